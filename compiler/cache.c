@@ -0,0 +1,366 @@
+#include "main.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Seconds an entry is reused without touching it again, the precision of the least recently used order
+#define CODE_CACHE_TOUCH_INTERVAL 60
+
+/**
+Code cache (-fcode-cache=dir): the assembly of each function, reused while the function is unchanged.
+
+A function is keyed by the hash of its type checked AST, which covers its tokens together with what they
+resolve to: the types and the offsets of the variables and the struct members, the global variables and
+the functions called, and the string literals. The compiler executable is hashed into the key as well.
+Each entry is a file "<key>.s" in the directory:
+
+    # <function name> <key>
+    <assembly of the function>
+
+The labels and the string literal labels in the assembly are numbered from 0 in the entry,
+and renumbered from the first ones of the function when reused.
+Entries are written to a temporary file and renamed, so that parallel compilations sharing the directory
+never read a partial entry. Reusing an entry touches its modification time, and the least recently used
+entries are removed when the directory exceeds the size limit (-fcode-cache-size).
+*/
+
+// Directory of the code cache (-fcode-cache=dir), NULL if disabled
+char *code_cache;
+// Size limit of the code cache in KB (-fcode-cache-size=N)
+long code_cache_size = DEFAULT_CODE_CACHE_SIZE;
+
+// Statistics for -ftime-report
+int code_cache_hits;
+int code_cache_misses;
+int code_cache_evictions;
+
+// Guards the statistics and the temporary file numbering, shared by the codegen threads
+pthread_mutex_t code_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+// Number of the next temporary file
+int code_cache_temp_count;
+
+// Hash of the compiler executable, 0 until computed
+unsigned long compiler_hash;
+
+// mix mixes the given value into the hash, faster than hash_value() as every node of the function is hashed.
+unsigned long mix(unsigned long hash, unsigned long value) {
+    hash = (hash ^ value) * 0x9e3779b97f4a7c15UL;
+    return hash ^ (hash >> 29);
+}
+
+// mix_string mixes the given string into the hash.
+unsigned long mix_string(unsigned long hash, char *str, int len) {
+    return mix(hash, hash_bytes(str, len));
+}
+
+// hash_type mixes the layout of the given type into the hash, following the pointers up to the given depth.
+unsigned long hash_type(unsigned long hash, Type *ty, int depth) {
+    if (!ty) {
+        return mix(hash, -1);
+    }
+    hash = mix(hash, ty->ty);
+    hash = mix(hash, ty->size);
+    hash = mix(hash, ty->align);
+    hash = mix(hash, ty->array_size);
+    if (depth == 0) return hash;
+    if (ty->ty == STRUCT) {
+        for (int i = 0; i < vector_count(ty->params); i++) {
+            DefinedType *member = (DefinedType*) vector_get(ty->params, i);
+            hash = mix(hash, member->offset);
+            hash = hash_type(hash, member->ty, depth - 1);
+        }
+        return hash;
+    }
+    if (ty->ty == FUNC) {
+        hash = mix(hash, ty->variadic);
+        for (int i = 0; i < vector_count(ty->params); i++) {
+            hash = hash_type(hash, (Type*) vector_get(ty->params, i), depth - 1);
+        }
+    }
+    return hash_type(hash, ty->ptr_to, depth - 1);
+}
+
+// hash_node mixes the given subtree of the given function into the hash, in pre-order.
+unsigned long hash_node(unsigned long hash, Function *fn, Node *node) {
+    if (node == NULL) {
+        return mix(hash, -1);
+    }
+    nodes_visited++;
+    hash = mix(hash, node->kind);
+    hash = hash_type(hash, node->type, 3);
+
+    switch (node->kind) {
+    case ND_IF:
+    case ND_COND:
+    case ND_WHILE:
+    case ND_FOR:
+    case ND_LAND:
+    case ND_LOR:
+        hash = mix(hash, node->label - fn->first_label);
+        break;
+    case ND_STRING:
+        hash = mix(hash, node->label - fn->first_string);
+        return mix_string(hash, node->str, node->len);
+    case ND_NUM:
+    case ND_CHAR:
+        return mix(hash, node->val);
+    case ND_GLOBAL_VAR:
+    case ND_FUNC_CALL:
+        hash = mix_string(hash, node->atom->name, node->atom->len);
+        // offset or the number of the arguments
+        hash = mix(hash, node->offset);
+        if (node->kind == ND_FUNC_CALL) {
+            Function *callee = (Function*) map_get(function_map, node->atom);
+            hash = hash_type(hash, callee ? callee->type : NULL, 3);
+        }
+        break;
+    case ND_LOCAL_VAR:
+    case ND_BLOCK:
+    case ND_ARRAY:
+        // offset or the number of the items
+        hash = mix(hash, node->offset);
+        break;
+    }
+
+    int arity = node_arity(node->kind);
+    if (arity > 0) hash = hash_node(hash, fn, node->left);
+    if (arity > 1) hash = hash_node(hash, fn, node->right);
+    if (arity > 2) hash = hash_node(hash, fn, node->third);
+    if (arity > 3) hash = hash_node(hash, fn, node->fourth);
+    if (has_items(node->kind)) {
+        for (int i = 0; i < node->count; i++) {
+            hash = hash_node(hash, fn, node->items[i]);
+        }
+    }
+    return hash;
+}
+
+// hash_compiler returns the hash of the running compiler executable, so that a new compiler never reuses
+// the code generated by the old one.
+unsigned long hash_compiler() {
+    pthread_mutex_lock(&code_cache_lock);
+    if (!compiler_hash) {
+        FILE *fp = fopen("/proc/self/exe", "r");
+        if (!fp) {
+            error("cannot read the compiler executable: %s", strerror(errno));
+        }
+        compiler_hash = 14695981039346656037UL;
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+            compiler_hash = mix_string(compiler_hash, buf, n);
+        }
+        fclose(fp);
+    }
+    pthread_mutex_unlock(&code_cache_lock);
+    return compiler_hash;
+}
+
+// function_key returns the key of the given type checked function in the code cache.
+unsigned long function_key(Function *fn) {
+    unsigned long hash = hash_compiler();
+    hash = mix_string(hash, fn->name, fn->len);
+    hash = hash_type(hash, fn->type, 3);
+    hash = mix(hash, fn->locals_size);
+    for (int i = 0; i < vector_count(fn->params); i++) {
+        hash = hash_node(hash, fn, (Node*) vector_get(fn->params, i));
+    }
+    return hash_node(hash, fn, fn->body);
+}
+
+// renumber_labels writes out the given assembly to fp, adding label_delta to the numbers of the labels
+// and string_delta to the numbers of the string literal labels (".LC").
+void renumber_labels(FILE *fp, char *text, size_t size, long label_delta, long string_delta) {
+    char *end = text + size;
+    char *p = text;
+    while (p < end) {
+        char *label = memchr(p, '.', end - p);
+        if (!label) break;
+        if (label + 1 == end || label[1] != 'L') {
+            fwrite(p, 1, label + 1 - p, fp);
+            p = label + 1;
+            continue;
+        }
+        char *q = label + 2;
+        while (q < end && ('a' <= *q && *q <= 'z' || 'A' <= *q && *q <= 'Z')) q++;
+        if (q == end || *q < '0' || '9' < *q) {
+            // not a numbered label, e.g. ".Lprof.main"
+            fwrite(p, 1, q - p, fp);
+            p = q;
+            continue;
+        }
+        long number = 0;
+        char *digits = q;
+        while (q < end && '0' <= *q && *q <= '9') {
+            number = number * 10 + (*q++ - '0');
+        }
+        bool string = digits - label == 3 && label[2] == 'C';
+        number += string ? string_delta : label_delta;
+        // digits from the end of the buffer
+        char buf[24];
+        char *n = buf + sizeof(buf);
+        do {
+            *--n = '0' + number % 10;
+            number /= 10;
+        } while (number > 0);
+        fwrite(p, 1, digits - p, fp);
+        fwrite(n, 1, buf + sizeof(buf) - n, fp);
+        p = q;
+    }
+    fwrite(p, 1, end - p, fp);
+}
+
+// entry_path writes the path of the entry of the given key to the buffer of PATH_MAX bytes.
+// The codegen threads do not allocate from the shared arena.
+char *entry_path(char *buf, unsigned long key) {
+    snprintf(buf, PATH_MAX, "%s/%016lx.s", code_cache, key);
+    return buf;
+}
+
+// gen_cached_function writes out the cached assembly of the given function to the output if any, and touches the entry.
+// Returns true if found.
+bool gen_cached_function(Function *fn, unsigned long key) {
+    char path[PATH_MAX];
+    int fd = open(entry_path(path, key), O_RDONLY);
+    struct stat st;
+    char *text = NULL;
+    if (fd >= 0 && fstat(fd, &st) == 0 && (text = malloc(st.st_size + 1))) {
+        if (read(fd, text, st.st_size) != st.st_size) {
+            free(text);
+            text = NULL;
+        }
+        // the least recently used entries are removed first; touched at most once in a while
+        // not to write the file system on every compilation
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (now.tv_sec - st.st_mtim.tv_sec >= CODE_CACHE_TOUCH_INTERVAL) {
+            futimens(fd, NULL);
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    // the first line names the function, not to be fooled by a collision of the keys
+    char header[PATH_MAX];
+    int header_len = snprintf(header, sizeof(header), "# %.*s %016lx\n", fn->len, fn->name, key);
+    bool found = text && st.st_size >= header_len && memcmp(text, header, header_len) == 0;
+    if (found) {
+        renumber_labels(output, text + header_len, st.st_size - header_len, fn->first_label, fn->first_string);
+    }
+    free(text);
+
+    pthread_mutex_lock(&code_cache_lock);
+    if (found) {
+        code_cache_hits++;
+    } else {
+        code_cache_misses++;
+    }
+    pthread_mutex_unlock(&code_cache_lock);
+    return found;
+}
+
+// store_cached_function stores the generated assembly of the given function into the code cache.
+// Failures are ignored, as the cache is only an optimization.
+void store_cached_function(Function *fn, unsigned long key, char *text, size_t size) {
+    pthread_mutex_lock(&code_cache_lock);
+    int temp_count = code_cache_temp_count++;
+    pthread_mutex_unlock(&code_cache_lock);
+
+    // written to a file of its own, and renamed to appear complete at once
+    char temp_path[PATH_MAX];
+    char path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s/%016lx.%d.%d.tmp", code_cache, key, getpid(), temp_count);
+    FILE *fp = fopen(temp_path, "w");
+    if (!fp) return;
+    fprintf(fp, "# %.*s %016lx\n", fn->len, fn->name, key);
+    renumber_labels(fp, text, size, -fn->first_label, -fn->first_string);
+    if (fclose(fp) != 0 || rename(temp_path, entry_path(path, key)) != 0) {
+        unlink(temp_path);
+    }
+}
+
+// Entry of the code cache directory, for trimming
+typedef struct CacheEntry {
+    char *path;
+    long size;
+    struct timespec used;
+} CacheEntry;
+
+// compare_cache_entry orders CacheEntry by the last use, the oldest first.
+int compare_cache_entry(const void *a, const void *b) {
+    struct timespec first = ((CacheEntry*) a)->used;
+    struct timespec second = ((CacheEntry*) b)->used;
+    if (first.tv_sec != second.tv_sec) {
+        return first.tv_sec < second.tv_sec ? -1 : 1;
+    }
+    return first.tv_nsec < second.tv_nsec ? -1 : first.tv_nsec > second.tv_nsec;
+}
+
+// trim_code_cache removes the least recently used entries while the code cache exceeds its size limit.
+// Skipped if another compiler is trimming it at the same time.
+void trim_code_cache() {
+    if (!code_cache || code_cache_misses == 0) return;
+    int lock = open(format("%s/lock", code_cache), O_RDWR | O_CREAT, 0666);
+    if (lock < 0) return;
+    if (flock(lock, LOCK_EX | LOCK_NB) != 0) {
+        close(lock);
+        return;
+    }
+
+    DIR *dir = opendir(code_cache);
+    Vector *entries = new_vector();
+    long total = 0;
+    struct dirent *ent;
+    while (dir && (ent = readdir(dir))) {
+        int len = strlen(ent->d_name);
+        if (len < 2 || strcmp(ent->d_name + len - 2, ".s") != 0) continue;
+        CacheEntry *entry = allocate(sizeof(CacheEntry));
+        entry->path = format("%s/%s", code_cache, ent->d_name);
+        struct stat st;
+        if (stat(entry->path, &st) != 0) continue;
+        entry->size = st.st_size;
+        entry->used = st.st_mtim;
+        total += entry->size;
+        vector_add(entries, entry);
+    }
+    if (dir) closedir(dir);
+
+    long limit = code_cache_size * 1024;
+    if (total > limit) {
+        int count = vector_count(entries);
+        CacheEntry *sorted = malloc(sizeof(CacheEntry) * count);
+        for (int i = 0; i < count; i++) {
+            sorted[i] = *(CacheEntry*) vector_get(entries, i);
+        }
+        qsort(sorted, count, sizeof(CacheEntry), compare_cache_entry);
+        // down to 90% of the limit, not to trim again on the next miss
+        for (int i = 0; i < count && total > limit / 10 * 9; i++) {
+            if (unlink(sorted[i].path) == 0) {
+                code_cache_evictions++;
+            }
+            total -= sorted[i].size;
+        }
+        free(sorted);
+    }
+    flock(lock, LOCK_UN);
+    close(lock);
+}
+
+// init_code_cache makes the directory of the code cache if it does not exist.
+void init_code_cache() {
+    if (!code_cache) return;
+    if (mkdir(code_cache, 0777) != 0 && errno != EEXIST) {
+        error("cannot make the code cache %s: %s", code_cache, strerror(errno));
+    }
+}
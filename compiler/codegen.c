@@ -1,6 +1,14 @@
 #include "main.h"
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Functions a codegen thread may generate ahead of the output, per thread, to bound the buffered output
+#define CODEGEN_WINDOW_PER_THREAD 4
 
 // register names
 char arguments[6][4] = {
@@ -13,6 +21,9 @@ char arguments_8[6][4] = {
     "dil", "sil", "dl", "cl", "r8b", "r9b",
 };
 
+// Output of the current thread: stdout, or the buffer of the function on a codegen thread
+_Thread_local FILE *output;
+
 void gen_tree();
 
 // gen_lvalue evaluates the next lvalue (prints error and exists if not), and pushes the address to the stack.
@@ -20,13 +31,13 @@ void gen_lvalue(Node *node) {
     switch(node->kind) {
     case ND_LOCAL_VAR:
         // calculate the variable address
-        printf("        mov rax, rbp\n");
-        printf("        sub rax, %d\n", node->offset);
-        printf("        push rax\n");
+        emit("        mov rax, rbp\n");
+        emit("        sub rax, %d\n", node->offset);
+        emit("        push rax\n");
         return;
     case ND_GLOBAL_VAR:
-        printf("        lea rax, %.*s[rip]\n", node->len, node->str);
-        printf("        push rax\n");
+        emit("        lea rax, %s[rip]\n", node->atom->name);
+        emit("        push rax\n");
         return;
     case ND_DEREF:
         // assigning to de-referenced values, e.g. *p = 5;
@@ -42,15 +53,15 @@ void gen_lvalue(Node *node) {
 void load_from_rax_to_rax(size_t size) {
     switch (size) {
     case 1:
-        printf("        movsx eax, BYTE PTR [rax]\n");
+        emit("        movsx eax, BYTE PTR [rax]\n");
         break;
     case 4:
         // sign extension from double word [rax] to quad word rax
         // since the arithmetic operations are based on 64-bit
-        printf("        movsxd rax, DWORD PTR [rax]\n");
+        emit("        movsxd rax, DWORD PTR [rax]\n");
         break;
     default:
-        printf("        mov rax, [rax]\n");
+        emit("        mov rax, [rax]\n");
         break;
     }
 }
@@ -58,7 +69,7 @@ void load_from_rax_to_rax(size_t size) {
 // multiply_ptr_value multiplies "rdi" register by the type that pointers point to, if the given node represents a pointer.
 // e.g. if the node represents a local variable of type int *, then multiply "rdi" by 4.
 void multiply_ptr_value(Node *node) {
-    Type *type = type_of(node);
+    Type *type = node->type;
     // HACK: ignore pointer to a struct?
     if ((type->ty == PTR && type->ptr_to->ty == STRUCT)) return;
     // left value is a pointer
@@ -66,14 +77,14 @@ void multiply_ptr_value(Node *node) {
         // which type this pointer points to / this array is composed of
         size_t ptr_to_size = size_of(type->ptr_to);
         if (ptr_to_size == 1) return;
-        printf("        imul rdi, %ld\n", ptr_to_size);
+        emit("        imul rdi, %ld\n", ptr_to_size);
     }
 }
 
 void _gen_tree(Node *node);
 
 // Current gen_tree call stack: elt: Node*
-Vector *gen_tree_stack;
+_Thread_local Vector *gen_tree_stack;
 
 // get_last_loop searches the gen_tree_stack (call stack of gen_tree), and returns the last loop node it found.
 // Returns NULL otherwise.
@@ -89,8 +100,153 @@ Node *get_last_loop() {
     return NULL;
 }
 
+// ColdBlock is the rarely executed "then" arm of an "if" statement, placed after the function epilogue
+// so that it doesn't break up the hot path.
+typedef struct ColdBlock {
+    // the "if" statement
+    Node *node;
+    // innermost loop around the statement, for "break;" and "continue;"
+    Node *loop;
+    // label sequence of the original "if" statement
+    int label;
+} ColdBlock;
+
+// Cold blocks of the current function, elt: ColdBlock*
+_Thread_local Vector *cold_blocks;
+
+// Section of the current function
+_Thread_local char *text_section;
+
+// Generate each function as soon as it is parsed, and release it (-fstreaming)
+bool streaming;
+
+// Profiles of the instrumented functions, elements: FunctionProfile*
+Vector *instrumented;
+
+// Number of threads to optimize and generate the functions on (-fthreads=N), 0 for the number of the cores
+int codegen_threads = 1;
+
+// is_cold guesses if the given statement is rarely executed, i.e. it leaves the loop or the function.
+bool is_cold(Node *node) {
+    while (node->kind == ND_BLOCK) {
+        if (node->count == 0) return false;
+        node = node->items[node->count - 1];
+    }
+    switch (node->kind) {
+    case ND_RETURN:
+    case ND_BREAK:
+        return true;
+    case ND_FUNC_CALL:
+        return strcmp(node->atom->name, "exit") == 0 || strcmp(node->atom->name, "abort") == 0;
+    default:
+        return false;
+    }
+}
+
+// defer_cold_block reserves the "then" arm of the given "if" statement to be generated at .Lcold{label}
+// after the function epilogue. The cold block jumps back to .Lend{label} when finished.
+void defer_cold_block(Node *node) {
+    ColdBlock *block = allocate(sizeof(ColdBlock));
+    block->node = node;
+    block->loop = get_last_loop();
+    vector_add(cold_blocks, block);
+}
+
+// gen_cold_blocks generates the cold blocks of the current function.
+// The blocks never executed in the profile are split out of the function into .text.unlikely,
+// and the rest stay after the epilogue in the section of the function.
+void gen_cold_blocks() {
+    bool unlikely = false;
+    // a cold block could defer another one, so do not cache the count
+    for (int i = 0; i < vector_count(cold_blocks); i++) {
+        ColdBlock *block = (ColdBlock*) vector_get(cold_blocks, i);
+        // a function never executed is already in .text.unlikely as a whole
+        bool split = profile_count(0) > 0 && profile_count(block->node->counter + 1) == 0;
+        if (split != unlikely) {
+            emit("        %s\n", split ? ".section .text.unlikely,\"ax\",@progbits" : text_section);
+            unlikely = split;
+        }
+        emit(".Lcold%d:\n", block->node->label);
+        gen_profile_counter(block->node->counter + 1);
+        if (block->loop) {
+            vector_add(gen_tree_stack, block->loop);
+        }
+        gen_tree(block->node->right);
+        emit("        pop rax\n");
+        emit("        jmp .Lend%d\n", block->node->label);
+        if (block->loop) {
+            vector_delete(gen_tree_stack, vector_count(gen_tree_stack) - 1);
+        }
+    }
+    if (unlikely) {
+        emit("        %s\n", text_section);
+    }
+}
+
+// has_labels returns true if generating the given expression defines any labels,
+// in which case the expression cannot be generated twice.
+bool has_labels(Node *node) {
+    if (node == NULL) return false;
+    switch (node->kind) {
+    case ND_LAND:
+    case ND_LOR:
+    case ND_COND:
+        return true;
+    case ND_FUNC_CALL:
+        for (int i = 0; i < node->count; i++) {
+            if (has_labels(node->items[i])) return true;
+        }
+        return false;
+    default: ;
+        int arity = node_arity(node->kind);
+        return (arity > 0 && has_labels(node->left)) || (arity > 1 && has_labels(node->right))
+            || (arity > 2 && has_labels(node->third));
+    }
+}
+
+// gen_loop_guard generates the test before entering a rotated loop, jumping to .Lend{end_label} if false.
+// If the condition cannot be duplicated, jumps to the bottom test at .Ltest{test_label} instead.
+// cond may be NULL if the loop has no condition.
+void gen_loop_guard(Node *cond, int end_label, int test_label) {
+    if (cond == NULL || (cond->kind == ND_NUM && cond->val != 0)) return;
+    if (has_labels(cond)) {
+        emit("        jmp .Ltest%d\n", test_label);
+        return;
+    }
+    gen_tree(cond);
+    emit("        pop rax\n");
+    emit("        cmp rax, 0\n");
+    emit("        je .Lend%d\n", end_label);
+}
+
+// gen_loop_header generates the aligned loop header .Lbegin{label} of the given loop node.
+void gen_loop_header(Node *node) {
+    // pad to 16 bytes, unless it takes more than 10 bytes
+    // not worth it if the profile says the loop never iterates
+    if (profile_count(node->counter + 1) != 0) {
+        emit("        .p2align 4,,10\n");
+    }
+    emit(".Lbegin%d:\n", node->label);
+    gen_profile_counter(node->counter + 1);
+}
+
+// gen_loop_latch generates the bottom test .Ltest{test_label} of a rotated loop, jumping back to .Lbegin{label} if true.
+// cond may be NULL if the loop has no condition.
+void gen_loop_latch(Node *cond, int label, int test_label) {
+    emit(".Ltest%d:\n", test_label);
+    if (cond == NULL || (cond->kind == ND_NUM && cond->val != 0)) {
+        emit("        jmp .Lbegin%d\n", label);
+        return;
+    }
+    gen_tree(cond);
+    emit("        pop rax\n");
+    emit("        cmp rax, 0\n");
+    emit("        jne .Lbegin%d\n", label);
+}
+
 // separating actual implementation for defer; to search current call stack for "break;" and "continue;"
 void gen_tree(Node *node) {
+    nodes_visited++;
     int count = vector_count(gen_tree_stack);
     vector_add(gen_tree_stack, node);
     _gen_tree(node);
@@ -101,19 +257,19 @@ void gen_tree(Node *node) {
 void _gen_tree(Node *node) {
     switch (node->kind) {
     case ND_NUM:
-        if (size_of(type_of(node)) == 8) {
-            printf("        mov rax, %ld\n", node->val);
-            printf("        push rax\n");
+        if (size_of(node->type) == 8) {
+            emit("        mov rax, %ld\n", node->val);
+            emit("        push rax\n");
         } else {
-            printf("        push %d\n", (int) node->val);
+            emit("        push %d\n", (int) node->val);
         }
         return;
     case ND_CHAR:
-        printf("        push %d\n", (char) node->val);
+        emit("        push %d\n", (char) node->val);
         return;
     case ND_STRING:
-        printf("        lea rax, .LC%d[rip]\n", node->label);
-        printf("        push rax\n");
+        emit("        lea rax, .LC%d[rip]\n", node->label);
+        emit("        push rax\n");
         return;
     case ND_LOCAL_VAR:
     case ND_GLOBAL_VAR:
@@ -126,40 +282,40 @@ void _gen_tree(Node *node) {
             return;
         }
 
-        printf("        pop rax\n");
+        emit("        pop rax\n");
         // Load value in the address considering the value size
         load_from_rax_to_rax(size_of(node->type));
-        printf("        push rax\n");
+        emit("        push rax\n");
         return;
     case ND_ASSIGN:
         gen_lvalue(node->left);
         gen_tree(node->right);
 
-        printf("        pop rdi\n");
-        printf("        pop rax\n");
+        emit("        pop rdi\n");
+        emit("        pop rax\n");
         // Assign value to the address considering the value size
-        switch (size_of(type_of(node->left))) {
+        switch (size_of(node->left->type)) {
         case 1:
-            printf("        mov [rax], dil\n");
+            emit("        mov [rax], dil\n");
             break;
         case 4:
-            printf("        mov [rax], edi\n");
+            emit("        mov [rax], edi\n");
             break;
         default:
-            printf("        mov [rax], rdi\n");
+            emit("        mov [rax], rdi\n");
             break;
         }
-        printf("        push rdi\n");
+        emit("        push rdi\n");
         return;
     case ND_RETURN:
         gen_tree(node->left);
 
         // Pop the result to rax
-        printf("        pop rax\n");
+        emit("        pop rax\n");
         // Function epilogue
-        printf("        mov rsp, rbp\n");
-        printf("        pop rbp\n");
-        printf("        ret\n");
+        emit("        mov rsp, rbp\n");
+        emit("        pop rbp\n");
+        emit("        ret\n");
         return;
     case ND_ADDR:
         gen_lvalue(node->left);
@@ -167,267 +323,280 @@ void _gen_tree(Node *node) {
     case ND_DEREF:
         gen_tree(node->left);
 
-        printf("        pop rax\n");
+        emit("        pop rax\n");
         // Load value in the address considering the value size
-        Type *ty = type_of(node->left);
+        Type *ty = node->left->type;
         // If the dereference is to an array, implicitly convert it to a pointer
         if (ty->ty == PTR || ty->ty == ARRAY) {
             ty = ty->ptr_to;
         }
         // HACK: ignore pointer to struct
         if (ty->ty == STRUCT) {
-            printf("        push rax\n");
+            emit("        push rax\n");
             return;
         }
         // load from address only if this is not multi-dimensional array, which is linearly on stack
         if (ty->ty != ARRAY) {
             load_from_rax_to_rax(size_of(ty));
         }
-        printf("        push rax\n");
+        emit("        push rax\n");
         return;
     case ND_LAND:
         gen_tree(node->left);
-        printf("        pop rax\n");
-        printf("        cmp rax, 0\n");
+        emit("        pop rax\n");
+        emit("        cmp rax, 0\n");
         // Minimal evaluation
-        printf("        je .Lend%d\n", node->label);
+        emit("        je .Lend%d\n", node->label);
 
         gen_tree(node->right);
-        printf("        pop rax\n");
-        printf("        cmp rax, 0\n");
-        printf("        je .Lend%d\n", node->label);
-
-        printf(".Lend%d:\n", node->label);
-        printf("        setne al\n");
-        printf("        movzb rax, al\n");
-        printf("        push rax\n");
+        emit("        pop rax\n");
+        emit("        cmp rax, 0\n");
+        emit("        je .Lend%d\n", node->label);
+
+        emit(".Lend%d:\n", node->label);
+        emit("        setne al\n");
+        emit("        movzb rax, al\n");
+        emit("        push rax\n");
         return;
     case ND_LOR:
         gen_tree(node->left);
-        printf("        pop rax\n");
-        printf("        cmp rax, 0\n");
+        emit("        pop rax\n");
+        emit("        cmp rax, 0\n");
         // Minimal evaluation
-        printf("        jne .Lend%d\n", node->label);
+        emit("        jne .Lend%d\n", node->label);
 
         gen_tree(node->right);
-        printf("        pop rax\n");
-        printf("        cmp rax, 0\n");
-        printf("        jne .Lend%d\n", node->label);
-
-        printf(".Lend%d:\n", node->label);
-        printf("        setne al\n");
-        printf("        movzb rax, al\n");
-        printf("        push rax\n");
+        emit("        pop rax\n");
+        emit("        cmp rax, 0\n");
+        emit("        jne .Lend%d\n", node->label);
+
+        emit(".Lend%d:\n", node->label);
+        emit("        setne al\n");
+        emit("        movzb rax, al\n");
+        emit("        push rax\n");
         return;
     case ND_LNOT:
         gen_tree(node->left);
-        printf("        pop rax\n");
-        printf("        cmp rax, 0\n");
+        emit("        pop rax\n");
+        emit("        cmp rax, 0\n");
         // If equals to 0, set 1, otherwise, set 0
-        printf("        cmp rax, 0\n");
-        printf("        sete al\n");
-        printf("        movzb rax, al\n");
-        printf("        push rax\n");
+        emit("        cmp rax, 0\n");
+        emit("        sete al\n");
+        emit("        movzb rax, al\n");
+        emit("        push rax\n");
+        return;
+    case ND_COND:
+        gen_profile_counter(node->counter);
+        gen_tree(node->left);
+        emit("        pop rax\n");
+        emit("        cmp rax, 0\n");
+        emit("        je .Lelse%d\n", node->label + 1);
+        gen_profile_counter(node->counter + 1);
+        gen_tree(node->right);
+        emit("        jmp .Lend%d\n", node->label);
+        emit(".Lelse%d:\n", node->label + 1);
+        gen_tree(node->third);
+        emit(".Lend%d:\n", node->label);
+        return;
+    case ND_SELECT:
+        gen_tree(node->left);
+        // "c ? 1 : 0" and "c ? 0 : 1" need only setcc
+        if (node->right->kind == ND_NUM && node->third->kind == ND_NUM
+            && ((node->right->val == 1 && node->third->val == 0) || (node->right->val == 0 && node->third->val == 1))) {
+            emit("        pop rax\n");
+            emit("        cmp rax, 0\n");
+            emit("        %s al\n", node->right->val == 1 ? "setne" : "sete");
+            emit("        movzb rax, al\n");
+            emit("        push rax\n");
+            return;
+        }
+        // evaluate both arms, and select one without branching
+        gen_tree(node->right);
+        gen_tree(node->third);
+        emit("        pop rdi\n");
+        emit("        pop rax\n");
+        emit("        pop rcx\n");
+        emit("        cmp rcx, 0\n");
+        // If the condition is 0 (false), take the "else" value
+        emit("        cmove rax, rdi\n");
+        emit("        push rax\n");
         return;
     case ND_IF:
+        gen_profile_counter(node->counter);
         gen_tree(node->left);
 
-        printf("        pop rax\n");
-        printf("        cmp rax, 0\n");
+        emit("        pop rax\n");
+        emit("        cmp rax, 0\n");
+        // Use the profile to see which arm is more likely, or guess it
+        int probability = branch_probability(node);
+        if (!node->third && (probability >= 0 ? probability <= 5 : is_cold(node->right) && get_last_loop())) {
+            // Early exit from a loop is rarely taken, so move it out of line and let the loop body fall through
+            emit("        jne .Lcold%d\n", node->label);
+            defer_cold_block(node);
+            emit(".Lend%d:\n", node->label);
+            emit("        push 0\n");
+            return;
+        }
+        if (node->third && (probability >= 0 ? probability < 50 : is_cold(node->right) && !is_cold(node->third))) {
+            // "then" block is less likely taken, so move it out of line and let the "else" block fall through
+            emit("        jne .Lcold%d\n", node->label);
+            defer_cold_block(node);
+            gen_tree(node->third);
+            emit("        pop rax\n");
+            emit(".Lend%d:\n", node->label);
+            emit("        push 0\n");
+            return;
+        }
         // If the evaluated condition is 0 (false),
         if (node->third) {
             // Jump to "else" block
-            printf("        je .Lelse%d\n", node->label + 1);
+            emit("        je .Lelse%d\n", node->label + 1);
         } else {
             // No "else" block, so jump to outside of the "if" statement
-            printf("        je .Lend%d\n", node->label);
+            emit("        je .Lend%d\n", node->label);
         }
         // otherwise, evaluate inside "if"
+        gen_profile_counter(node->counter + 1);
         gen_tree(node->right);
         // pop the result so it doesn't stay on stack
-        printf("        pop rax\n");
+        emit("        pop rax\n");
         if (node->third) {
             // and go to end (if else block exists)
-            printf("        jmp .Lend%d\n", node->label);
+            emit("        jmp .Lend%d\n", node->label);
             // generate "else" block
-            printf(".Lelse%d:\n", node->label + 1);
+            emit(".Lelse%d:\n", node->label + 1);
             gen_tree(node->third);
             // pop the result so it doesn't stay on stack
-            printf("        pop rax\n");
+            emit("        pop rax\n");
         }
         // end block (next code block)
-        printf(".Lend%d:\n", node->label);
+        emit(".Lend%d:\n", node->label);
         // leave something on stack (gen func expects each gen_tree to generate a value)
-        printf("        push 0\n");
+        emit("        push 0\n");
         return;
     case ND_WHILE:
-        printf(".Lbegin%d:\n", node->label);
+        // Rotated loop: the condition is tested once before entering the loop,
+        // and then at the bottom of the loop, so each iteration executes a single branch.
+        gen_profile_counter(node->counter);
+        gen_loop_guard(node->left, node->label + 1, node->label + 3);
 
-        gen_tree(node->left);
-        printf("        pop rax\n");
-        printf("        cmp rax, 0\n");
-        // If the evaluated condition is false, break the loop
-        printf("        je .Lend%d\n", node->label + 1);
-        // otherwise, evaluate inside "while"
+        gen_loop_header(node);
         gen_tree(node->right);
         // pop the result so it doesn't stay on stack
-        printf("        pop rax\n");
-        // then return back to the beginning
-        printf("        jmp .Lbegin%d\n", node->label);
+        emit("        pop rax\n");
+
+        // on continue
+        emit(".Lcont%d:\n", node->label + 2);
+        gen_loop_latch(node->left, node->label, node->label + 3);
 
         // end block (next code block)
-        printf(".Lend%d:\n", node->label + 1);
+        emit(".Lend%d:\n", node->label + 1);
         // leave something on stack (gen func expects each gen_tree to generate a value)
-        printf("        push 0\n");
+        emit("        push 0\n");
         return;
     case ND_FOR:
         // init
         if (node->left) {
             gen_tree(node->left);
             // pop the result so it doesn't stay on stack
-            printf("        pop rax\n");
+            emit("        pop rax\n");
         }
+        // Rotated loop, same as "while"
+        gen_profile_counter(node->counter);
+        gen_loop_guard(node->right, node->label + 1, node->label + 3);
+
         // "for" block
-        printf(".Lbegin%d:\n", node->label);
-        if (node->right) {
-            gen_tree(node->right);
-        } else {
-            printf("        push 1\n");
-        }
-        printf("        pop rax\n");
-        printf("        cmp rax, 0\n");
-        // If the evaluated condition is false, break the loop
-        printf("        je .Lend%d\n", node->label + 1);
-        // otherwise, evaluate inside "for"
+        gen_loop_header(node);
         gen_tree(node->fourth);
         // pop the result so it doesn't stay on stack
-        printf("        pop rax\n");
+        emit("        pop rax\n");
+
         // on continue
-        printf(".Lcont%d:\n", node->label + 2);
+        emit(".Lcont%d:\n", node->label + 2);
         if (node->third) {
             gen_tree(node->third);
             // pop the result so it doesn't stay on stack
-            printf("        pop rax\n");
+            emit("        pop rax\n");
         }
-        // then return back to the beginning
-        printf("        jmp .Lbegin%d\n", node->label);
+        gen_loop_latch(node->right, node->label, node->label + 3);
 
         // end block (next code block)
-        printf(".Lend%d:\n", node->label + 1);
+        emit(".Lend%d:\n", node->label + 1);
         // leave something on stack (gen func expects each gen_tree to generate a value)
-        printf("        push 0\n");
+        emit("        push 0\n");
         return;
     case ND_BREAK: ;
         Node *loop = get_last_loop();
         if (loop == NULL) {
-            error_at(node->str, "break outside of a loop");
+            error_at(node->loc, "break outside of a loop");
         }
         switch (loop->kind) {
         case ND_WHILE:
-            printf("        jmp .Lend%d\n", loop->label + 1);
+            emit("        jmp .Lend%d\n", loop->label + 1);
             break;
         case ND_FOR:
-            printf("        jmp .Lend%d\n", loop->label + 1);
+            emit("        jmp .Lend%d\n", loop->label + 1);
             break;
         default:
-            error_at(node->str, "unknown loop?");
+            error_at(node->loc, "unknown loop?");
         }
         return;
     case ND_CONTINUE:
         loop = get_last_loop();
         if (loop == NULL) {
-            error_at(node->str, "continue outside of a loop");
+            error_at(node->loc, "continue outside of a loop");
         }
         switch (loop->kind) {
         case ND_WHILE:
-            printf("        jmp .Lbegin%d\n", loop->label);
+            emit("        jmp .Lcont%d\n", loop->label + 2);
             break;
         case ND_FOR:
-            printf("        jmp .Lcont%d\n", loop->label + 2);
+            emit("        jmp .Lcont%d\n", loop->label + 2);
             break;
         default:
-            error_at(node->str, "unknown loop?");
+            error_at(node->loc, "unknown loop?");
         }
         return;
     case ND_BLOCK:
-        for (int i = 0; i < vector_count(node->arguments); i++) {
-            Node *next = (Node*) vector_get(node->arguments, i);
+        for (int i = 0; i < node->count; i++) {
+            Node *next = node->items[i];
             gen_tree(next);
             // pop the result so it doesn't stay on stack
-            printf("        pop rax\n");
+            emit("        pop rax\n");
         }
-        printf("        push rax\n");
+        emit("        push rax\n");
         return;
     case ND_FUNC_CALL: ;
         // Evaluate arguments
-        for (int i = 0; i < vector_count(node->arguments); i++) {
-            gen_tree((Node*) vector_get(node->arguments, i));
+        for (int i = 0; i < node->count; i++) {
+            gen_tree(node->items[i]);
         }
         // Pop evaluated result into registers, max of 6 results
-        for (int i = vector_count(node->arguments) - 1; i >= 0; i--) {
+        for (int i = node->count - 1; i >= 0; i--) {
             if (i < 6) {
-                printf("        pop %s\n", arguments[i]);
+                emit("        pop %s\n", arguments[i]);
             } else {
-                printf("        pop rax\n");
+                emit("        pop rax\n");
             }
         }
         // 16-byte align rsp
         // 1. push the original rsp two times (which pushes rsp by 16 bytes)
-        printf("        push rsp\n");
-        printf("        push [rsp]\n");
+        emit("        push rsp\n");
+        emit("        push [rsp]\n");
         // 2. 16-byte align rsp, possibly subtracting 8 bytes.
-        printf("        and rsp, -0x10\n");
+        emit("        and rsp, -0x10\n");
         // 3. Call function
-        printf("        call %.*s\n", node->len, node->str);
+        // A variadic function (or an undeclared one, which may be) takes the number of vector registers in al
+        Function *callee = (Function*) map_get(function_map, node->atom);
+        if (!callee || callee->type->variadic) {
+            emit("        mov eax, 0\n");
+        }
+        emit("        call %s\n", node->atom->name);
         // 4. bring back the original rsp, which is always at [rsp + 8]
-        printf("        add rsp, 8\n");
-        printf("        mov rsp, [rsp]\n");
+        emit("        add rsp, 8\n");
+        emit("        mov rsp, [rsp]\n");
         // push the result to stack
-        printf("        push rax\n");
-        return;
-    case ND_FUNC:
-        // Function name
-        printf("%.*s:\n", node->len, node->str);
-        // Function Prologue
-        printf("        push rbp\n");
-        printf("        mov rbp, rsp\n");
-        // allocate local variables
-        if (node->offset > 0) {
-            // 8-byte align
-            int offset = ((node->offset - 1) / 8 + 1) * 8;
-            printf("        sub rsp, %d\n", offset);
-        }
-
-        // Copy function arguments from registers to stack
-        for (int i = 0; i < vector_count(node->arguments); i++) {
-            // evaluate address of the local variable in stack
-            Node *arg = (Node*) vector_get(node->arguments, i);
-            gen_lvalue(arg);
-            printf("        pop rax\n");
-            // support up to 6 arguments to load from registers
-            if (i < 6) {
-                // check the argument size in bytes
-                switch (size_of(arg->type)) {
-                case 1:
-                    printf("        mov [rax], %s\n", arguments_8[i]);
-                    break;
-                case 4:
-                    printf("        mov [rax], %s\n", arguments_32[i]);
-                    break;
-                default:
-                    printf("        mov [rax], %s\n", arguments[i]);
-                }
-            }
-        }
-
-        // Function body
-        gen_tree(node->left);
-        printf("        pop rax\n");
-
-        // Function Epilogue
-        printf("        mov rsp, rbp\n");
-        printf("        pop rbp\n");
-        printf("        ret\n");
+        emit("        push rax\n");
         return;
     case ND_ARRAY:
         error("got node array\n");
@@ -438,70 +607,70 @@ void _gen_tree(Node *node) {
     gen_tree(node->right);
 
     // Pop the first result into rax and the second result into rax.
-    printf("        pop rdi\n");
-    printf("        pop rax\n");
+    emit("        pop rdi\n");
+    emit("        pop rax\n");
 
     // Perform the operation
     switch (node->kind) {
     // Basic arithmetic operations
     case ND_ADD:
         multiply_ptr_value(node->left);
-        printf("        add rax, rdi\n");
+        emit("        add rax, rdi\n");
         break;
     case ND_SUB:
         multiply_ptr_value(node->left);
-        printf("        sub rax, rdi\n");
+        emit("        sub rax, rdi\n");
         break;
     case ND_MUL:
-        printf("        imul rax, rdi\n");
+        emit("        imul rax, rdi\n");
         break;
     case ND_DIV:
         // cqo expands 64-bit rax into 128-bit rdx, rax
-        printf("        cqo\n");
+        emit("        cqo\n");
         // idiv divides 128-bit rdx, rax by the 64-bit given register (rdi here),
         // and sets the quotient to rax and remainder to rdx.
-        printf("        idiv rdi\n");
+        emit("        idiv rdi\n");
         break;
     // Comparison operations
     case ND_EQUAL:
         // Compare
-        printf("        cmp rax, rdi\n");
+        emit("        cmp rax, rdi\n");
         // Set compare result to al (lower 8-bit of rax register)
-        printf("        sete al\n");
+        emit("        sete al\n");
         // Set rax register from al with zero-extension
-        printf("        movzb rax, al\n");
+        emit("        movzb rax, al\n");
         break;
     case ND_NOT_EQUAL:
-        printf("        cmp rax, rdi\n");
-        printf("        setne al\n");
-        printf("        movzb rax, al\n");
+        emit("        cmp rax, rdi\n");
+        emit("        setne al\n");
+        emit("        movzb rax, al\n");
         break;
     case ND_LESS:
-        printf("        cmp rax, rdi\n");
-        printf("        setl al\n");
-        printf("        movzb rax, al\n");
+        emit("        cmp rax, rdi\n");
+        emit("        setl al\n");
+        emit("        movzb rax, al\n");
         break;
     case ND_LESS_EQUAL:
-        printf("        cmp rax, rdi\n");
-        printf("        setle al\n");
-        printf("        movzb rax, al\n");
+        emit("        cmp rax, rdi\n");
+        emit("        setle al\n");
+        emit("        movzb rax, al\n");
         break;
     case ND_GREATER:
         // opposite of less equal
-        printf("        cmp rdi, rax\n");
-        printf("        setle al\n");
-        printf("        movzb rax, al\n");
+        emit("        cmp rdi, rax\n");
+        emit("        setle al\n");
+        emit("        movzb rax, al\n");
         break;
     case ND_GREATER_EQUAL:
         // opposite of less
-        printf("        cmp rdi, rax\n");
-        printf("        setl al\n");
-        printf("        movzb rax, al\n");
+        emit("        cmp rdi, rax\n");
+        emit("        setl al\n");
+        emit("        movzb rax, al\n");
         break;
     }
 
     // Push rax to the stack for the callee.
-    printf("        push rax\n");
+    emit("        push rax\n");
 }
 
 int max(int a, int b) {
@@ -519,53 +688,52 @@ void gen_global_node(Node *node, Type *ty) {
         // supposing the type is int, for now
         switch (size_of(ty)) {
         case 1:
-            printf("        .byte %d\n", (char) node->val);
+            emit("        .byte %d\n", (char) node->val);
             break;
         case 2:
-            printf("        .short %d\n", (short) node->val);
+            emit("        .short %d\n", (short) node->val);
             break;
         case 4:
-            printf("        .long %d\n", (int) node->val);
+            emit("        .long %d\n", (int) node->val);
             break;
         case 8:
-            printf("        .quad %ld\n", node->val);
+            emit("        .quad %ld\n", node->val);
             break;
         default:
-            error_at(node->str, "unsupported size: %d", size_of(ty));
+            error_at(node->loc, "unsupported size: %d", size_of(ty));
         }
         break;
     case ND_GLOBAL_VAR:
         // take address of the global var
-        printf("        .quad %.*s\n", node->len, node->str);
+        emit("        .quad %s\n", node->atom->name);
         break;
     case ND_STRING:
         // NOTE: does not support non-ascii characters for now
-        printf("        .string \"%.*s\"\n", node->len, node->str);
+        emit("        .string \"%.*s\"\n", node->len, node->str);
         // zero fill
         if (size_of(type_of(node)) < size_of(ty)) {
-            printf("        .zero %ld\n", size_of(ty) - (size_of(type_of(node))));
+            emit("        .zero %ld\n", size_of(ty) - (size_of(type_of(node))));
         }
         break;
     case ND_ADD:
         // expect node->left to be ND_GLOBAL_VAR
-        printf("        .quad %.*s+%ld\n", node->left->len, node->left->str, node->right->val);
+        emit("        .quad %s+%ld\n", node->left->atom->name, node->right->val);
         break;
     case ND_SUB:
         // expect node->left to be ND_GLOBAL_VAR
-        printf("        .quad %.*s+%ld\n", node->left->len, node->left->str, node->right->val);
+        emit("        .quad %s+%ld\n", node->left->atom->name, node->right->val);
         break;
     case ND_ARRAY: ;
         if (!ty || ty->ty != ARRAY) {
-            error_at(node->str, "expected array type");
+            error_at(node->loc, "expected array type");
         }
-        for (int i = 0; i < vector_count(node->arguments); i++) {
-            Node *elt = (Node*) vector_get(node->arguments, i);
-            gen_global_node(elt, ty->ptr_to);
+        for (int i = 0; i < node->count; i++) {
+            gen_global_node(node->items[i], ty->ptr_to);
         }
         // zero fill
-        if (vector_count(node->arguments) < ty->array_size) {
-            int zero_fill_size = (ty->array_size - vector_count(node->arguments)) * size_of(ty->ptr_to);
-            printf("        .zero %d\n", zero_fill_size);
+        if (node->count < ty->array_size) {
+            int zero_fill_size = (ty->array_size - node->count) * size_of(ty->ptr_to);
+            emit("        .zero %d\n", zero_fill_size);
         }
         break;
     default:
@@ -575,46 +743,315 @@ void gen_global_node(Node *node, Type *ty) {
 
 // gen_global generates the assembly for the given global variable.
 void gen_global(GlobalVar *var) {
-    printf("%.*s:\n", var->len, var->name);
+    emit("%.*s:\n", var->len, var->name);
     // If there is an initialization for this global variable
     if (var->init) {
         gen_global_node(var->init, var->type);
     } else {
-        printf("        .zero %d\n", var->offset);
+        emit("        .zero %d\n", var->offset);
     }
 }
 
-// gen reads the parsed code in AST, and prints out the assembly to complete the compilation.
-void gen() {
+// gen_function generates the assembly for the given function.
+void gen_function(Function *fn) {
     gen_tree_stack = new_vector();
+    cold_blocks = new_vector();
+
+    // Functions never executed in the profile are moved away from the hot ones
+    if (profile_count(0) == 0) {
+        text_section = ".section .text.unlikely,\"ax\",@progbits";
+    } else {
+        text_section = ".text";
+    }
+    emit("        %s\n", text_section);
+    // Function name, aligned for the instruction fetch
+    emit("        .p2align 4\n");
+    // Functions are visible to the other files linked together
+    emit(".global %.*s\n", fn->len, fn->name);
+    emit("%.*s:\n", fn->len, fn->name);
+    // Function Prologue
+    emit("        push rbp\n");
+    emit("        mov rbp, rsp\n");
+    // allocate local variables
+    if (fn->locals_size > 0) {
+        // 8-byte align
+        int offset = ((fn->locals_size - 1) / 8 + 1) * 8;
+        emit("        sub rsp, %d\n", offset);
+    }
+    gen_profile_counter(0);
+
+    // Copy function arguments from registers to stack
+    for (int i = 0; i < vector_count(fn->params); i++) {
+        // evaluate address of the local variable in stack
+        Node *arg = (Node*) vector_get(fn->params, i);
+        gen_lvalue(arg);
+        emit("        pop rax\n");
+        // support up to 6 arguments to load from registers
+        if (i < 6) {
+            // check the argument size in bytes
+            switch (size_of(arg->type)) {
+            case 1:
+                emit("        mov [rax], %s\n", arguments_8[i]);
+                break;
+            case 4:
+                emit("        mov [rax], %s\n", arguments_32[i]);
+                break;
+            default:
+                emit("        mov [rax], %s\n", arguments[i]);
+            }
+        }
+    }
+
+    // Function body
+    gen_tree(fn->body);
+    emit("        pop rax\n");
 
-    // Consume tokens to build multiple ASTs (Abstract Syntax Tree)
-    program();
+    // Function Epilogue
+    emit("        mov rsp, rbp\n");
+    emit("        pop rbp\n");
+    emit("        ret\n");
+
+    gen_cold_blocks();
+}
+
+// gen_header prints out the beginning of the assembly.
+void gen_header() {
+    output = stdout;
+    instrumented = new_vector();
 
     // Base assembly syntax
-    printf(".intel_syntax noprefix\n");
-    printf(".global main\n");
+    emit(".intel_syntax noprefix\n");
+}
 
-    // Print out global variables
+// gen_strings prints out the string literals parsed so far, and forgets them.
+void gen_strings() {
+    for (int i = 0; i < vector_count(strings); i++) {
+        Node *literal = (Node*) vector_get(strings, i);
+        emit(".LC%d:\n", literal->label);
+        emit("        .string \"%.*s\"\n", literal->len, literal->str);
+    }
+    vector_clear(strings);
+}
+
+// gen_data prints out the global variables and the string literals.
+void gen_data() {
     if (vector_count(globals) + vector_count(strings) > 0) {
-        printf(".data\n");
+        emit(".data\n");
     }
     for (int i = 0; i < vector_count(globals); i++) {
         GlobalVar *var = (GlobalVar*) vector_get(globals, i);
         gen_global(var);
     }
+    gen_strings();
+}
 
-    // Print out string literals
-    for (int i = 0; i < vector_count(strings); i++) {
-        Node *literal = (Node*) vector_get(strings, i);
-        printf(".LC%d:\n", literal->label);
-        printf("        .string \"%.*s\"\n", literal->len, literal->str);
+// assign_profile assigns the profile counters of the given function, the index-th in the order of the definition.
+// Counters are assigned before the optimization, so that they match between -fprofile-generate and -fprofile-use
+void assign_profile(int index, Function *fn) {
+    if (!profile_generate && !profile_use) return;
+    set_timed_function(index, fn->name, fn->len);
+    phase_begin(PHASE_PROFILE);
+    long visited = nodes_visited;
+    fn->profile = profile_function(fn);
+    vector_add(instrumented, fn->profile);
+    function_time(PHASE_PROFILE, phase_end(PHASE_PROFILE, nodes_visited - visited));
+}
+
+// gen_defined_function optimizes and generates the given function, the index-th in the order of the definition.
+// The function is taken from the code cache instead if unchanged.
+void gen_defined_function(int index, Function *fn) {
+    set_timed_function(index, fn->name, fn->len);
+    unsigned long key = 0;
+    if (code_cache) {
+        // keyed before the passes change the tree
+        phase_begin(PHASE_CODEGEN);
+        long visited = nodes_visited;
+        key = function_key(fn);
+        bool cached = gen_cached_function(fn, key);
+        function_time(PHASE_CODEGEN, phase_end(PHASE_CODEGEN, nodes_visited - visited));
+        if (cached) return;
+    }
+    // nodes made by the passes and the codegen temporaries live only while generating the function
+    current_arena = &function_arena;
+    current_profile = fn->profile;
+    optimize(fn);
+
+    phase_begin(PHASE_CODEGEN);
+    long visited = nodes_visited;
+    FILE *out = output;
+    char *text;
+    size_t size;
+    if (code_cache) {
+        // generated to the buffer to store, and then written out
+        output = open_memstream(&text, &size);
+        if (!output) {
+            error("cannot open the output buffer of %.*s", fn->len, fn->name);
+        }
+    }
+    gen_function(fn);
+    if (code_cache) {
+        fclose(output);
+        output = out;
+        fwrite(text, 1, size, output);
+        store_cached_function(fn, key, text, size);
+        free(text);
+    }
+    function_time(PHASE_CODEGEN, phase_end(PHASE_CODEGEN, nodes_visited - visited));
+}
+
+// release_function releases the memory used to generate the given function.
+void release_function(Function *fn) {
+    // the function may refer to the released nodes
+    current_arena = &permanent_arena;
+    account_function_arena();
+    arena_reset(&function_arena);
+    fn->body = NULL;
+    fn->params = NULL;
+}
+
+// gen_streamed_function type checks and generates the given function as soon as it is parsed (-fstreaming).
+// Only the symbols, the types, and the global variables outlive the function.
+void gen_streamed_function(int index, Function *fn) {
+    sema_function(index, fn);
+    // nothing is generated after an error, but the rest of the input is still checked
+    if (error_count == 0) {
+        assign_profile(index, fn);
+        gen_defined_function(index, fn);
+        // the string literals are released with the function
+        if (vector_count(strings) > 0) {
+            emit(".data\n");
+            gen_strings();
+        }
+    }
+    vector_clear(strings);
+    release_function(fn);
+}
+
+// gen_footer prints out the end of the assembly.
+void gen_footer() {
+    if (streaming) {
+        // the rest of the data, all known only at the end
+        gen_data();
+    }
+    if (profile_generate) {
+        gen_profile_runtime(instrumented);
     }
+    trim_code_cache();
+}
+
+// Generated assembly of a function, made on a codegen thread
+typedef struct FunctionOutput {
+    char *text;
+    size_t size;
+    bool done;
+} FunctionOutput;
+
+// Guards the state shared by the codegen threads below
+pthread_mutex_t codegen_lock = PTHREAD_MUTEX_INITIALIZER;
+// Signaled when a function has been generated, or written out
+pthread_cond_t codegen_progress = PTHREAD_COND_INITIALIZER;
+// Output of each function, in the order of the definition
+FunctionOutput *function_outputs;
+// Index of the next function to generate
+int next_function;
+// Index of the next function to write out
+int next_output;
+
+// codegen_worker is the body of a codegen thread. Takes the next function in turn, and generates it to its own buffer.
+void *codegen_worker(void *arg) {
+    int count = vector_count(functions);
+    int window = codegen_threads * CODEGEN_WINDOW_PER_THREAD;
+    for (;;) {
+        pthread_mutex_lock(&codegen_lock);
+        int index = next_function++;
+        while (index < count && index >= next_output + window) {
+            pthread_cond_wait(&codegen_progress, &codegen_lock);
+        }
+        pthread_mutex_unlock(&codegen_lock);
+        if (index >= count) break;
 
-    printf(".text\n");
+        Function *fn = (Function*) vector_get(functions, index);
+        FunctionOutput out = {0};
+        output = open_memstream(&out.text, &out.size);
+        if (!output) {
+            error("cannot open the output buffer of %.*s", fn->len, fn->name);
+        }
+        gen_defined_function(index, fn);
+        fclose(output);
+        release_function(fn);
+
+        pthread_mutex_lock(&codegen_lock);
+        out.done = true;
+        function_outputs[index] = out;
+        pthread_cond_broadcast(&codegen_progress);
+        pthread_mutex_unlock(&codegen_lock);
+    }
+    account_thread_arena();
+    return NULL;
+}
+
+// gen_functions_parallel generates the functions on the codegen threads,
+// and writes them out in the order of the definition, so that the output does not depend on the threads.
+void gen_functions_parallel() {
+    int count = vector_count(functions);
+    function_outputs = calloc(count, sizeof(FunctionOutput));
+    pthread_t *threads = calloc(codegen_threads, sizeof(pthread_t));
+    if (!function_outputs || !threads) {
+        error("out of memory");
+    }
+    for (int i = 0; i < codegen_threads; i++) {
+        if (pthread_create(&threads[i], NULL, codegen_worker, NULL) != 0) {
+            error("cannot create a codegen thread");
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        pthread_mutex_lock(&codegen_lock);
+        while (!function_outputs[i].done) {
+            pthread_cond_wait(&codegen_progress, &codegen_lock);
+        }
+        pthread_mutex_unlock(&codegen_lock);
+
+        fwrite(function_outputs[i].text, 1, function_outputs[i].size, stdout);
+        free(function_outputs[i].text);
+
+        pthread_mutex_lock(&codegen_lock);
+        next_output = i + 1;
+        pthread_cond_broadcast(&codegen_progress);
+        pthread_mutex_unlock(&codegen_lock);
+    }
+
+    for (int i = 0; i < codegen_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(function_outputs);
+}
+
+// gen reads the parsed code in AST, and prints out the assembly to complete the compilation.
+void gen() {
+    gen_header();
+    gen_data();
+    emit(".text\n");
 
     // Calculate the result for each functions
     for (int i = 0; i < vector_count(functions); i++) {
-        gen_tree(vector_get(functions, i));
+        assign_profile(i, (Function*) vector_get(functions, i));
+    }
+    if (codegen_threads == 0) {
+        codegen_threads = sysconf(_SC_NPROCESSORS_ONLN);
     }
+    if (codegen_threads > 1) {
+        double start = wall_clock();
+        gen_functions_parallel();
+        parallel_codegen_wall = wall_clock() - start;
+    } else {
+        for (int i = 0; i < vector_count(functions); i++) {
+            Function *fn = (Function*) vector_get(functions, i);
+            gen_defined_function(i, fn);
+            release_function(fn);
+        }
+    }
+
+    gen_footer();
 }
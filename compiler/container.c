@@ -1,10 +1,16 @@
 #include "main.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <setjmp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 // Reports error
 void error(char *fmt, ...) {
@@ -15,71 +21,378 @@ void error(char *fmt, ...) {
     exit(1);
 }
 
-// Reports error at the given location
-void error_at(char *loc, char *fmt, ...) {
-    // Retrieve starting and ending point of the line in which 'loc' is included
-    char *line = loc;
-    while (user_input < line && line[-1] != '\n') line--;
-    char *end = loc;
-    while (*end != '\n') end++;
-
-    // Retrieve line number
-    int line_num = 1;
-    for (char *p = user_input; p < line; p++) {
-        if (*p == '\n') {
-            line_num++;
+// Number of errors reported by error_at and report_error_at
+int error_count;
+
+// Maximum number of errors to report before giving up (-fmax-errors), 0 for no limit
+int max_errors = DEFAULT_MAX_ERRORS;
+
+// Where error_at jumps back to after reporting the error, to continue finding more errors; NULL to exit
+jmp_buf *error_recovery;
+
+// Offsets of the beginning of each line in user_input, followed by the end of the last line plus one
+int *line_starts;
+// Number of the lines in user_input
+int line_count;
+
+// build_line_index records the beginning of each line of user_input,
+// so that the line of an error location is found by binary search instead of counting the newlines.
+void build_line_index() {
+    char *end = user_input + strlen(user_input);
+    int count = 0;
+    for (char *p = user_input; (p = memchr(p, '\n', end - p)); p++) {
+        count++;
+    }
+    // one more for the last line without the newline
+    line_starts = heap_allocate(sizeof(int) * (count + 2));
+    line_count = 0;
+    for (char *p = user_input; (p = memchr(p, '\n', end - p)); p++) {
+        line_starts[++line_count] = p + 1 - user_input;
+    }
+    if (end > user_input && end[-1] != '\n') {
+        // as if the input ended with a newline
+        line_starts[++line_count] = end + 1 - user_input;
+    }
+}
+
+// find_line returns the 0-origin line number of the given location in user_input.
+int find_line(char *loc) {
+    int offset = loc - user_input;
+    // the last line starting at or before the offset
+    int low = 0;
+    int high = line_count;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (line_starts[mid] <= offset) {
+            low = mid;
+        } else {
+            high = mid - 1;
         }
     }
+    return low;
+}
 
-    // Print file name, line number, and content of the line
-    int indent = fprintf(stderr, "%s:%d: ", file_name, line_num);
+// print_error_line prints out the error message at loc in the given line [line, end) of the given file.
+void print_error_line(char *name, int line_num, char *line, char *end, char *loc, char *fmt, va_list ap) {
+    // Print file name, line number, column, and content of the line
+    int indent = fprintf(stderr, "%s:%d:%d: ", name, line_num, (int) (loc - line) + 1);
     fprintf(stderr, "%.*s\n", (int) (end - line), line);
 
-    va_list ap;
-    va_start(ap, fmt);
     // Point to the error location with '^'
     int pos = loc - line + indent;
     fprintf(stderr, "%*s", pos, ""); // space 'pos' times
     fprintf(stderr, "^ ");
     vfprintf(stderr, fmt, ap);
     fprintf(stderr, "\n");
-    exit(1);
 }
 
-// Returns the content of the given file name
-char *read_file(char *path) {
-    // Open file
-    FILE *fp = fopen(path, "r");
-    if (!fp) {
-        error("cannot open %s: %s", path, strerror(errno));
+// verror_at prints out the error message at the given location.
+void verror_at(char *loc, char *fmt, va_list ap) {
+    // Retrieve starting and ending point of the line in which 'loc' is included
+    int line_num = find_line(loc);
+    char *line = user_input + line_starts[line_num];
+    char *end = line_num < line_count ? user_input + line_starts[line_num + 1] - 1 : loc;
+
+    // the line in the original file, if preprocessed
+    LineMark *mark = find_line_mark(line_num);
+    if (mark) {
+        print_error_line(mark->file, mark->file_line + line_num - mark->line, line, end, loc, fmt, ap);
+    } else {
+        print_error_line(file_name, line_num + 1, line, end, loc, fmt, ap);
+    }
+}
+
+// count_error counts the reported error, and gives up if there are too many.
+void count_error() {
+    error_count++;
+    if (max_errors > 0 && error_count >= max_errors) {
+        fprintf(stderr, "compilation terminated due to -fmax-errors=%d.\n", max_errors);
+        exit(1);
+    }
+}
+
+// exit_on_errors exits if any error has been reported.
+void exit_on_errors() {
+    if (error_count > 0) {
+        fprintf(stderr, "%d error(s) generated.\n", error_count);
+        exit(1);
+    }
+}
+
+// Reports error at the given location, and recovers at error_recovery if set. Exits otherwise.
+void error_at(char *loc, char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    verror_at(loc, fmt, ap);
+    va_end(ap);
+    count_error();
+    if (error_recovery) {
+        longjmp(*error_recovery, 1);
+    }
+    exit_on_errors();
+}
+
+// report_error_at reports the error at the given location, and continues to find more errors.
+void report_error_at(char *loc, char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    verror_at(loc, fmt, ap);
+    va_end(ap);
+    count_error();
+}
+
+// Number of allocations made by the current thread, for -ftime-report
+_Thread_local long allocation_count;
+// Total bytes allocated by the current thread, for -ftime-report
+_Thread_local long allocation_bytes;
+
+// Size of the first block of an arena. Each next block doubles, so that small arenas (e.g. of tiny functions) stay small.
+#define ARENA_MIN_BLOCK_SIZE (4 * 1024)
+// Number of the block sizes, up to ARENA_MIN_BLOCK_SIZE << (ARENA_BLOCK_CLASSES - 1) = 256 KB.
+// Allocations larger than a quarter of the largest block get a block of their own.
+#define ARENA_BLOCK_CLASSES 7
+#define ARENA_MAX_BLOCK_SIZE (ARENA_MIN_BLOCK_SIZE << (ARENA_BLOCK_CLASSES - 1))
+
+struct ArenaBlock {
+    ArenaBlock *next;
+    // usable bytes after the header
+    size_t size;
+};
+
+// Arena for the allocations which live until the end of the compilation
+Arena permanent_arena;
+// Arena for the local symbols of the function being parsed, released after parsing each function
+Arena scope_arena;
+// Arena for the function being optimized and generated, released after generating each function.
+// Each codegen thread has its own.
+_Thread_local Arena function_arena;
+// Arena allocate() allocates from on the current thread
+_Thread_local Arena *current_arena = &permanent_arena;
+
+// Released blocks of each size class, reused before asking malloc for more
+ArenaBlock *free_blocks[ARENA_BLOCK_CLASSES];
+
+// Bytes of the blocks currently owned by any arena, and its peak, for -ftime-report
+long arena_reserved_bytes;
+long arena_peak_bytes;
+
+// Guards the blocks shared by the arenas of the codegen threads
+pthread_mutex_t block_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// heap_allocate returns the zero-cleared memory of the given size from malloc.
+void *heap_allocate(size_t size) {
+    void *ptr = calloc(1, size);
+    if (!ptr) {
+        error("out of memory");
     }
+    return ptr;
+}
 
-    // Retrieve file size
-    if (fseek(fp, 0, SEEK_END) == -1) {
-        error("%s: fseek: %s", path, strerror(errno));
+// block_class returns the size class of the given block size, or -1 if it is not a standard size.
+int block_class(size_t size) {
+    for (int i = 0; i < ARENA_BLOCK_CLASSES; i++) {
+        if (size == ARENA_MIN_BLOCK_SIZE << i) return i;
     }
-    size_t size = ftell(fp);
-    if (fseek(fp, 0, SEEK_SET) == -1) {
-        error("%s: fseek: %s", path, strerror(errno));
+    return -1;
+}
+
+// arena_add_block links a new block of at least the given size to the arena, and returns it.
+ArenaBlock *arena_add_block(Arena *arena, size_t size) {
+    if (size <= ARENA_MAX_BLOCK_SIZE) {
+        // double the size of the last block
+        size_t standard = arena->blocks ? arena->blocks->size * 2 : ARENA_MIN_BLOCK_SIZE;
+        if (standard > ARENA_MAX_BLOCK_SIZE) {
+            standard = ARENA_MAX_BLOCK_SIZE;
+        }
+        while (standard < size) {
+            standard *= 2;
+        }
+        size = standard;
     }
+    ArenaBlock *block = NULL;
+    int class = block_class(size);
+    pthread_mutex_lock(&block_lock);
+    if (class >= 0 && free_blocks[class]) {
+        block = free_blocks[class];
+        free_blocks[class] = block->next;
+    }
+    arena_reserved_bytes += size;
+    if (arena_reserved_bytes > arena_peak_bytes) {
+        arena_peak_bytes = arena_reserved_bytes;
+    }
+    pthread_mutex_unlock(&block_lock);
+    if (!block) {
+        block = malloc(sizeof(ArenaBlock) + size);
+        if (!block) {
+            error("out of memory");
+        }
+        block->size = size;
+    }
+    arena->reserved += block->size;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    return block;
+}
+
+// arena_alloc returns the zero-cleared memory of the given size from the arena.
+// Counts the allocation for -ftime-report.
+void *arena_alloc(Arena *arena, size_t size) {
+    allocation_count++;
+    allocation_bytes += size;
+    arena->allocations++;
+    arena->bytes += size;
 
-    // Read file content
-    char *buf = calloc(1, size + 2);
-    fread(buf, size, 1, fp);
+    size = (size + 7) & ~7;
+    if (size > arena->end - arena->ptr) {
+        if (size > ARENA_MAX_BLOCK_SIZE / 4) {
+            // a large one gets its own block, keeping the rest of the current block for the next allocations
+            ArenaBlock *block = arena_add_block(arena, size);
+            void *ptr = (char*) (block + 1);
+            if (block->next) {
+                // keep the current block first
+                arena->blocks = block->next;
+                block->next = arena->blocks->next;
+                arena->blocks->next = block;
+            }
+            return memset(ptr, 0, size);
+        }
+        ArenaBlock *block = arena_add_block(arena, size);
+        arena->ptr = (char*) (block + 1);
+        arena->end = arena->ptr + block->size;
+    }
+    void *ptr = arena->ptr;
+    arena->ptr += size;
+    return memset(ptr, 0, size);
+}
 
-    // Make sure the content always ends with "\n\0"
-    if (size == 0 || buf[size - 1] != '\n') {
-        buf[size++] = '\n';
+// arena_reset releases all the memory allocated from the arena at once.
+// Blocks of the standard sizes are kept for reuse by the other arenas.
+void arena_reset(Arena *arena) {
+    ArenaBlock *block = arena->blocks;
+    pthread_mutex_lock(&block_lock);
+    while (block) {
+        ArenaBlock *next = block->next;
+        arena_reserved_bytes -= block->size;
+        int class = block_class(block->size);
+        if (class >= 0) {
+            block->next = free_blocks[class];
+            free_blocks[class] = block;
+        } else {
+            free(block);
+        }
+        block = next;
+    }
+    pthread_mutex_unlock(&block_lock);
+    arena->blocks = NULL;
+    arena->ptr = NULL;
+    arena->end = NULL;
+    arena->reserved = 0;
+}
+
+// allocate returns the zero-cleared memory of the given size from the current arena.
+void *allocate(size_t size) {
+    return arena_alloc(current_arena, size);
+}
+
+// Size of each read from a stream, also the initial size of its buffer
+#define READ_CHUNK_SIZE (64 * 1024)
+
+// read_stream returns the content read from the given file descriptor (e.g. a pipe) until EOF,
+// followed by a '\0' sentinel.
+char *read_stream(int fd, char *path) {
+    size_t capacity = READ_CHUNK_SIZE;
+    size_t size = 0;
+    char *buf = malloc(capacity);
+    for (;;) {
+        // keep room for a chunk and the sentinel
+        if (capacity - size < READ_CHUNK_SIZE + 1) {
+            capacity *= 2;
+            buf = realloc(buf, capacity);
+        }
+        if (!buf) {
+            error("out of memory");
+        }
+        ssize_t n = read(fd, buf + size, READ_CHUNK_SIZE);
+        if (n == 0) break;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            error("%s: read: %s", path, strerror(errno));
+        }
+        size += n;
     }
     buf[size] = '\0';
-    fclose(fp);
+    return buf;
+}
+
+// map_file returns the content of the given regular file mapped into memory, followed by a '\0' sentinel.
+// The file is mapped over a zero-filled region one page larger,
+// so that the sentinel is there even if the size is a multiple of the page size.
+char *map_file(int fd, size_t size, char *path) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t mapped = (size + page) / page * page;
+    char *region = mmap(NULL, mapped, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        error("%s: mmap: %s", path, strerror(errno));
+    }
+    // tokenized from the beginning to the end right after
+    char *buf = mmap(region, size, PROT_READ, MAP_PRIVATE | MAP_FIXED | MAP_POPULATE, fd, 0);
+    if (buf == MAP_FAILED) {
+        error("%s: mmap: %s", path, strerror(errno));
+    }
+    return buf;
+}
+
+// Returns the content of the given file name ("-" for stdin), terminated by '\0'.
+// The content is read-only, as a regular file is mapped into memory without copying.
+char *read_file(char *path) {
+    if (strcmp(path, "-") == 0) {
+        return read_stream(STDIN_FILENO, "<stdin>");
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        error("cannot open %s: %s", path, strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        error("%s: fstat: %s", path, strerror(errno));
+    }
+
+    char *buf;
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        buf = map_file(fd, st.st_size, path);
+    } else {
+        // pipes, devices, and empty files have no size to map
+        buf = read_stream(fd, path);
+    }
+    close(fd);
+    return buf;
+}
+
+// format returns the formatted string allocated in the permanent arena.
+char *format(char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    char *buf = arena_alloc(&permanent_arena, len + 1);
+    va_start(ap, fmt);
+    vsnprintf(buf, len + 1, fmt, ap);
+    va_end(ap);
     return buf;
 }
 
 // Code from https://gist.github.com/EmilHernvall/953968/0fef1b1f826a8c3d8cfb74b2915f17d2944ec1d0
 
 Vector *new_vector() {
-    return calloc(1, sizeof(Vector));
+    return new_vector_in(current_arena);
+}
+
+// new_vector_in returns a new vector allocated from the given arena.
+Vector *new_vector_in(Arena *arena) {
+    Vector *v = arena_alloc(arena, sizeof(Vector));
+    v->arena = arena;
+    return v;
 }
 
 int vector_count(Vector *v) {
@@ -89,14 +402,17 @@ int vector_count(Vector *v) {
 void vector_add(Vector *v, void *elt) {
 	if (v->size == 0) {
 		v->size = 10;
-		v->data = calloc(1, sizeof(void*) * v->size);
+		v->data = arena_alloc(v->arena, sizeof(void*) * v->size);
 	}
 
 	// condition to increase v->data:
 	// last slot exhausted
+	// the old data is left to the arena
 	if (v->size == v->count) {
 		v->size *= 2;
-		v->data = realloc(v->data, sizeof(void*) * v->size);
+		void **data = arena_alloc(v->arena, sizeof(void*) * v->size);
+		memcpy(data, v->data, sizeof(void*) * v->count);
+		v->data = data;
 	}
 
 	v->data[v->count] = elt;
@@ -135,6 +451,137 @@ void vector_delete(Vector *v, int index) {
 	v->count--;
 }
 
+// vector_clear removes all the elements, keeping the data for the next ones.
+void vector_clear(Vector *v) {
+	v->count = 0;
+}
+
+// vector_free empties the vector. The data is released with its arena.
 void vector_free(Vector *v) {
-	free(v->data);
+	v->data = NULL;
+	v->size = 0;
+	v->count = 0;
+}
+
+// hash_string returns the FNV-1a hash of the given string.
+unsigned int hash_string(char *str, int len) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        hash ^= (unsigned char) str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Interned strings, open addressing with linear probing, elements: Atom* (NULL if the slot is empty)
+Atom **atoms;
+// number of slots, always a power of 2
+int atom_capacity;
+int atom_count;
+
+// find_atom_slot returns the slot of the atom with the given string, or the empty slot to insert it into.
+Atom **find_atom_slot(char *str, int len, unsigned int hash) {
+    unsigned int mask = atom_capacity - 1;
+    for (unsigned int i = hash & mask;; i = (i + 1) & mask) {
+        Atom *atom = atoms[i];
+        if (atom == NULL || (atom->hash == hash && atom->len == len && memcmp(atom->name, str, len) == 0)) {
+            return &atoms[i];
+        }
+    }
+}
+
+// intern returns the unique atom of the given string, so that equal names are the same pointer.
+// The string is copied and null-terminated.
+Atom *intern(char *str, int len) {
+    // keep the load factor under 3/4
+    if ((atom_count + 1) * 4 > atom_capacity * 3) {
+        Atom **old_atoms = atoms;
+        int old_capacity = atom_capacity;
+        atom_capacity = old_capacity == 0 ? 1024 : old_capacity * 2;
+        atoms = heap_allocate(sizeof(Atom*) * atom_capacity);
+        for (int i = 0; i < old_capacity; i++) {
+            if (old_atoms[i]) {
+                *find_atom_slot(old_atoms[i]->name, old_atoms[i]->len, old_atoms[i]->hash) = old_atoms[i];
+            }
+        }
+        free(old_atoms);
+    }
+
+    unsigned int hash = hash_string(str, len);
+    Atom **slot = find_atom_slot(str, len, hash);
+    if (*slot == NULL) {
+        Atom *atom = arena_alloc(&permanent_arena, sizeof(Atom));
+        atom->name = arena_alloc(&permanent_arena, len + 1);
+        memcpy(atom->name, str, len);
+        atom->len = len;
+        atom->hash = hash;
+        *slot = atom;
+        atom_count++;
+    }
+    return *slot;
+}
+
+// Open addressing hash map keyed by atom, with linear probing.
+
+Map *new_map() {
+    return new_map_in(current_arena);
+}
+
+// new_map_in returns a new map allocated from the given arena.
+Map *new_map_in(Arena *arena) {
+    Map *map = arena_alloc(arena, sizeof(Map));
+    map->arena = arena;
+    return map;
+}
+
+// map_find returns the entry of the given key, or the empty entry to insert the key into.
+MapEntry *map_find(Map *map, Atom *key) {
+    unsigned int mask = map->capacity - 1;
+    for (unsigned int i = key->hash & mask;; i = (i + 1) & mask) {
+        MapEntry *entry = &map->entries[i];
+        if (entry->key == NULL || entry->key == key) {
+            return entry;
+        }
+    }
+}
+
+// map_grow doubles the capacity of the map, and re-inserts the entries.
+void map_grow(Map *map) {
+    MapEntry *old_entries = map->entries;
+    int old_capacity = map->capacity;
+    map->capacity = old_capacity == 0 ? 16 : old_capacity * 2;
+    map->entries = arena_alloc(map->arena, sizeof(MapEntry) * map->capacity);
+    for (int i = 0; i < old_capacity; i++) {
+        MapEntry *old = &old_entries[i];
+        if (old->key) {
+            *map_find(map, old->key) = *old;
+        }
+    }
+    // the old entries are left to the arena
+}
+
+// map_get returns the value of the given key, or NULL if not found.
+void *map_get(Map *map, Atom *key) {
+    if (map->count == 0) {
+        return NULL;
+    }
+    return map_find(map, key)->value;
+}
+
+// map_put sets the value of the given key.
+void map_put(Map *map, Atom *key, void *value) {
+    // keep the load factor under 3/4
+    if ((map->count + 1) * 4 > map->capacity * 3) {
+        map_grow(map);
+    }
+    MapEntry *entry = map_find(map, key);
+    if (entry->key == NULL) {
+        entry->key = key;
+        map->count++;
+    }
+    entry->value = value;
+}
+
+int map_count(Map *map) {
+    return map->count;
 }
@@ -0,0 +1,221 @@
+#include "main.h"
+
+#include <errno.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Final output of the driver (-S, -c, or an executable by default)
+Stage driver_stage = STAGE_EXECUTABLE;
+// Output file (-o), NULL for the default name
+char *output_path;
+// Number of files to compile at the same time (-j N), 0 for the number of the cores
+int driver_jobs;
+
+// Compilation of a single input file, run in a child process
+typedef struct Job {
+    char *input;
+    // assembly, object, and diagnostics of the file
+    char *asm_path;
+    char *obj_path;
+    char *err_path;
+    // running child, 0 if not started or finished
+    pid_t pid;
+} Job;
+
+// Directory for the intermediate files, removed when the driver finishes
+char temp_dir[] = "/tmp/main-XXXXXX";
+
+// replace_extension returns the base name of the given path with its extension replaced, e.g. "dir/a.c" -> "a.o".
+char *replace_extension(char *path, char *extension) {
+    char *base = basename(format("%s", path));
+    char *dot = strrchr(base, '.');
+    if (dot) {
+        *dot = '\0';
+    }
+    return format("%s%s", base, extension);
+}
+
+// copy_diagnostics copies the diagnostics of the finished job to stderr, so that the messages of the files
+// compiled at the same time are not interleaved.
+void copy_diagnostics(Job *job) {
+    FILE *fp = fopen(job->err_path, "r");
+    if (!fp) return;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        fwrite(buf, 1, n, stderr);
+    }
+    fclose(fp);
+}
+
+// run_job compiles the file of the given job in the child process, and assembles it if an object is needed.
+// Never returns.
+void run_job(Job *job) {
+    if (!freopen(job->err_path, "w", stderr)) {
+        _exit(1);
+    }
+    if (!freopen(job->asm_path, "w", stdout)) {
+        fprintf(stderr, "cannot open %s: %s\n", job->asm_path, strerror(errno));
+        exit(1);
+    }
+    compile(job->input);
+    if (fclose(stdout) != 0) {
+        fprintf(stderr, "cannot write %s: %s\n", job->asm_path, strerror(errno));
+        exit(1);
+    }
+    if (driver_stage == STAGE_ASSEMBLY) {
+        exit(0);
+    }
+    execlp("cc", "cc", "-c", "-o", job->obj_path, job->asm_path, NULL);
+    fprintf(stderr, "cannot run cc: %s\n", strerror(errno));
+    exit(1);
+}
+
+// start_job forks the child process compiling the file of the given job.
+void start_job(Job *job) {
+    // not to write out the buffered output twice
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        error("cannot fork: %s", strerror(errno));
+    }
+    if (pid == 0) {
+        run_job(job);
+    }
+    job->pid = pid;
+}
+
+// wait_job waits for any of the running jobs to finish, and reports its diagnostics.
+// Returns true if the file has been compiled successfully.
+bool wait_job(Job *jobs, int count) {
+    int status;
+    pid_t pid = wait(&status);
+    if (pid < 0) {
+        error("cannot wait for the jobs: %s", strerror(errno));
+    }
+    for (int i = 0; i < count; i++) {
+        Job *job = &jobs[i];
+        if (job->pid != pid) continue;
+        job->pid = 0;
+        copy_diagnostics(job);
+        if (WIFSIGNALED(status)) {
+            fprintf(stderr, "%s: compiler killed by signal %d\n", job->input, WTERMSIG(status));
+            return false;
+        }
+        return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    return true;
+}
+
+// link_objects links the objects of the jobs into the executable.
+// Returns true if linked successfully.
+bool link_objects(Job *jobs, int count) {
+    char **argv = arena_alloc(&permanent_arena, sizeof(char*) * (count + 4));
+    argv[0] = "cc";
+    argv[1] = "-o";
+    argv[2] = output_path ? output_path : "a.out";
+    for (int i = 0; i < count; i++) {
+        argv[3 + i] = jobs[i].obj_path;
+    }
+    argv[3 + count] = NULL;
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        error("cannot fork: %s", strerror(errno));
+    }
+    if (pid == 0) {
+        execvp("cc", argv);
+        fprintf(stderr, "cannot run cc: %s\n", strerror(errno));
+        _exit(1);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0) {
+        error("cannot wait for the linker: %s", strerror(errno));
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// remove_temp_files removes the intermediate files of the jobs, and the directory of them.
+void remove_temp_files(Job *jobs, int count) {
+    for (int i = 0; i < count; i++) {
+        Job *job = &jobs[i];
+        unlink(job->err_path);
+        if (driver_stage != STAGE_ASSEMBLY) {
+            unlink(job->asm_path);
+        }
+        if (driver_stage == STAGE_EXECUTABLE) {
+            unlink(job->obj_path);
+        }
+    }
+    rmdir(temp_dir);
+}
+
+// drive compiles the given files in parallel, each in its own process, and links them unless -S or -c is given.
+// inputs: elements: char*
+// Returns the exit status of the compiler.
+int drive(Vector *inputs) {
+    int count = vector_count(inputs);
+    if (output_path && driver_stage != STAGE_EXECUTABLE && count > 1) {
+        fprintf(stderr, "-o with -S or -c cannot be used with multiple files\n");
+        return 1;
+    }
+    if (driver_jobs <= 0) {
+        driver_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (!mkdtemp(temp_dir)) {
+        error("cannot create a temporary directory: %s", strerror(errno));
+    }
+
+    Job *jobs = arena_alloc(&permanent_arena, sizeof(Job) * count);
+    for (int i = 0; i < count; i++) {
+        Job *job = &jobs[i];
+        job->input = (char*) vector_get(inputs, i);
+        if (strcmp(job->input, "-") == 0) {
+            fprintf(stderr, "reading from stdin is supported only for a single file to stdout\n");
+            rmdir(temp_dir);
+            return 1;
+        }
+        // the intermediate files are numbered, as the files of the same base name may be given
+        job->err_path = format("%s/%d.err", temp_dir, i);
+        job->asm_path = format("%s/%d.s", temp_dir, i);
+        job->obj_path = format("%s/%d.o", temp_dir, i);
+        if (driver_stage == STAGE_ASSEMBLY) {
+            job->asm_path = output_path ? output_path : replace_extension(job->input, ".s");
+        } else if (driver_stage == STAGE_OBJECT) {
+            job->obj_path = output_path ? output_path : replace_extension(job->input, ".o");
+        }
+    }
+
+    // keep at most driver_jobs files compiled at the same time, and continue with the rest on a failure
+    // to report the errors of all the files
+    int failed = 0;
+    int running = 0;
+    for (int next = 0; next < count || running > 0;) {
+        if (next < count && running < driver_jobs) {
+            start_job(&jobs[next++]);
+            running++;
+            continue;
+        }
+        if (!wait_job(jobs, count)) {
+            failed++;
+        }
+        running--;
+    }
+
+    int status = 0;
+    if (failed > 0) {
+        fprintf(stderr, "%d of %d file(s) failed to compile.\n", failed, count);
+        status = 1;
+    } else if (driver_stage == STAGE_EXECUTABLE && !link_objects(jobs, count)) {
+        status = 1;
+    }
+    remove_temp_files(jobs, count);
+    return status;
+}
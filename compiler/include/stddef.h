@@ -0,0 +1,10 @@
+// <stddef.h> for this compiler: only the declarations it can parse
+#ifndef __STDDEF_H
+#define __STDDEF_H
+
+typedef long size_t;
+typedef long ptrdiff_t;
+
+#define NULL 0
+
+#endif
@@ -0,0 +1,16 @@
+// <stdio.h> for this compiler: only the declarations it can parse
+#ifndef __STDIO_H
+#define __STDIO_H
+
+#include <stddef.h>
+
+#define EOF (-1)
+
+int printf(char *format, ...);
+int sprintf(char *str, char *format, ...);
+int snprintf(char *str, size_t size, char *format, ...);
+int puts(char *s);
+int putchar(int c);
+int getchar();
+
+#endif
@@ -0,0 +1,25 @@
+// <stdlib.h> for this compiler: only the declarations it can parse
+#ifndef __STDLIB_H
+#define __STDLIB_H
+
+#include <stddef.h>
+
+#define EXIT_SUCCESS 0
+#define EXIT_FAILURE 1
+#define RAND_MAX 2147483647
+
+void *malloc(size_t size);
+void *calloc(size_t nmemb, size_t size);
+void *realloc(void *ptr, size_t size);
+void free(void *ptr);
+void exit(int status);
+void abort();
+int atoi(char *s);
+long atol(char *s);
+long strtol(char *s, char **end, int base);
+int abs(int n);
+long labs(long n);
+int rand();
+void srand(int seed);
+
+#endif
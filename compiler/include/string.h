@@ -0,0 +1,23 @@
+// <string.h> for this compiler: only the declarations it can parse
+#ifndef __STRING_H
+#define __STRING_H
+
+#include <stddef.h>
+
+size_t strlen(char *s);
+int strcmp(char *s1, char *s2);
+int strncmp(char *s1, char *s2, size_t n);
+char *strcpy(char *dest, char *src);
+char *strncpy(char *dest, char *src, size_t n);
+char *strcat(char *dest, char *src);
+char *strchr(char *s, int c);
+char *strrchr(char *s, int c);
+char *strstr(char *haystack, char *needle);
+size_t strcspn(char *s, char *reject);
+size_t strspn(char *s, char *accept);
+void *memcpy(void *dest, void *src, size_t n);
+void *memmove(void *dest, void *src, size_t n);
+void *memset(void *s, int c, size_t n);
+int memcmp(void *s1, void *s2, size_t n);
+
+#endif
@@ -1,28 +1,221 @@
 #include "main.h"
 
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-// Given file name
+// Default profile file name for -fprofile-generate and -fprofile-use
+#define DEFAULT_PROFILE "cc.prof"
+
+// Given file name, "-" for stdin
 char *file_name;
 
-// Whole user input
+// Whole user input, read-only
 char *user_input;
 
-int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Invalid arguments length\n");
-        return 1;
-    }
+// Print out the preprocessed input instead of the assembly (-E)
+bool preprocess_only;
+
+// compile compiles the given file ("-" for stdin), and prints out the assembly to stdout.
+// Exits with the errors reported if the file has any.
+void compile(char *path) {
+    file_name = path;
+    init_symbols();
 
     // Read from file
-    file_name = argv[1];
+    phase_begin(PHASE_READ);
     user_input = read_file(file_name);
+    if (strcmp(file_name, "-") == 0) {
+        file_name = "<stdin>";
+    }
+    phase_end(PHASE_READ, strlen(user_input));
+    char *source = user_input;
 
-    // Tokenize the input
-    token = tokenize(user_input);
+    // Declare what the precompiled header declares, as if it were included first
+    if (include_pch) {
+        phase_begin(PHASE_PCH);
+        phase_end(PHASE_PCH, load_pch(include_pch));
+    }
+
+    // Expand the #include files and the macros
+    phase_begin(PHASE_PREPROCESS);
+    user_input = preprocess(user_input);
+    phase_end(PHASE_PREPROCESS, preprocessed_tokens);
+    if (preprocess_only) {
+        fputs(user_input, stdout);
+        return;
+    }
+    build_line_index();
+
+    if (emit_pch) {
+        // Parse the declarations of the header, and write them out instead of the assembly
+        phase_begin(PHASE_PARSE);
+        tokenize(user_input);
+        program();
+        phase_end(PHASE_PARSE, node_count);
+        token = 0;
+        write_pch(source);
+        print_time_report();
+        return;
+    }
+
+    if (streaming) {
+        // Generate each function as soon as it is parsed, so that only one function is in memory at a time
+        gen_header();
+        phase_begin(PHASE_PARSE);
+        tokenize(user_input);
+        program();
+        phase_end(PHASE_PARSE, node_count);
+        token = 0;
+        gen_footer();
+        print_time_report();
+        return;
+    }
+
+    // Consume tokens to build multiple ASTs (Abstract Syntax Tree), tokenizing the input on demand
+    phase_begin(PHASE_PARSE);
+    tokenize(user_input);
+    program();
+    phase_end(PHASE_PARSE, node_count);
+    token = 0;
+
+    // Annotate the types, and report the type errors
+    sema();
 
     // Generate the output
     gen();
 
-    return 0;
+    print_time_report();
+}
+
+// compile_command compiles as the given command line tells.
+// Returns the exit status.
+int compile_command(int argc, char **argv) {
+    // source files, elements: char*
+    Vector *inputs = new_vector();
+    for (int i = 1; i < argc; i++) {
+        char *arg = argv[i];
+        if (strcmp(arg, "-fprofile-generate") == 0) {
+            profile_generate = DEFAULT_PROFILE;
+        } else if (strncmp(arg, "-fprofile-generate=", 19) == 0) {
+            profile_generate = arg + 19;
+        } else if (strcmp(arg, "-fprofile-use") == 0) {
+            profile_use = DEFAULT_PROFILE;
+        } else if (strncmp(arg, "-fprofile-use=", 14) == 0) {
+            profile_use = arg + 14;
+        } else if (strncmp(arg, "-fmax-errors=", 13) == 0) {
+            max_errors = atoi(arg + 13);
+        } else if (strcmp(arg, "-ftime-report") == 0) {
+            time_report = true;
+        } else if (strcmp(arg, "-fstreaming") == 0) {
+            streaming = true;
+        } else if (strncmp(arg, "-fthreads=", 10) == 0) {
+            codegen_threads = atoi(arg + 10);
+        } else if (strncmp(arg, "-fcode-cache=", 13) == 0) {
+            code_cache = arg + 13;
+        } else if (strncmp(arg, "-fcode-cache-size=", 18) == 0) {
+            code_cache_size = atol(arg + 18);
+        } else if (strcmp(arg, "-I") == 0 && i + 1 < argc) {
+            add_include_path(argv[++i]);
+        } else if (strncmp(arg, "-I", 2) == 0 && arg[2] != '\0') {
+            add_include_path(arg + 2);
+        } else if (strcmp(arg, "-emit-pch") == 0) {
+            emit_pch = true;
+        } else if (strcmp(arg, "-include-pch") == 0 && i + 1 < argc) {
+            include_pch = argv[++i];
+        } else if (strcmp(arg, "-E") == 0) {
+            preprocess_only = true;
+        } else if (strcmp(arg, "-S") == 0) {
+            driver_stage = STAGE_ASSEMBLY;
+        } else if (strcmp(arg, "-c") == 0) {
+            driver_stage = STAGE_OBJECT;
+        } else if (strcmp(arg, "-o") == 0 || strcmp(arg, "-j") == 0) {
+            if (i + 1 == argc) {
+                fprintf(stderr, "Missing argument to %s\n", arg);
+                return 1;
+            }
+            i++;
+            if (arg[1] == 'o') {
+                output_path = argv[i];
+            } else {
+                driver_jobs = atoi(argv[i]);
+            }
+        } else if (strncmp(arg, "-j", 2) == 0) {
+            driver_jobs = atoi(arg + 2);
+        } else if (arg[0] == '-' && arg[1] != '\0') {
+            fprintf(stderr, "Unknown option %s\n", arg);
+            return 1;
+        } else {
+            vector_add(inputs, arg);
+        }
+    }
+    if (vector_count(inputs) == 0) {
+        fprintf(stderr, "Invalid arguments length\n");
+        return 1;
+    }
+    if (profile_generate && profile_use) {
+        fprintf(stderr, "-fprofile-generate and -fprofile-use cannot be used together\n");
+        return 1;
+    }
+    if (streaming && codegen_threads != 1) {
+        fprintf(stderr, "-fstreaming and -fthreads cannot be used together\n");
+        return 1;
+    }
+    if (code_cache && (profile_generate || profile_use)) {
+        fprintf(stderr, "-fcode-cache cannot be used with -fprofile-generate nor -fprofile-use\n");
+        return 1;
+    }
+    if (emit_pch && (include_pch || streaming || preprocess_only || vector_count(inputs) > 1)) {
+        fprintf(stderr, "-emit-pch takes a single header, and cannot be used with -include-pch, -fstreaming, nor -E\n");
+        return 1;
+    }
+    if (profile_use) {
+        read_profile(profile_use);
+    }
+    init_include_paths(argv[0]);
+    init_code_cache();
+
+    if (emit_pch) {
+        // the precompiled header to stdout, or to the -o file
+        if (output_path && !freopen(output_path, "w", stdout)) {
+            fprintf(stderr, "cannot open %s\n", output_path);
+            return 1;
+        }
+        compile((char*) vector_get(inputs, 0));
+        return 0;
+    }
+    if (vector_count(inputs) == 1 && driver_stage == STAGE_EXECUTABLE && !output_path) {
+        // the assembly of a single file to stdout
+        compile((char*) vector_get(inputs, 0));
+        return 0;
+    }
+    return drive(inputs);
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "-fserver=", 9) == 0) {
+            if (argc != 2) {
+                fprintf(stderr, "-fserver takes no other arguments; the options are given by the clients\n");
+                return 1;
+            }
+            serve(argv[i] + 9);
+        }
+        if (strncmp(argv[i], "-fclient=", 9) == 0) {
+            char *socket_path = argv[i] + 9;
+            // the rest of the arguments are for the compilation
+            for (int j = i; j < argc; j++) {
+                argv[j] = argv[j + 1];
+            }
+            argc--;
+            int status = request_server(socket_path, argc, argv);
+            if (status >= 0) {
+                return status;
+            }
+            // no server is running, compiled in this process
+            break;
+        }
+    }
+    return compile_command(argc, argv);
 }
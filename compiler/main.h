@@ -1,13 +1,80 @@
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 // container.c
 
 void error(char *fmt, ...);
 
-// Reports error at the given location
+// Reports error at the given location, and recovers at error_recovery if set
 void error_at(char *loc, char *fmt, ...);
 
+// Default of -fmax-errors
+#define DEFAULT_MAX_ERRORS 20
+
+// Number of errors reported by error_at and report_error_at
+extern int error_count;
+// Maximum number of errors to report before giving up (-fmax-errors), 0 for no limit
+extern int max_errors;
+// Where error_at jumps back to after reporting the error; NULL to exit
+extern jmp_buf *error_recovery;
+// Reports error at the given location, and continues
+void report_error_at(char *loc, char *fmt, ...);
+// Exits if any error has been reported
+void exit_on_errors();
+// Counts the reported error, and gives up if there are too many
+void count_error();
+// Prints out the error message at loc in the given line [line, end) of the given file
+void print_error_line(char *name, int line_num, char *line, char *end, char *loc, char *fmt, va_list ap);
+
+// Records the beginning of each line of user_input for the error messages
+void build_line_index();
+
 char *read_file(char *path);
+// Returns the formatted string allocated in the permanent arena
+char *format(char *fmt, ...);
+
+// Number of allocations made by the current thread, for -ftime-report
+extern _Thread_local long allocation_count;
+// Total bytes allocated by the current thread, for -ftime-report
+extern _Thread_local long allocation_bytes;
+
+typedef struct ArenaBlock ArenaBlock;
+
+// Bump pointer allocator, whose memory is released all at once
+typedef struct Arena {
+    // blocks owned by this arena, the current one first
+    ArenaBlock *blocks;
+    // free space of the current block
+    char *ptr;
+    char *end;
+    // statistics for -ftime-report
+    long allocations;
+    long bytes;
+    long reserved;
+} Arena;
+
+// Arena for the allocations which live until the end of the compilation
+extern Arena permanent_arena;
+// Arena for the local symbols of the function being parsed, released after parsing each function
+extern Arena scope_arena;
+// Arena for the function being optimized and generated, released after generating each function.
+// Each codegen thread has its own.
+extern _Thread_local Arena function_arena;
+// Arena allocate() allocates from on the current thread
+extern _Thread_local Arena *current_arena;
+
+// Bytes of the blocks currently owned by any arena, and its peak, for -ftime-report
+extern long arena_reserved_bytes;
+extern long arena_peak_bytes;
+
+void *arena_alloc(Arena *arena, size_t size);
+void arena_reset(Arena *arena);
+void *heap_allocate(size_t size);
+void *allocate(size_t size);
 
 typedef struct Vector {
     // pointer to the first data
@@ -17,31 +84,168 @@ typedef struct Vector {
     int size;
     // actual elements count
     int count;
+    // arena the data is allocated from
+    Arena *arena;
 } Vector;
 
 Vector *new_vector();
+Vector *new_vector_in(Arena *arena);
 int vector_count(Vector*);
 void vector_add(Vector*, void*);
 void vector_set(Vector*, int, void*);
 void *vector_get(Vector*, int);
 void *vector_get_last(Vector*);
 void vector_delete(Vector*, int);
+void vector_clear(Vector*);
 void vector_free(Vector*);
 
+// Interned identifier, unique per name so that names can be compared by pointer
+typedef struct Atom {
+    // null-terminated copy of the name
+    char *name;
+    int len;
+    // hash of the name, for symbol maps
+    unsigned int hash;
+} Atom;
+
+Atom *intern(char *str, int len);
+
+typedef struct MapEntry {
+    // NULL if the slot is empty
+    Atom *key;
+    void *value;
+} MapEntry;
+
+// Hash map keyed by atom
+typedef struct Map {
+    MapEntry *entries;
+    // number of slots, always a power of 2
+    int capacity;
+    // number of used slots
+    int count;
+    // arena the entries are allocated from
+    Arena *arena;
+} Map;
+
+Map *new_map();
+Map *new_map_in(Arena *arena);
+void *map_get(Map*, Atom *key);
+void map_put(Map*, Atom *key, void *value);
+int map_count(Map*);
+
 // main.c
 
 // Given file name
 extern char *file_name;
-// Whole user input
+// Whole user input, read-only
 extern char *user_input;
 
+void compile(char *path);
+int compile_command(int argc, char **argv);
+
+// preprocess.c
+
+// Line of user_input where the lines of a file start in the preprocessed input
+typedef struct LineMark {
+    // 0-origin line in user_input
+    int line;
+    char *file;
+    // 1-origin line in the file
+    int file_line;
+} LineMark;
+
+// Directories to find the headers in, elements: char*
+extern Vector *include_paths;
+// Number of the tokens written out by the preprocessor, for -ftime-report
+extern long preprocessed_tokens;
+// Headers read, and the #includes skipped by their include guards or #pragma once, for -ftime-report
+extern int headers_read;
+extern int headers_skipped;
+
+void add_include_path(char *dir);
+void init_include_paths(char *argv0);
+char *preprocess(char *input);
+LineMark *find_line_mark(int line);
+
+// pch.c
+
+// Precompiled header to write out instead of the assembly (-emit-pch)
+extern bool emit_pch;
+// Precompiled header to load before the main file (-include-pch), NULL if none
+extern char *include_pch;
+
+// Cursor in a precompiled header mapped into memory
+typedef struct PCHReader {
+    char *p;
+    char *end;
+    // path of the precompiled header, for the error messages
+    char *path;
+} PCHReader;
+
+unsigned long hash_bytes(char *p, long len);
+void pch_write_long(long value);
+void pch_write_string(char *str, int len);
+long pch_read_long(PCHReader *r);
+char *pch_read_string(PCHReader *r, int *len);
+Atom *pch_read_atom(PCHReader *r);
+void write_pch(char *contents);
+long load_pch(char *path);
+
+// Compare the cached headers with the files on the disk once per compilation (compile server)
+extern bool revalidate_sources;
+
+void init_preprocessor();
+void warm_source_file(char *path);
+void write_source_paths(FILE *fp);
+
+// preprocess.c, precompiled header
+
+void write_pch_headers();
+void write_pch_macros();
+void read_pch_macros(PCHReader *r, char *header);
+void mark_included(char *path);
+
+// driver.c
+
+// Final output of the driver
+typedef enum {
+    // assembly of each file (-S)
+    STAGE_ASSEMBLY,
+    // object of each file (-c)
+    STAGE_OBJECT,
+    // executable linking all the files
+    STAGE_EXECUTABLE,
+} Stage;
+
+// Final output of the driver (-S, -c, or an executable by default)
+extern Stage driver_stage;
+// Output file (-o), NULL for the default name
+extern char *output_path;
+// Number of files to compile at the same time (-j N), 0 for the number of the cores
+extern int driver_jobs;
+
+int drive(Vector *inputs);
+
+// server.c
+
+int request_server(char *socket_path, int argc, char **argv);
+void serve(char *socket_path);
+
 // parse.c
 
 struct Token;
 typedef struct Token Token;
 
-// Current token
-extern Token *token;
+// Index of a token, counted from 1 in the order of lexing
+typedef uint32_t TokenIndex;
+
+// Index of the current token in the token ring, 0 if none
+extern TokenIndex token;
+
+// Number of tokens lexed, for -ftime-report
+extern TokenIndex token_count;
+// Number of AST nodes created by the current thread, for -ftime-report
+extern _Thread_local long node_count;
 
 typedef struct Type Type;
 
@@ -57,18 +261,31 @@ typedef enum {
 } TypeKind;
 
 // Variable type
+// Types are canonical: there is a single object per distinct type, so types are compared by pointer.
+// Each struct definition is a distinct type.
 struct Type {
     TypeKind ty;
     // pointer to / array of what type
     // return type of func
     Type *ptr_to;
+    // number of elements if ARRAY, -1 until known from the initializer (e.g. "int a[] = {1, 2};")
     size_t array_size;
     // parameters of func, elt type: Type*
-    // parameters of struct, elt type: DefinedType*
+    // members of struct, elt type: DefinedType*
     Vector *params;
-    // identifier, if type is FUNC or STRUCT
+    // true if FUNC takes variable arguments after params ("...")
+    bool variadic;
+    // tag, if type is STRUCT
     char *str;
     int len;
+    Atom *atom;
+    // size and alignment in bytes
+    size_t size;
+    int align;
+    // canonical pointer type to this type, made on demand
+    Type *pointer;
+    // next ARRAY or FUNC type in the same bucket of the type table
+    Type *next_in_bucket;
 };
 
 typedef struct LocalVar LocalVar;
@@ -79,13 +296,14 @@ struct LocalVar {
     char *name;
     // variable name length
     int len;
+    Atom *atom;
     // offset from rbp
     int offset;
     // type
     Type *type;
 };
 
-Token *tokenize(char *p);
+void tokenize(char *p);
 
 // Node kind for building AST (Abstract Syntax Tree)
 typedef enum {
@@ -105,7 +323,8 @@ typedef enum {
     ND_LAND, // &&
     ND_LOR, // ||
     ND_LNOT, // !
-    ND_FUNC, // function
+    ND_COND, // "?:" conditional operator
+    ND_SELECT, // branchless "?:", both arms are evaluated (made by if-conversion)
     ND_FUNC_CALL, // function call
     ND_RETURN, // "return" statement
     ND_IF, // "if" statement
@@ -124,42 +343,104 @@ typedef enum {
 
 typedef struct Node Node;
 
+// AST node. Only the part of the union used by the kind is allocated (see node_size()),
+// so that the nodes are packed densely in the arena.
 struct Node {
     NodeKind kind;
-    // Global variable initializer node here if the kind is ND_GLOBAL_VAR
-    Node *left;
-    Node *right;
-    Node *third;
-    Node *fourth;
-    // Value here if the kind is ND_NUM or ND_CHAR
-    long val;
-    // Offset and type here if the kind is ND_LOCAL_VAR or ND_GLOBAL_VAR,
-    // total local vars offset here if the kind is ND_FUNC
-    int offset;
-    // function return type if the kind is ND_FUNC
+    union {
+        // Label name sequencing here if the kind is ND_IF, ND_COND, ND_WHILE, ND_FOR, ND_LAND, or ND_LOR
+        // String literal label name here if the kind is ND_STRING
+        int label;
+        // Offset here if the kind is ND_LOCAL_VAR or ND_GLOBAL_VAR
+        int offset;
+        // Number of items if the kind is ND_BLOCK, ND_ARRAY, or ND_FUNC_CALL
+        int count;
+    };
+    // Type of the expression
     Type *type;
-    // Label name sequencing here if the kind is ND_IF, ND_WHILE, or ND_FOR
-    // String literal label name here if the kind is ND_STRING
-    int label;
-    // Function name if the kind is ND_FUNC_CALL or ND_FUNC
-    // Variable name here if the kind is ND_LOCAL_VAR or ND_GLOBAL_VAR
-    // String literal here if the kind is ND_STRING
-    char *str;
-    int len;
-    // List of statements if the kind is ND_BLOCK
-    // List of function arguments if the kind is ND_FUNC or ND_FUNC_CALL, elements: Node*
-    // List of array elements if the kind is ND_ARRAY, elements: Node*
-    Vector *arguments;
+    // Source location for error messages, NULL if made by the passes
+    char *loc;
+    union {
+        // Operators and statements, as many children as node_arity() of the kind
+        struct {
+            Node *left;
+            Node *right;
+            Node *third;
+            // First profile counter index if the kind is ND_IF, ND_COND, ND_WHILE, or ND_FOR
+            int counter;
+            Node *fourth;
+        };
+        // Value here if the kind is ND_NUM or ND_CHAR
+        long val;
+        // Named nodes: ND_LOCAL_VAR, ND_GLOBAL_VAR, and ND_FUNC_CALL
+        struct {
+            Atom *atom;
+            // Statements if the kind is ND_BLOCK, elements if ND_ARRAY, arguments if ND_FUNC_CALL.
+            // Stored right after the node.
+            Node **items;
+        };
+        // String literal here if the kind is ND_STRING
+        struct {
+            char *str;
+            int len;
+        };
+    };
 };
 
+Node *allocate_node(NodeKind kind);
+Node *new_node(NodeKind kind, Node *left, Node *right);
+Node *new_list_node(NodeKind kind, Vector *items);
+size_t node_size(NodeKind kind);
+int node_arity(NodeKind kind);
+bool has_items(NodeKind kind);
+
 // size_of returns the size of the given type.
 size_t size_of(Type *ty);
+// Canonical primitive types
+extern Type void_type;
+extern Type char_type;
+extern Type int_type;
+extern Type long_type;
+
+Type *new_type(TypeKind kind, size_t size, int align);
+// pointer_to returns the canonical pointer type to the given type.
+Type *pointer_to(Type *base);
+Type *array_of(Type *base, size_t array_size);
+Type *func_type(Type *ret, Vector *params, bool variadic);
 // type_of returns the type of the given node.
 Type *type_of(Node *node);
 
-// List of functions, elements: Node*
+typedef struct Function Function;
+typedef struct FunctionProfile FunctionProfile;
+
+// Function symbol, made by a prototype declaration or the definition
+struct Function {
+    char *name;
+    int len;
+    Atom *atom;
+    // FUNC type, the same for all the declarations
+    Type *type;
+    // Body (ND_BLOCK) if defined, NULL if only declared
+    Node *body;
+    // Parameters if defined, elements: Node* (ND_LOCAL_VAR)
+    Vector *params;
+    // Total size of the local variables
+    int locals_size;
+    // Source location of the definition
+    char *loc;
+    // First label and string literal label numbered in the body, for the code cache to renumber them
+    int first_label;
+    int first_string;
+    // Profile counters, NULL if not profiled
+    FunctionProfile *profile;
+};
+
+// List of defined functions, elements: Function*
 extern Vector *functions;
 
+// Functions by name, values: Function*
+extern Map *function_map;
+
 typedef struct GlobalVar GlobalVar;
 
 struct GlobalVar {
@@ -167,6 +448,7 @@ struct GlobalVar {
     char *name;
     // variable name length
     int len;
+    Atom *atom;
     // offset from rbp
     int offset;
     // type
@@ -177,12 +459,135 @@ struct GlobalVar {
 
 // Global variables, elements: GlobalVar*
 extern Vector *globals;
+// Global variables by name, values: GlobalVar*
+extern Map *global_map;
+
+typedef struct DefinedType DefinedType;
+
+// Named type: a typedef, a struct tag, or a struct member
+struct DefinedType {
+    Atom *atom;
+    Type *ty;
+    // offset in bytes if this is a struct member
+    int offset;
+};
+
+// Defined types by name, values: DefinedType*
+extern Map *types;
+// Struct types by tag, values: DefinedType*
+extern Map *structs;
 
-// String literals
+// String literals not generated yet, elements: Node* (ND_STRING)
 extern Vector *strings;
 
+DefinedType *new_defined_type(Atom *atom, Type *ty);
+void init_symbols();
 void program();
 
+// cache.c
+
+// Default size limit of the code cache in KB
+#define DEFAULT_CODE_CACHE_SIZE (64 * 1024)
+
+// Directory of the code cache (-fcode-cache=dir), NULL if disabled
+extern char *code_cache;
+// Size limit of the code cache in KB (-fcode-cache-size=N)
+extern long code_cache_size;
+// Statistics for -ftime-report
+extern int code_cache_hits;
+extern int code_cache_misses;
+extern int code_cache_evictions;
+
+unsigned long hash_compiler();
+unsigned long function_key(Function *fn);
+bool gen_cached_function(Function *fn, unsigned long key);
+void store_cached_function(Function *fn, unsigned long key, char *text, size_t size);
+void trim_code_cache();
+void init_code_cache();
+
+// profile.c
+
+// Profile counters of a function
+struct FunctionProfile {
+    // function name
+    char *name;
+    int len;
+    // checksum of the function's shape, to detect stale profiles
+    unsigned long checksum;
+    int num_counters;
+    // counter values from the loaded profile, NULL if unknown
+    long *counters;
+};
+
+// Profile file to instrument the program for (-fprofile-generate), NULL if disabled
+extern char *profile_generate;
+// Profile file to optimize the program with (-fprofile-use), NULL if disabled
+extern char *profile_use;
+// Profile of the function currently being optimized and generated on the current thread
+extern _Thread_local FunctionProfile *current_profile;
+
+unsigned long hash_value(unsigned long hash, unsigned long value);
+FunctionProfile *profile_function(Function *fn);
+long profile_count(int counter);
+int branch_probability(Node *node);
+void read_profile(char *path);
+void gen_profile_counter(int counter);
+void gen_profile_runtime(Vector *instrumented);
+
+// time_report.c
+
+// Compilation phases measured by -ftime-report
+typedef enum {
+    PHASE_READ,
+    PHASE_PCH,
+    PHASE_PREPROCESS,
+    // tokens are lexed on demand while parsing
+    PHASE_PARSE,
+    PHASE_SEMA,
+    PHASE_PROFILE,
+    PHASE_IF_CONVERSION,
+    PHASE_CODEGEN,
+    NUM_PHASES,
+} Phase;
+
+// Print out compile time report to stderr (-ftime-report)
+extern bool time_report;
+// Number of AST nodes visited by the passes and codegen on the current thread, for -ftime-report
+extern _Thread_local long nodes_visited;
+// Wall time of generating the functions on the codegen threads, 0 if not in parallel
+extern double parallel_codegen_wall;
+
+double wall_clock();
+void phase_begin(Phase phase);
+double phase_end(Phase phase, long items);
+void set_timed_function(int index, char *name, int len);
+void function_time(Phase phase, double wall);
+void account_function_arena();
+void account_thread_arena();
+void print_time_report();
+
+// sema.c
+
+void sema_function(int index, Function *fn);
+void sema();
+
+// optimize.c
+
+void optimize(Function *fn);
+
 // codegen.c
 
+// Generate each function as soon as it is parsed, and release it (-fstreaming)
+extern bool streaming;
+// Number of threads to optimize and generate the functions on (-fthreads=N), 0 for the number of the cores
+extern int codegen_threads;
+// Output of the current thread: stdout, or the buffer of the function on a codegen thread
+extern _Thread_local FILE *output;
+
+// emit prints out the formatted assembly to the output of the current thread.
+#define emit(...) fprintf(output, __VA_ARGS__)
+
+void gen_header();
+void gen_streamed_function(int index, Function *fn);
+void gen_footer();
 void gen();
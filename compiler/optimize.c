@@ -0,0 +1,194 @@
+#include "main.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Maximum total cost of both arms for a conditional to be if-converted.
+// Both arms are always evaluated after the conversion, so this bounds the wasted work
+// compared to a mispredicted branch (roughly 15-20 cycles).
+#define IF_CONVERSION_MAX_COST 12
+
+// is_speculatable returns true if the given expression has no side effects and can never trap,
+// i.e. it is safe to evaluate even if its value is thrown away.
+bool is_speculatable(Node *node) {
+    switch (node->kind) {
+    case ND_NUM:
+    case ND_CHAR:
+    case ND_STRING:
+    case ND_LOCAL_VAR:
+    case ND_GLOBAL_VAR:
+        return true;
+    case ND_ADDR:
+        return node->left->kind == ND_LOCAL_VAR || node->left->kind == ND_GLOBAL_VAR;
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_EQUAL:
+    case ND_NOT_EQUAL:
+    case ND_LESS_EQUAL:
+    case ND_LESS:
+    case ND_GREATER_EQUAL:
+    case ND_GREATER:
+        return is_speculatable(node->left) && is_speculatable(node->right);
+    case ND_LNOT:
+        return is_speculatable(node->left);
+    case ND_SELECT:
+        return is_speculatable(node->left) && is_speculatable(node->right) && is_speculatable(node->third);
+    default:
+        // assignments, function calls, dereferences (may fault), division (may trap),
+        // and anything containing a branch of its own
+        return false;
+    }
+}
+
+// node_cost estimates the number of instructions needed to evaluate the given expression.
+int node_cost(Node *node) {
+    if (node == NULL) return 0;
+    // push/pop plus the operation itself
+    int cost = 2;
+    int arity = node_arity(node->kind);
+    if (arity > 0) cost += node_cost(node->left);
+    if (arity > 1) cost += node_cost(node->right);
+    if (arity > 2) cost += node_cost(node->third);
+    return cost;
+}
+
+// is_predictable guesses if the branch on the given condition is well predicted by the hardware.
+// Comparisons for (in)equality against a constant are usually heavily biased (e.g. "if (c == 'x')"),
+// while order comparisons between two runtime values (e.g. "if (a < b)") are data dependent.
+bool is_predictable(Node *cond) {
+    switch (cond->kind) {
+    case ND_NUM:
+    case ND_CHAR:
+        return true;
+    case ND_EQUAL:
+    case ND_NOT_EQUAL:
+        return cond->left->kind == ND_NUM || cond->left->kind == ND_CHAR
+            || cond->right->kind == ND_NUM || cond->right->kind == ND_CHAR;
+    default:
+        return false;
+    }
+}
+
+// should_if_convert is the cost model of the if-conversion of the given ND_IF or ND_COND node.
+// Returns true if selecting between the two arms without branching is expected to be faster.
+bool should_if_convert(Node *branch, Node *then, Node *els) {
+    int probability = branch_probability(branch);
+    if (probability >= 0) {
+        // a heavily biased branch is well predicted
+        if (probability < 10 || probability > 90) return false;
+    } else if (is_predictable(branch->left)) {
+        return false;
+    }
+    if (!is_speculatable(then) || !is_speculatable(els)) return false;
+    return node_cost(then) + node_cost(els) <= IF_CONVERSION_MAX_COST;
+}
+
+// new_select creates a new ND_SELECT node choosing "then" if "cond" is non-zero, and "els" otherwise.
+Node *new_select(Node *cond, Node *then, Node *els) {
+    Node *node = allocate_node(ND_SELECT);
+    node->left = cond;
+    node->right = then;
+    node->third = els;
+    node->type = then->type;
+    return node;
+}
+
+// single_stmt unwraps "{ stmt; }" into "stmt;".
+Node *single_stmt(Node *node) {
+    while (node && node->kind == ND_BLOCK && node->count == 1) {
+        node = node->items[0];
+    }
+    return node;
+}
+
+// is_scalar_local returns true if the given node is a local variable which fits in a register.
+bool is_scalar_local(Node *node) {
+    return node->kind == ND_LOCAL_VAR && node->type
+        && node->type->ty != ARRAY && node->type->ty != STRUCT;
+}
+
+// same_local returns true if both nodes refer to the same local variable.
+bool same_local(Node *first, Node *second) {
+    return is_scalar_local(first) && is_scalar_local(second) && first->offset == second->offset;
+}
+
+// copy_node returns a shallow copy of the given node, so that the tree does not share nodes.
+// The items of a list node are shared.
+Node *copy_node(Node *node) {
+    Node *copy = allocate_node(node->kind);
+    memcpy(copy, node, node_size(node->kind));
+    return copy;
+}
+
+// if_convert_if tries to turn the small diamond of the given ND_IF into a straight-line ND_SELECT.
+// Returns the given node as-is if the statement does not match any of the patterns below.
+Node *if_convert_if(Node *node) {
+    Node *then = single_stmt(node->right);
+    Node *els = single_stmt(node->third);
+
+    // "if (c) return a; else return b;" -> "return c ? a : b;"
+    if (els && then->kind == ND_RETURN && els->kind == ND_RETURN) {
+        if (!should_if_convert(node, then->left, els->left)) return node;
+        then->left = new_select(node->left, then->left, els->left);
+        return then;
+    }
+
+    if (then->kind != ND_ASSIGN || !is_scalar_local(then->left)) return node;
+    Node *var = then->left;
+    Node *other;
+    if (els) {
+        // "if (c) x = a; else x = b;" -> "x = c ? a : b;"
+        if (els->kind != ND_ASSIGN || !same_local(var, els->left)) return node;
+        other = els->right;
+    } else {
+        // "if (c) x = a;" -> "x = c ? a : x;"
+        // only for local variables, as introducing a store to a global variable is visible to others
+        other = copy_node(var);
+    }
+    if (!should_if_convert(node, then->right, other)) return node;
+    then->right = new_select(node->left, then->right, other);
+    return then;
+}
+
+// if_convert walks the given tree bottom-up, and replaces unpredictable branches with conditional moves.
+// Returns the node that should replace the given node.
+Node *if_convert(Node *node) {
+    if (node == NULL) return NULL;
+    nodes_visited++;
+
+    int arity = node_arity(node->kind);
+    if (arity > 0) node->left = if_convert(node->left);
+    if (arity > 1) node->right = if_convert(node->right);
+    if (arity > 2) node->third = if_convert(node->third);
+    if (arity > 3) node->fourth = if_convert(node->fourth);
+    if (has_items(node->kind)) {
+        for (int i = 0; i < node->count; i++) {
+            node->items[i] = if_convert(node->items[i]);
+        }
+    }
+
+    switch (node->kind) {
+    case ND_COND:
+        if (should_if_convert(node, node->right, node->third)) {
+            return new_select(node->left, node->right, node->third);
+        }
+        return node;
+    case ND_IF:
+        return if_convert_if(node);
+    default:
+        return node;
+    }
+}
+
+// optimize runs the optimization passes on the given function.
+void optimize(Function *fn) {
+    // Instrumented build profiles the original branches
+    if (!profile_generate) {
+        phase_begin(PHASE_IF_CONVERSION);
+        long visited = nodes_visited;
+        fn->body = if_convert(fn->body);
+        function_time(PHASE_IF_CONVERSION, phase_end(PHASE_IF_CONVERSION, nodes_visited - visited));
+    }
+}
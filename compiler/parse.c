@@ -1,36 +1,31 @@
 #include "main.h"
 
 #include <ctype.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-char symbols[][3] = {
-    "==", "!=",
-    // notice the check order
-    "<=", "<", ">=", ">",
-    "->",
-    "++", "--",
-    "+", "-",
-    "*", "/",
-    "(", ")",
-    ";", "=",
-    "{", "}",
-    "&&", "||",
-    ",", "&",
-    "[", "]",
-    ".", "!",
-};
-
-char keywords[][9] = {
-    "return", "if", "else",
-    "for", "while", "int",
-    "sizeof", "char", "void",
-    "typedef", "struct",
-    "break", "continue",
-    "long",
+// Reserved keywords, placed by keyword_hash() so that each keyword has its own slot (perfect hash).
+// Keep keyword_hash() collision free when adding a keyword.
+char keywords[32][9] = {
+    [0] = "continue",
+    [5] = "int",
+    [8] = "for",
+    [10] = "void",
+    [13] = "char",
+    [16] = "return",
+    [17] = "sizeof",
+    [18] = "else",
+    [19] = "long",
+    [20] = "while",
+    [23] = "if",
+    [26] = "typedef",
+    [29] = "break",
+    [31] = "struct",
 };
 
 int next_label = 0;
@@ -52,64 +47,144 @@ typedef enum {
 
 typedef struct Token Token;
 
+// Token is a token decoded out of the token ring, for the declared names the parser keeps beyond the ring.
 struct Token {
     TokenKind kind;
-    Token *next;
-    // Value if kind == TK_NUM
-    long val;
-    // Literal type if kind == TK_NUM, e.g. 9223372036854775808L
-    Type *type;
     // Token
     char *str;
     // Token length
     int len;
+    // Interned name if kind == TK_IDENTIFIER
+    Atom *atom;
 };
 
-Type *new_type(TypeKind kind);
+// Payload of a token in the token ring, depending on its kind
+typedef union TokenValue {
+    // Value if kind == TK_NUM
+    long val;
+    // Interned name if kind == TK_IDENTIFIER
+    Atom *atom;
+} TokenValue;
+
+// Canonical primitive types
+Type void_type = {.ty = VOID, .size = 0, .align = 1};
+Type char_type = {.ty = CHAR, .size = 1, .align = 1};
+Type int_type = {.ty = INT, .size = 4, .align = 4};
+Type long_type = {.ty = LONG, .size = 8, .align = 8};
+
+// Number of the latest tokens kept in the token ring, a power of 2.
+// The parser can look back (restore a checkpoint) within this many tokens.
+#define TOKEN_RING_SIZE 4096
+
+// Tokens lexed on demand, stored in parallel arrays.
+// The token of index i is at the slot i % TOKEN_RING_SIZE of each array.
+unsigned char token_kinds[TOKEN_RING_SIZE];
+// Offsets of the tokens in user_input
+uint32_t token_offsets[TOKEN_RING_SIZE];
+uint32_t token_lengths[TOKEN_RING_SIZE];
+// Literal values and identifier names
+TokenValue token_values[TOKEN_RING_SIZE];
+
+// Where the lexer continues from
+char *lex_cursor;
+
+// Index of the current token (from 1, 0 for no token), and its slot in the token ring
+TokenIndex token;
+int token_slot;
+
+// Number of tokens lexed, also the index of the last one lexed
+TokenIndex token_count;
+
+void advance();
+// Number of AST nodes created by the current thread, for -ftime-report
+_Thread_local long node_count;
+
+typedef struct Scope Scope;
+
+// Block scope of local variables
+struct Scope {
+    // variables declared in this block, values: LocalVar*
+    Map *vars;
+    // enclosing block, NULL if this is the outermost block of the function
+    Scope *parent;
+};
 
-// Current token
-Token *token;
+// Innermost scope of the current function's local variables, NULL if not inside function parsing
+Scope *scope;
 
-// Current function's local variables
-// elements: LocalVar*
-Vector *locals;
+// Total size of the current function's local variables, i.e. offset of the last local variable
+int locals_offset;
 
 // Global variables
 // elements: GlobalVar*
 Vector *globals;
 
+// Global variables by name, values: GlobalVar*
+Map *global_map;
+
 // List of functions
 Vector *functions;
 
-// String literals
+// Functions by name, values: Function*
+Map *function_map;
+
+// String literals not generated yet
 Vector *strings;
 
-typedef struct DefinedType DefinedType;
+// Number of the string literals, for their labels
+int string_count;
 
-struct DefinedType {
-    char *name;
-    Type *ty;
-};
+// Defined types by name, values: DefinedType*
+Map *types;
 
-// List of defined types, elements: DefinedType*
-Vector *types;
-
-// List of struct types, elements: DefinedType*
+// Struct types by tag, values: DefinedType*
 // prefixed with "struct"
-Vector *structs;
+Map *structs;
+
+// token_kind returns the kind of the token of the given index, which must be in the token ring.
+TokenKind token_kind(TokenIndex tok) {
+    return token_kinds[tok % TOKEN_RING_SIZE];
+}
+
+// token_str returns the beginning of the token of the given index in user_input.
+char *token_str(TokenIndex tok) {
+    return user_input + token_offsets[tok % TOKEN_RING_SIZE];
+}
+
+// token_len returns the length of the token of the given index.
+int token_len(TokenIndex tok) {
+    return token_lengths[tok % TOKEN_RING_SIZE];
+}
+
+// token_atom returns the interned name of the identifier token of the given index.
+Atom *token_atom(TokenIndex tok) {
+    return token_values[tok % TOKEN_RING_SIZE].atom;
+}
+
+// token_val returns the value of the number token of the given index.
+long token_val(TokenIndex tok) {
+    return token_values[tok % TOKEN_RING_SIZE].val;
+}
+
+// token_type returns the literal type of the number token of the given index, e.g. 9223372036854775808L,
+// or NULL if not specified.
+Type *token_type(TokenIndex tok) {
+    char suffix = token_str(tok)[token_len(tok) - 1];
+    return suffix == 'l' || suffix == 'L' ? &long_type : NULL;
+}
 
 // consume returns true when the current token is the given expected operator, and proceeds to the next token.
 // Returns false otherwise.
 bool consume(char *op) {
         // next token is not a symbol
-    if (token->kind != TK_RESERVED ||
+    if (token_kinds[token_slot] != TK_RESERVED ||
         // not correct expected token length
-        strlen(op) != token->len ||
-        // compare the first token->len bytes of two strings
-        memcmp(token->str, op, token->len)) {
+        strlen(op) != token_lengths[token_slot] ||
+        // compare the first token length bytes of two strings
+        memcmp(user_input + token_offsets[token_slot], op, token_lengths[token_slot])) {
         return false;
     }
-    token = token->next;
+    advance();
     return true;
 }
 
@@ -117,104 +192,127 @@ bool consume(char *op) {
 // Reports error otherwise.
 void expect(char *op) {
     if (!consume(op)) {
-        error_at(token->str, "Next token is not \"%s\"\n", op);
+        error_at(token_str(token), "Next token is not \"%s\"", op);
     }
 }
 
 // consume_keyword returns true when the current token is TK_KEYWORD, and proceeds to the next token.
 bool consume_keyword(char *keyword) {
-    if (token->kind != TK_KEYWORD ||
-        strlen(keyword) != token->len ||
-        memcmp(keyword, token->str, token->len)) {
+    if (token_kinds[token_slot] != TK_KEYWORD ||
+        strlen(keyword) != token_lengths[token_slot] ||
+        memcmp(keyword, user_input + token_offsets[token_slot], token_lengths[token_slot])) {
         return false;
     }
-    token = token->next;
+    advance();
     return true;
 }
 
 // expect_keyword consumes keyword and proceeds to the next token. If the expected keyword was not found, raises an error.
 void expect_keyword(char *keyword) {
     if (!consume_keyword(keyword)) {
-        error_at(token->str, "Expected %s", keyword);
+        error_at(token_str(token), "Expected %s", keyword);
     }
 }
 
 // consume_identifier consumes the next identifier token if exists, and proceed to the next token.
-Token *consume_identifier() {
-    if (token->kind != TK_IDENTIFIER) {
-        return NULL;
+// Returns the index of the identifier, 0 otherwise.
+TokenIndex consume_identifier() {
+    if (token_kinds[token_slot] != TK_IDENTIFIER) {
+        return 0;
     }
-    Token *ret = token;
-    token = token->next;
+    TokenIndex ret = token;
+    advance();
     return ret;
 }
 
-// consume_identifier_with_name consumes the next identifier token if exists, and checks the identifier name.
-// Intended for use with defined types with typedef.
-Token *consume_identifier_with_name(char *name) {
-    if (token->kind != TK_IDENTIFIER ||
-        strlen(name) != token->len ||
-        memcmp(name, token->str, token->len)) {
+// consume_defined_type consumes the next identifier token if it is a name defined with typedef.
+// Returns the defined type if found, NULL otherwise.
+DefinedType *consume_defined_type() {
+    if (token_kinds[token_slot] != TK_IDENTIFIER) {
         return NULL;
     }
-    Token *ret = token;
-    token = token->next;
-    return ret;
+    DefinedType *defined = (DefinedType*) map_get(types, token_values[token_slot].atom);
+    if (defined) {
+        advance();
+    }
+    return defined;
 }
 
 // consume_identifier returns the next identifier token, otherwise reports an error.
-Token *expect_identifier() {
-    Token *ret = consume_identifier();
-    if (ret == NULL) {
-        error_at(token->str, "Next token is not an identifier\n");
+TokenIndex expect_identifier() {
+    TokenIndex ret = consume_identifier();
+    if (ret == 0) {
+        error_at(token_str(token), "Next token is not an identifier");
     }
     return ret;
 }
 
 // consume_string returns the next string literal and proceeds to the next token, if found.
-Token *consume_string() {
-    if (token->kind != TK_STRING) {
-        return NULL;
+// Returns 0 otherwise.
+TokenIndex consume_string() {
+    if (token_kinds[token_slot] != TK_STRING) {
+        return 0;
     }
-    Token *ret = token;
-    token = token->next;
+    TokenIndex ret = token;
+    advance();
     return ret;
 }
 
-// consume_number returns pointer to the consumed number and proceed to the next token.
-// Returns NULL otherwise.
-Token *consume_number() {
-    if (token->kind != TK_NUM) {
-        return NULL;
+// consume_number returns the consumed number and proceed to the next token.
+// Returns 0 otherwise.
+TokenIndex consume_number() {
+    if (token_kinds[token_slot] != TK_NUM) {
+        return 0;
     }
-    Token *ret = token;
-    token = token->next;
+    TokenIndex ret = token;
+    advance();
     return ret;
 }
 
 // expect_number returns number and proceed to the next token when the current token is represents a number.
 // Reports error otherwise.
-Token *expect_number() {
-    if (token->kind != TK_NUM) {
-        error_at(token->str, "Not a number\n");
+TokenIndex expect_number() {
+    if (token_kinds[token_slot] != TK_NUM) {
+        error_at(token_str(token), "Not a number");
     }
-    Token *ret = token;
-    token = token->next;
+    TokenIndex ret = token;
+    advance();
     return ret;
 }
 
 // at_eof returns true if the current token is the last token.
 bool at_eof() {
-    return token->kind == TK_EOF;
+    return token_kinds[token_slot] == TK_EOF;
 }
 
-// new_token generates a new token and links it to the given current token.
-Token *new_token(TokenKind kind, Token *cur, char *str) {
-    Token *tok = calloc(1, sizeof(Token));
-    tok->kind = kind;
-    tok->str = str;
-    cur->next = tok;
-    return tok;
+// Checkpoint is the index of a token the parser can restore, while it is in the token ring.
+typedef TokenIndex Checkpoint;
+
+// checkpoint returns the position of the current token.
+Checkpoint checkpoint() {
+    return token;
+}
+
+// in_token_ring returns true if the token of the given index has been lexed and is not overwritten yet.
+bool in_token_ring(TokenIndex tok) {
+    return tok != 0 && token_count - tok < TOKEN_RING_SIZE;
+}
+
+// restore moves back (or forward) to the given checkpoint.
+void restore(Checkpoint cp) {
+    if (!in_token_ring(cp)) {
+        error_at(token_str(token), "too many tokens to look back");
+    }
+    token = cp;
+    token_slot = cp % TOKEN_RING_SIZE;
+}
+
+// init_token initializes the given slot of the token ring.
+void init_token(int slot, TokenKind kind, char *str) {
+    token_kinds[slot] = kind;
+    token_offsets[slot] = str - user_input;
+    token_lengths[slot] = 0;
+    token_values[slot].val = 0;
 }
 
 // is_variable_char returns true if the given character is a valid first character for a variable.
@@ -230,143 +328,205 @@ bool is_alnum(char c) {
          (c == '_');
 }
 
-// has_char_length checks if the given string length is greater than or equal to the given length.
-bool has_char_length(char *p, size_t len) {
-    while (*p && len > 0) {
-        len--;
-        p += 1;
+// keyword_hash returns the slot in keywords for the identifier of the given length.
+int keyword_hash(char *p, int len) {
+    return ((unsigned char) p[0] * 9 + (unsigned char) p[len - 1]) & 31;
+}
+
+// is_keyword returns true if the given identifier is a reserved keyword.
+bool is_keyword(char *p, int len) {
+    if (len >= sizeof(keywords[0])) return false;
+    char *keyword = keywords[keyword_hash(p, len)];
+    return keyword[len] == '\0' && memcmp(keyword, p, len) == 0;
+}
+
+// punctuator_length returns the length of the (longest) punctuator at p, or 0 if p is not a punctuator.
+int punctuator_length(char *p) {
+    switch (p[0]) {
+    case '=':
+    case '!':
+    case '<':
+    case '>':
+        // "==", "!=", "<=", ">="
+        return p[1] == '=' ? 2 : 1;
+    case '-':
+        // "->", "--"
+        return p[1] == '>' || p[1] == '-' ? 2 : 1;
+    case '+':
+        return p[1] == '+' ? 2 : 1;
+    case '&':
+        return p[1] == '&' ? 2 : 1;
+    case '|':
+        // single "|" is not supported
+        return p[1] == '|' ? 2 : 0;
+    case '*':
+    case '/':
+    case '(':
+    case ')':
+    case ';':
+    case '{':
+    case '}':
+    case ',':
+    case '.':
+        // "..."
+        return p[1] == '.' && p[2] == '.' ? 3 : 1;
+    case '[':
+    case ']':
+    case '?':
+    case ':':
+        return 1;
+    default:
+        return 0;
     }
-    return len == 0;
 }
 
-// tokenize_next tokenizes the next characters.
-Token *tokenize_next(char **p, Token *cur) {
+// tokenize_next tokenizes the next characters into the given slot of the token ring.
+// Returns false if the characters are skipped without making a token.
+bool tokenize_next(char **p, int slot) {
     // Skip space characters
     if (isspace(**p)) {
         *p += 1;
-        return NULL;
+        return false;
     }
 
     // Skip line comment
     if (strncmp(*p, "//", 2) == 0) {
         *p += 2;
-        while (**p != '\n') {
+        // the input may end without a newline
+        while (**p != '\n' && **p != '\0') {
             *p += 1;
         }
-        *p += 1;
-        return NULL;
+        return false;
     }
 
     // Skip block comment
     if (strncmp(*p, "/*", 2) == 0) {
         char *q = strstr(*p + 2, "*/");
         if (!q) {
-            error_at(*p, "couldn't find comment closer");
+            char *start = *p;
+            // continue from the end, if recovered
+            *p += strlen(*p);
+            error_at(start, "couldn't find comment closer");
         }
         *p = q + 2;
-        return NULL;
-    }
-
-    // Check for symbols
-    for (size_t i = 0; i < sizeof(symbols) / sizeof(symbols[0]); i++) {
-        if (memcmp(symbols[i], *p, strlen(symbols[i])) == 0) {
-            Token *next = new_token(TK_RESERVED, cur, *p);
-            next->len = strlen(symbols[i]);
-            // proceed the pointer
-            *p += strlen(symbols[i]);
-            return next;
-        }
-    }
-
-    // Check for reserved keywords
-    for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++) {
-        size_t len = strlen(keywords[i]);
-        if (has_char_length(*p, len) &&
-            memcmp(*p, keywords[i], len) == 0 &&
-            !is_alnum((*p)[len])) {
-            Token *next = new_token(TK_KEYWORD, cur, *p);
-            next->len = len;
-            *p += len;
-            return next;
-        }
+        return false;
     }
 
-    // Check for identifiers (local variables)
+    // Check for identifiers (local variables) and reserved keywords
     if (is_variable_char(**p)) {
-        int len = 0;
-        Token *next = new_token(TK_IDENTIFIER, cur, *p);
+        char *start = *p;
         while (is_alnum(**p)) {
-            len++;
             *p += 1;
         }
-        next->len = len;
-        return next;
+        int len = *p - start;
+        bool keyword = is_keyword(start, len);
+        init_token(slot, keyword ? TK_KEYWORD : TK_IDENTIFIER, start);
+        token_lengths[slot] = len;
+        if (!keyword) {
+            token_values[slot].atom = intern(start, len);
+        }
+        return true;
+    }
+
+    // Check for symbols
+    int len = punctuator_length(*p);
+    if (len > 0) {
+        init_token(slot, TK_RESERVED, *p);
+        token_lengths[slot] = len;
+        // proceed the pointer
+        *p += len;
+        return true;
     }
 
     // Check for number
     if (isdigit(**p)) {
-        Token *next = new_token(TK_NUM, cur, *p);
-        next->val = strtol(*p, p, 10);
-        // Check for literal number type
+        char *start = *p;
+        init_token(slot, TK_NUM, start);
+        token_values[slot].val = strtol(*p, p, 10);
+        // Literal number type, see token_type()
         if (**p == 'l' || **p == 'L') {
-            next->type = new_type(LONG);
             *p += 1;
         }
-        return next;
+        token_lengths[slot] = *p - start;
+        return true;
     }
 
     // Check for string literal (quoted in double quote " character)
     if (**p == '"') {
         // NOTE: does not support escaping characters as of now
         *p += 1;
-        Token *literal = new_token(TK_STRING, cur, *p);
+        init_token(slot, TK_STRING, *p);
         int len = 0;
         while (**p != '"') {
             if (**p == '\0') {
-                error_at(literal->str, "unexpected EOF in string literal");
+                error_at(*p - len, "unexpected EOF in string literal");
             }
             len++;
             *p += 1;
         }
         // consume the last double quote " character
         *p += 1;
-        literal->len = len;
-        return literal;
+        token_lengths[slot] = len;
+        return true;
     }
 
-    // Check for char literal -> parse as number
+    // Check for char literal -> parse as number, including the quotes so that token_type() sees no suffix
     if (**p == '\'') {
         // NOTE: does not support escaping characters as of now
+        char *start = *p;
+        init_token(slot, TK_NUM, start);
         *p += 1;
-        Token *literal = new_token(TK_NUM, cur, *p);
-        literal->val = **p;
+        token_values[slot].val = **p;
         *p += 1;
         if (**p != '\'') {
             error_at(*p, "expected closing \' for char literal");
         }
         *p += 1;
-        return literal;
+        token_lengths[slot] = *p - start;
+        return true;
     }
 
-    error_at(*p, "Cannot tokenize");
+    // continue from the next character, if recovered
+    *p += 1;
+    error_at(*p - 1, "Cannot tokenize");
 }
 
-// tokenize tokenizes the given character sequence and returns it.
-Token *tokenize(char *p) {
-    Token head;
-    head.next = NULL;
-    Token *cur = &head;
-
+// lex_next lexes the next token into the token ring, overwriting the oldest one.
+void lex_next() {
+    int slot = (token_count + 1) % TOKEN_RING_SIZE;
     // While the next character is not a null character
-    while (*p) {
-        Token *next = tokenize_next(&p, cur);
-        if (next) {
-            cur = next;
+    while (*lex_cursor) {
+        if (tokenize_next(&lex_cursor, slot)) {
+            token_count++;
+            return;
         }
     }
+    init_token(slot, TK_EOF, lex_cursor);
+    token_count++;
+}
 
-    new_token(TK_EOF, cur, p);
-    return head.next;
+// advance proceeds to the next token, lexing it if not yet. Stays at the end of the tokens.
+void advance() {
+    if (token_kinds[token_slot] == TK_EOF) return;
+    if (token == token_count) {
+        lex_next();
+    }
+    token++;
+    token_slot = token % TOKEN_RING_SIZE;
+}
+
+// tokenize starts tokenizing the given character sequence.
+// The tokens are lexed on demand as the parser proceeds, keeping only the latest ones in the token ring.
+void tokenize(char *p) {
+    // tokens are located by 32-bit offsets
+    if (strlen(p) >= UINT32_MAX) {
+        error("%s: input too large", file_name);
+    }
+    lex_cursor = p;
+    token_count = 0;
+    lex_next();
+    token = 1;
+    token_slot = 1;
 }
 
 /**
@@ -391,7 +551,8 @@ stmt       = expr ";"
             | "continue" ";"
 init       = "{" (expr ("," expr)*)? "}" | expr
 expr       = assign
-assign     = logic_ors ("=" assign)?
+assign     = conditional ("=" assign)?
+conditional = logic_ors ("?" expr ":" conditional)?
 logic_ors  = logic "||" logic_ors
 logic      = equality "&&" logic
 equality   = relational ("==" relational | "!=" relational)*
@@ -416,38 +577,145 @@ primary_rest = "[" expr "]" primary_rest
             | ""
 */
 
+// node_arity returns the number of the children (left, right, third, and fourth) of the given node kind.
+int node_arity(NodeKind kind) {
+    switch (kind) {
+    case ND_ADDR:
+    case ND_DEREF:
+    case ND_LNOT:
+    case ND_RETURN:
+        return 1;
+    case ND_ASSIGN:
+    case ND_EQUAL:
+    case ND_NOT_EQUAL:
+    case ND_LESS_EQUAL:
+    case ND_LESS:
+    case ND_GREATER_EQUAL:
+    case ND_GREATER:
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_LAND:
+    case ND_LOR:
+    case ND_WHILE:
+        return 2;
+    case ND_COND:
+    case ND_SELECT:
+    case ND_IF:
+        return 3;
+    case ND_FOR:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+// has_items returns true if the nodes of the given kind have the list of items.
+bool has_items(NodeKind kind) {
+    return kind == ND_BLOCK || kind == ND_ARRAY || kind == ND_FUNC_CALL;
+}
+
+// node_size returns the size in bytes of the nodes of the given kind, without the items.
+size_t node_size(NodeKind kind) {
+    switch (kind) {
+    case ND_NUM:
+    case ND_CHAR:
+        return offsetof(Node, val) + sizeof(long);
+    case ND_LOCAL_VAR:
+    case ND_GLOBAL_VAR:
+        return offsetof(Node, atom) + sizeof(Atom*);
+    case ND_BLOCK:
+    case ND_ARRAY:
+    case ND_FUNC_CALL:
+        return offsetof(Node, items) + sizeof(Node**);
+    case ND_STRING:
+        return offsetof(Node, len) + sizeof(int);
+    case ND_IF:
+    case ND_COND:
+    case ND_WHILE:
+        // the children and the profile counter
+        return offsetof(Node, fourth);
+    case ND_FOR:
+        return sizeof(Node);
+    default:
+        return offsetof(Node, left) + node_arity(kind) * sizeof(Node*);
+    }
+}
+
+// allocate_node_of_size allocates a new empty AST node of the given kind and size.
+Node *allocate_node_of_size(NodeKind kind, size_t size) {
+    node_count++;
+    Node *node = allocate(size);
+    node->kind = kind;
+    // nodes made after parsing (e.g. by the passes) have no source location
+    if (token) {
+        node->loc = token_str(token);
+    }
+    return node;
+}
+
+// allocate_node allocates a new empty AST node of the given kind, only as large as the kind needs.
+Node *allocate_node(NodeKind kind) {
+    return allocate_node_of_size(kind, node_size(kind));
+}
+
 // new_node creates a new AST node according to the given right and left children.
 Node *new_node(NodeKind kind, Node *left, Node *right) {
-    Node *node = calloc(1, sizeof(Node));
-    node->kind = kind;
+    Node *node = allocate_node(kind);
     node->left = left;
-    node->right = right;
+    if (node_arity(kind) > 1) {
+        node->right = right;
+    }
+    return node;
+}
+
+// new_list_node creates a new ND_BLOCK, ND_ARRAY, or ND_FUNC_CALL node with the given items,
+// which are copied right after the node.
+Node *new_list_node(NodeKind kind, Vector *items) {
+    int count = vector_count(items);
+    Node *node = allocate_node_of_size(kind, node_size(kind) + count * sizeof(Node*));
+    node->count = count;
+    node->items = (Node**) ((char*) node + node_size(kind));
+    for (int i = 0; i < count; i++) {
+        node->items[i] = (Node*) vector_get(items, i);
+    }
     return node;
 }
 
 // new_node_num creates a new ND_NUM node.
 Node *new_node_num(long val) {
-    Node *node = calloc(1, sizeof(Node));
-    node->kind = ND_NUM;
+    Node *node = allocate_node(ND_NUM);
     node->val = val;
     return node;
 }
 
 // new_node_char creates a new ND_CHAR node.
 Node *new_node_char(int val) {
-    Node *node = calloc(1, sizeof(Node));
-    node->kind = ND_CHAR;
+    Node *node = allocate_node(ND_CHAR);
     node->val = val;
     return node;
 }
 
-// find_local_var returns local var struct if name in the given token has been used before; returns NULL otherwise.
-LocalVar *find_local_var(Token *tok) {
-    // Not inside function parsing
-    if (!locals) return NULL;
-    for (int i = 0; i < vector_count(locals); i++) {
-        LocalVar *var = (LocalVar*) vector_get(locals, i);
-        if (var->len == tok->len && memcmp(var->name, tok->str, var->len) == 0) {
+// enter_scope starts a new block scope of local variables.
+void enter_scope() {
+    Scope *sc = arena_alloc(&scope_arena, sizeof(Scope));
+    sc->vars = new_map_in(&scope_arena);
+    sc->parent = scope;
+    scope = sc;
+}
+
+// leave_scope ends the innermost block scope. Its variables keep their stack slots.
+void leave_scope() {
+    scope = scope->parent;
+}
+
+// find_local_var returns the local var visible from the current scope with the name in the given token;
+// returns NULL if not found.
+LocalVar *find_local_var(Atom *name) {
+    for (Scope *sc = scope; sc; sc = sc->parent) {
+        LocalVar *var = (LocalVar*) map_get(sc->vars, name);
+        if (var) {
             return var;
         }
     }
@@ -455,64 +723,126 @@ LocalVar *find_local_var(Token *tok) {
 }
 
 // find_global_var returns global var if the global var has already been declared; returns NULL otherwise.
-GlobalVar *find_global_var(Token *tok) {
-    for (int i = 0; i < vector_count(globals); i++) {
-        GlobalVar *var = (GlobalVar*) vector_get(globals, i);
-        if (var->len == tok->len && memcmp(var->name, tok->str, var->len) == 0) {
-            return var;
-        }
-    }
-    return NULL;
+GlobalVar *find_global_var(Atom *name) {
+    return (GlobalVar*) map_get(global_map, name);
 }
 
-// Retrieves identifier for the given type. Returns NULL if not found.
-Token *retrieve_type_identifier(Type *ty) {
-    Type *next = ty;
-    while (next->ptr_to && next->str == NULL) {
-        next = next->ptr_to;
-    }
-    if (next->str == NULL) {
-        return NULL;
-    }
-    Token *ret = calloc(1, sizeof(Token));
-    ret->str = next->str;
-    ret->len = next->len;
-    return ret;
+// align_to rounds up the given offset to the multiple of the alignment.
+int align_to(int offset, int align) {
+    return (offset + align - 1) / align * align;
 }
 
-// new_local_var returns a local variable as node.
+// claim_local_offset claims the stack space for a local variable of the given type, and returns its offset from rbp.
+int claim_local_offset(Type *ty) {
+    locals_offset = align_to(locals_offset + size_of(ty), ty->align);
+    return locals_offset;
+}
+
+// new_local_var returns a local variable with the given name as node.
 // Always generates a new local variable and appends it to the current local variables.
-Node *new_local_var(Type *ty) {
-    LocalVar *var = calloc(1, sizeof(LocalVar));
-    Token *name = retrieve_type_identifier(ty);
+Node *new_local_var(Type *ty, Token *name) {
+    LocalVar *var = arena_alloc(&scope_arena, sizeof(LocalVar));
     if (name == NULL) {
-        error_at(token->str, "expected identifier for a variable");
+        error_at(token_str(token), "expected identifier for a variable");
     }
     var->name = name->str;
     var->len = name->len;
+    var->atom = name->atom;
+    if (map_get(scope->vars, var->atom)) {
+        error_at(var->name, "Variable %.*s has already been declared in this scope", var->len, var->name);
+    }
     // claim offset only if the size is already defined (array size could be defined by initializer at local_var_init())
     if (!(ty->ty == ARRAY && ty->array_size == -1)) {
-        if (vector_count(locals) == 0) {
-            var->offset = size_of(ty);
-        } else {
-            LocalVar *last_var = (LocalVar*) vector_get_last(locals);
-            var->offset = last_var->offset + size_of(ty);
-        }
+        var->offset = claim_local_offset(ty);
     }
     var->type = ty;
-    vector_add(locals, var);
+    map_put(scope->vars, var->atom, var);
 
-    Node *node = calloc(1, sizeof(Node));
-    node->kind = ND_LOCAL_VAR;
+    Node *node = allocate_node(ND_LOCAL_VAR);
     node->offset = var->offset;
     node->type = ty;
+    node->loc = var->name;
+    node->atom = var->atom;
     return node;
 }
 
-// new_type constructs struct type with the given type kind.
-Type *new_type(TypeKind kind) {
-    Type *ty = calloc(1, sizeof(Type));
+// Number of buckets of the type table, must be a power of 2
+#define TYPE_TABLE_SIZE 1024
+
+// Canonical ARRAY and FUNC types, chained by next_in_bucket
+Type *type_table[TYPE_TABLE_SIZE];
+
+// new_type constructs a type with the given type kind. Canonical types live until the end of the compilation.
+Type *new_type(TypeKind kind, size_t size, int align) {
+    Type *ty = arena_alloc(&permanent_arena, sizeof(Type));
     ty->ty = kind;
+    ty->size = size;
+    ty->align = align;
+    return ty;
+}
+
+// pointer_to returns the canonical pointer type to the given type.
+Type *pointer_to(Type *base) {
+    if (!base->pointer) {
+        Type *ty = new_type(PTR, 8, 8);
+        ty->ptr_to = base;
+        base->pointer = ty;
+    }
+    return base->pointer;
+}
+
+// type_bucket returns the bucket of the type table for the given hash.
+Type **type_bucket(unsigned long hash) {
+    return &type_table[(hash ^ (hash >> 17)) & (TYPE_TABLE_SIZE - 1)];
+}
+
+// array_of returns the canonical array type of the given element type and length (-1 if not yet known).
+Type *array_of(Type *base, size_t array_size) {
+    Type **bucket = type_bucket((unsigned long) base / sizeof(Type) * 31 + array_size);
+    for (Type *ty = *bucket; ty; ty = ty->next_in_bucket) {
+        if (ty->ty == ARRAY && ty->ptr_to == base && ty->array_size == array_size) {
+            return ty;
+        }
+    }
+    Type *ty = new_type(ARRAY, array_size == -1 ? 0 : array_size * base->size, base->align);
+    ty->ptr_to = base;
+    ty->array_size = array_size;
+    ty->next_in_bucket = *bucket;
+    *bucket = ty;
+    return ty;
+}
+
+// func_type returns the canonical function type of the given return type and parameter types.
+// params: elements: Type*
+// variadic: true if the function takes variable arguments after params
+Type *func_type(Type *ret, Vector *params, bool variadic) {
+    unsigned long hash = (unsigned long) ret / sizeof(Type) + variadic;
+    for (int i = 0; i < vector_count(params); i++) {
+        hash = hash * 31 + (unsigned long) vector_get(params, i) / sizeof(Type);
+    }
+    Type **bucket = type_bucket(hash);
+    for (Type *ty = *bucket; ty; ty = ty->next_in_bucket) {
+        if (ty->ty != FUNC || ty->ptr_to != ret || ty->variadic != variadic
+            || vector_count(ty->params) != vector_count(params)) continue;
+        bool same = true;
+        for (int i = 0; i < vector_count(params) && same; i++) {
+            same = vector_get(ty->params, i) == vector_get(params, i);
+        }
+        if (same) {
+            return ty;
+        }
+    }
+    // implicit conversion to pointer
+    Type *ty = new_type(FUNC, 8, 8);
+    ty->ptr_to = ret;
+    // params may be temporary
+    ty->params = new_vector_in(&permanent_arena);
+    for (int i = 0; i < vector_count(params); i++) {
+        vector_add(ty->params, vector_get(params, i));
+    }
+    ty->variadic = variadic;
+    ty->next_in_bucket = *bucket;
+    *bucket = ty;
     return ty;
 }
 
@@ -531,37 +861,35 @@ Type *type_of(Node *node) {
         case ND_LESS:
         case ND_GREATER_EQUAL:
         case ND_GREATER:
-            return new_type(INT);
+            return &int_type;
         case ND_ADD:
         case ND_SUB:
         case ND_MUL:
         case ND_DIV:
             return type_of(node->left);
-        case ND_ADDR: ;
-            Type *to = type_of(node->left);
-            Type *ty = new_type(PTR);
-            ty->ptr_to = to;
-            return ty;
+        case ND_ADDR:
+            return pointer_to(type_of(node->left));
         case ND_DEREF: ;
-            ty = type_of(node->left);
+            Type *ty = type_of(node->left);
             // implicit conversion of array to pointer
             if (ty->ty != PTR && ty->ty != ARRAY) {
-                error_at(node->str, "Dereference not to a pointer or an array");
+                error_at(node->loc, "Dereference not to a pointer or an array");
             }
             return ty->ptr_to;
+        case ND_COND:
+        case ND_SELECT:
+            return type_of(node->right);
         case ND_LAND:
         case ND_LOR:
         case ND_LNOT:
             // treat results of logic operators (always 1 or 0) as type int
-            return new_type(INT);
-        case ND_FUNC_CALL:
-            for (int i = 0; i < vector_count(functions); i++) {
-                Node *stmt = (Node*) vector_get(functions, i);
-                if (memcmp(stmt->str, node->str, node->len) == 0) {
-                    return stmt->type;
-                }
+            return &int_type;
+        case ND_FUNC_CALL: ;
+            Function *callee = (Function*) map_get(function_map, node->atom);
+            if (!callee) {
+                error_at(node->loc, "Unknown function");
             }
-            error_at(node->str, "Unknown function");
+            return callee->type->ptr_to;
         case ND_GLOBAL_VAR:
         case ND_LOCAL_VAR:
             if (node->type == NULL) {
@@ -569,103 +897,23 @@ Type *type_of(Node *node) {
             }
             return node->type;
         case ND_NUM:
-            return new_type(INT);
+            return &int_type;
         case ND_CHAR:
-            return new_type(CHAR);
+            return &char_type;
         case ND_STRING:
-            ty = new_type(ARRAY);
-            ty->ptr_to = new_type(CHAR);
             // +1: null sequence
-            ty->array_size = node->len + 1;
-            return ty;
+            return array_of(&char_type, node->len + 1);
     }
 
     error("unknown type");
 }
 
-bool type_equals(Type *first, Type *second);
-
-// defined_type_equals deeply checks the DefinedType struct equality.
-bool defined_type_equals(DefinedType *first, DefinedType *second) {
-    if (strcmp(first->name, second->name) != 0) {
-        return false;
-    }
-    return type_equals(first->ty, second->ty);
-}
-
-// type_equals deeply checks the type equality.
-bool type_equals(Type *first, Type *second) {
-    if (first->ty != second->ty) {
-        return false;
-    }
-    switch (first->ty) {
-    case VOID:
-    case CHAR:
-    case INT:
-    case LONG:
-        return true;
-    case PTR:
-    case ARRAY:
-        return type_equals(first->ptr_to, second->ptr_to);
-    case FUNC:
-        if (vector_count(first->params) != vector_count(second->params)) {
-            return false;
-        }
-        for (int i = 0; i < vector_count(first->params); i++) {
-            Type *first_arg = vector_get(first->params, i);
-            Type *second_arg = vector_get(second->params, i);
-            if (!type_equals(first_arg, second_arg)) {
-                return false;
-            }
-        }
-        return true;
-    case STRUCT:
-        if (vector_count(first->params) != vector_count(second->params)) {
-            return false;
-        }
-        for (int i = 0; i < vector_count(first->params); i++) {
-            DefinedType *first_member = (DefinedType*) vector_get(first->params, i);
-            DefinedType *second_member = (DefinedType*) vector_get(second->params, i);
-            if (defined_type_equals(first_member, second_member)) {
-                return false;
-            }
-        }
-        return true;
-    }
-    error("type equals not implemented");
-}
-
 // size_of returns the size of the given type in bytes.
 size_t size_of(Type *ty) {
-    switch (ty->ty) {
-    case VOID:
-        return 0;
-    case CHAR:
-        return 1;
-    case INT:
-        return 4;
-    case LONG:
-        return 8;
-    case PTR:
-        return 8;
-    case ARRAY:
-        if (ty->array_size == -1) {
-            error_at(token->str, "array size is undefined");
-        }
-        return ty->array_size * size_of(ty->ptr_to);
-    case FUNC:
-        // implicit conversion to pointer
-        return 8;
-    case STRUCT: ;
-        // sum of all member sizes
-        int size = 0;
-        for (int i = 0; i < vector_count(ty->params); i++) {
-            DefinedType *member = (DefinedType*) vector_get(ty->params, i);
-            size += size_of(member->ty);
-        }
-        return size;
+    if (ty->ty == ARRAY && ty->array_size == -1) {
+        error_at(token_str(token), "array size is undefined");
     }
-    error("size_of not implemented");
+    return ty->size;
 }
 
 // Helper function for eval_global_init
@@ -677,22 +925,20 @@ bool init_node_equals(Node *first, Node *second) {
     case ND_NUM:
         return first->val == second->val;
     case ND_GLOBAL_VAR:
-        return first->len == second->len
-            && strncmp(first->str, second->str, first->len) == 0
-            && first->offset == second->offset;
+        return first->atom == second->atom && first->offset == second->offset;
     case ND_ADD:
     case ND_SUB:
         return init_node_equals(first->left, second->left) && init_node_equals(first->right, second->right);
     }
 
-    error_at(first->str, "expected ND_NUM, ND_GLOBAL_VAR, ND_ADD or ND_SUB but got %d", first->kind);
+    error_at(first->loc, "expected ND_NUM, ND_GLOBAL_VAR, ND_ADD or ND_SUB but got %d", first->kind);
 }
 
 // Helper function for eval_global_init
 // Returns the number of the node with ND_NUM. If the kind of the node is not ND_NUM, throws an error.
 long eval_number(Node *num) {
     if (num->kind != ND_NUM) {
-        error_at(num->str, "expected number");
+        error_at(num->loc, "expected number");
     }
     return num->val;
 }
@@ -711,7 +957,7 @@ Node *retrieve_global_var(Node *node) {
             return retrieve_global_var(node->right);
         }
     }
-    error_at(node->str, "expected global variable inside this node, but not found");
+    error_at(node->loc, "expected global variable inside this node, but not found");
 }
 
 // Helper function for eval_global_init
@@ -732,7 +978,7 @@ int size_of_ptr(Node *node) {
 Node *eval_global_init(Node *node) {
     switch (node->kind) {
     case ND_ASSIGN: // =
-        error_at(node->str, "assigning at initializer not allowed");
+        error_at(node->loc, "assigning at initializer not allowed");
     case ND_EQUAL: // == // NOTE: equality comparison of only numbers
         return new_node_num(init_node_equals(eval_global_init(node->left), eval_global_init(node->right)));
     case ND_NOT_EQUAL: // !=
@@ -781,7 +1027,7 @@ Node *eval_global_init(Node *node) {
             }
             return node;
         } else {
-            error_at(node->str, "unsupported operand types");
+            error_at(node->loc, "unsupported operand types");
         }
     case ND_MUL: // *
         first = eval_global_init(node->left);
@@ -793,7 +1039,7 @@ Node *eval_global_init(Node *node) {
         return new_node_num(eval_number(first) / eval_number(second));
     case ND_ADDR: // &
         if (node->left->kind != ND_GLOBAL_VAR) {
-            error_at(node->left->str, "expected global variable");
+            error_at(node->left->loc, "expected global variable");
         }
         return node->left;
     case ND_LAND: // &&
@@ -807,14 +1053,17 @@ Node *eval_global_init(Node *node) {
     case ND_LNOT: // !
         first = eval_global_init(node->left);
         return new_node_num(!eval_number(first));
-    case ND_FUNC: // function
-        // TODO: support taking address of functions
-        error_at(node->str, "taking address of functions is not supported");
+    case ND_COND: // ?:
+        first = eval_global_init(node->left);
+        if (eval_number(first)) {
+            return eval_global_init(node->right);
+        }
+        return eval_global_init(node->third);
     case ND_GLOBAL_VAR: // Global variable
         if (node->type->ty == PTR || node->type->ty == ARRAY) {
             return node;
         }
-        error_at(node->str, "initializer element is not constant");
+        error_at(node->loc, "initializer element is not constant");
     case ND_STRING: // String literal
         return node;
     case ND_NUM: // Number
@@ -823,114 +1072,82 @@ Node *eval_global_init(Node *node) {
     case ND_ARRAY:
         // validate
         if (!node->type || node->type->ty != ARRAY) {
-            error_at(node->str, "expected array type");
+            error_at(node->loc, "expected array type");
         }
-        for (int i = 0; i < vector_count(node->arguments); i++) {
-            Node *elt = (Node*) vector_get(node->arguments, i);
-            if (!type_equals(node->type->ptr_to, type_of(elt))) {
-                error_at(token->str, "unmatched type in array initializer element");
+        for (int i = 0; i < node->count; i++) {
+            Node *elt = node->items[i];
+            if (node->type->ptr_to != type_of(elt)) {
+                error_at(token_str(token), "unmatched type in array initializer element");
             }
-            vector_set(node->arguments, i, eval_global_init(elt));
+            node->items[i] = eval_global_init(elt);
         }
         return node;
     }
 
-    error_at(node->str, "invalid initializer");
+    error_at(node->loc, "invalid initializer");
 }
 
 Node *expr();
 
+// find_member returns the member of the given struct type with the name of the given identifier.
+DefinedType *find_member(Type *ty, TokenIndex ident) {
+    for (int i = 0; i < vector_count(ty->params); i++) {
+        DefinedType *member = (DefinedType*) vector_get(ty->params, i);
+        if (member->atom == token_atom(ident)) {
+            return member;
+        }
+    }
+    error_at(token_str(ident), "member with name %.*s not found", token_len(ident), token_str(ident));
+}
+
 Node *primary_rest(Node *node) {
     if (consume("[")) {
         // parse "a[b]" syntax (array indexing) as "*(a + b)"
-        Node *parent = calloc(1, sizeof(Node));
+        Node *parent = allocate_node(ND_DEREF);
         Node *right = expr();
         expect("]");
 
-        parent->kind = ND_DEREF;
-        Node *adder = calloc(1, sizeof(Node));
-        adder->kind = ND_ADD;
-        adder->left = node;
-        adder->right = right;
-        parent->left = adder;
+        parent->left = new_node(ND_ADD, node, right);
         return primary_rest(parent);
     } else if (consume(".")) {
         // structure (and union) member access
-        Token *ident = expect_identifier();
+        TokenIndex ident = expect_identifier();
         Type *type = type_of(node);
         node->type = type;
 
         if (type->ty != STRUCT) {
-            error_at(ident->str, "cannot access %.*s of a non-struct type", ident->len, ident->str);
-        }
-
-        // search member
-        Type *member_type = NULL;
-        int offset = 0;
-        for (int i = 0; i < vector_count(type->params); i++) {
-            DefinedType *member = (DefinedType*) vector_get(type->params, i);
-            if (strlen(member->name) == ident->len
-            && memcmp(member->name, ident->str, ident->len) == 0) {
-                member_type = member->ty;
-                break;
-            } else {
-                offset += size_of(member->ty);
-            }
-        }
-        if (member_type == NULL) {
-            error_at(ident->str, "member with name %.*s not found", ident->len, ident->str);
+            error_at(token_str(ident), "cannot access %.*s of a non-struct type", token_len(ident), token_str(ident));
         }
+        DefinedType *member = find_member(type, ident);
 
         // construct AST as *(node + offset)
-        Node *parent = calloc(1, sizeof(Node));
-        parent->kind = ND_DEREF;
-        parent->left = new_node(ND_ADD, node, new_node_num(offset));
+        Node *parent = allocate_node(ND_DEREF);
+        parent->left = new_node(ND_ADD, node, new_node_num(member->offset));
         // for code generator (ND_DEREF) to know that it's loading from the member
-        Type *deref_type = new_type(PTR);
-        deref_type->ptr_to = member_type;
-        parent->left->type = deref_type;
-        parent->type = member_type;
+        parent->left->type = pointer_to(member->ty);
+        parent->type = member->ty;
         return primary_rest(parent);
     } else if (consume("->")) {
         // structure (and union) member access through pointer
-        Token *ident = expect_identifier();
+        TokenIndex ident = expect_identifier();
         Type *type = type_of(node);
         node->type = type;
 
         if (type->ty != PTR) {
-            error_at(ident->str, "cannot access %.*s of a non-pointer type", ident->len, ident->str);
+            error_at(token_str(ident), "cannot access %.*s of a non-pointer type", token_len(ident), token_str(ident));
         }
         type = type->ptr_to;
         if (!type || type->ty != STRUCT) {
-            error_at(ident->str, "cannot access %.*s of a non-struct type", ident->len, ident->str);
-        }
-
-        // search member
-        Type *member_type = NULL;
-        int offset = 0;
-        for (int i = 0; i < vector_count(type->params); i++) {
-            DefinedType *member = (DefinedType*) vector_get(type->params, i);
-            if (strlen(member->name) == ident->len
-            && memcmp(member->name, ident->str, ident->len) == 0) {
-                member_type = member->ty;
-                break;
-            } else {
-                offset += size_of(member->ty);
-            }
-        }
-        if (member_type == NULL) {
-            error_at(ident->str, "member with name %.*s not found", ident->len, ident->str);
+            error_at(token_str(ident), "cannot access %.*s of a non-struct type", token_len(ident), token_str(ident));
         }
+        DefinedType *member = find_member(type, ident);
 
         // construct AST as *(*node + offset)
-        Node *parent = calloc(1, sizeof(Node));
-        parent->kind = ND_DEREF;
-        parent->left = new_node(ND_ADD, new_node(ND_DEREF, node, NULL), new_node_num(offset));
+        Node *parent = allocate_node(ND_DEREF);
+        parent->left = new_node(ND_ADD, new_node(ND_DEREF, node, NULL), new_node_num(member->offset));
         // for code generator (ND_DEREF) to know that it's loading from the member
-        Type *deref_type = new_type(PTR);
-        deref_type->ptr_to = member_type;
-        parent->left->type = deref_type;
-        parent->type = member_type;
+        parent->left->type = pointer_to(member->ty);
+        parent->type = member->ty;
         return primary_rest(parent);
     }
     return node;
@@ -946,13 +1163,12 @@ Node *primary() {
     }
 
     // String literal
-    Token *tok = consume_string();
+    TokenIndex tok = consume_string();
     if (tok) {
-        Node *node = calloc(1, sizeof(Node));
-        node->kind = ND_STRING;
-        node->str = tok->str;
-        node->len = tok->len;
-        node->label = vector_count(strings);
+        Node *node = allocate_node(ND_STRING);
+        node->str = token_str(tok);
+        node->len = token_len(tok);
+        node->label = string_count++;
         vector_add(strings, node);
         return primary_rest(node);
     }
@@ -963,12 +1179,10 @@ Node *primary() {
         // Function call
         if (consume("(")) {
             // TODO: check if the function has been declared (including prototype declaration)
-            Node *node = calloc(1, sizeof(Node));
-            node->kind = ND_FUNC_CALL;
-            node->str = tok->str;
-            node->len = tok->len;
-
-            Vector *arguments = new_vector();
+            char *loc = token_str(token);
+            // the slot of the name in the token ring may be reused while parsing long arguments
+            Atom *atom = token_atom(tok);
+            Vector *arguments = new_vector_in(&scope_arena);
             while (!consume(")")) {
                 vector_add(arguments, expr());
                 if (!consume(",")) {
@@ -976,47 +1190,59 @@ Node *primary() {
                     break;
                 }
             }
-            node->arguments = arguments;
+            Node *node = new_list_node(ND_FUNC_CALL, arguments);
+            node->loc = loc;
+            node->atom = atom;
             return primary_rest(node);
         }
 
         // Local variable or global variable
-        Node *node = calloc(1, sizeof(Node));
-        LocalVar *var = find_local_var(tok);
+        Node *node;
+        LocalVar *var = find_local_var(token_atom(tok));
         if (var) {
-            node->kind = ND_LOCAL_VAR;
+            node = allocate_node(ND_LOCAL_VAR);
             node->offset = var->offset;
             node->type = var->type;
-            node->str = var->name;
-            node->len = var->len;
+            node->atom = var->atom;
         } else {
-            GlobalVar *var = find_global_var(tok);
+            GlobalVar *var = find_global_var(token_atom(tok));
             // If the variable has not been declared, raise an error
             if (!var) {
-                error_at(tok->str, "Variable %.*s has not been declared", tok->len, tok->str);
+                error_at(token_str(tok), "Variable %.*s has not been declared", token_len(tok), token_str(tok));
             }
 
-            node->kind = ND_GLOBAL_VAR;
+            node = allocate_node(ND_GLOBAL_VAR);
             node->offset = var->offset;
             node->type = var->type;
-            node->str = var->name;
-            node->len = var->len;
+            node->atom = var->atom;
         }
+        node->loc = token_str(tok);
 
         return primary_rest(node);
     }
 
     // Otherwise expect a number.
-    Token *num = expect_number();
-    Node *num_node = new_node_num(num->val);
-    if (num->type) {
-        num_node->type = num->type;
+    TokenIndex num = expect_number();
+    Node *num_node = new_node_num(token_val(num));
+    Type *literal_type = token_type(num);
+    if (literal_type) {
+        num_node->type = literal_type;
     }
     return num_node;
 }
 
+typedef struct Declarator Declarator;
+
+// Declarator holds the parts of a declaration other than its type.
+struct Declarator {
+    // declared identifier, NULL if abstract (e.g. "sizeof(int*)")
+    Token *name;
+    // parameter names of the function declarator, elements: Token* (NULL if unnamed)
+    Vector *param_names;
+};
+
 Type *base_type();
-Type *type(Type *base);
+Type *type(Type *base, Declarator *decl);
 
 // unary parses the next 'unary' (in EBNF) as AST.
 Node *unary() {
@@ -1024,7 +1250,8 @@ Node *unary() {
         int consumed = consume("(");
         Type *base = base_type();
         if (base) {
-            Type *ty = type(base);
+            Declarator decl = {0};
+            Type *ty = type(base, &decl);
             if (consumed) expect(")");
             return new_node_num(size_of(ty));
         }
@@ -1049,18 +1276,15 @@ Node *unary() {
     } else if (consume("-")) {
         return new_node(ND_SUB, new_node_num(0), primary());
     } else if (consume("!")) {
-        Node *node = calloc(1, sizeof(Node));
-        node->kind = ND_LNOT;
+        Node *node = allocate_node(ND_LNOT);
         node->left = unary();
         return node;
     } else if (consume("*")) {
-        Node *node = calloc(1, sizeof(Node));
-        node->kind = ND_DEREF;
+        Node *node = allocate_node(ND_DEREF);
         node->left = unary();
         return node;
     } else if (consume("&")) {
-        Node *node = calloc(1, sizeof(Node));
-        node->kind = ND_ADDR;
+        Node *node = allocate_node(ND_ADDR);
         node->left = unary();
         return node;
     } else {
@@ -1150,9 +1374,26 @@ Node *logic_ors() {
     return node;
 }
 
+// conditional parses the next 'conditional' (in EBNF) as AST.
+Node *conditional() {
+    Node *node = logic_ors();
+    if (consume("?")) {
+        Node *cond = allocate_node(ND_COND);
+        cond->left = node;
+        cond->right = expr();
+        expect(":");
+        cond->third = conditional();
+        // Labels: end, else
+        cond->label = next_label;
+        next_label += 2;
+        return cond;
+    }
+    return node;
+}
+
 // assign parses the next 'assign' (in EBNF) as AST.
 Node *assign() {
-    Node *node = logic_ors();
+    Node *node = conditional();
     if (consume("=")) {
         node = new_node(ND_ASSIGN, node, assign());
     }
@@ -1164,68 +1405,75 @@ Node *expr() {
     return assign();
 }
 
-DefinedType *new_defined_type(char *str, int len, Type *ty) {
-    DefinedType *defined = calloc(1, sizeof(DefinedType));
-    char *name = calloc(1, len + 1);
-    memcpy(name, str, len);
-    defined->name = name;
+// new_defined_type returns a new named type. Types outlive the functions they are defined in.
+DefinedType *new_defined_type(Atom *atom, Type *ty) {
+    DefinedType *defined = arena_alloc(&permanent_arena, sizeof(DefinedType));
+    defined->atom = atom;
     defined->ty = ty;
     return defined;
 }
 
 // struct_type parses struct type after consuming "struct" keyword.
 Type *struct_type() {
-    Token *ident = consume_identifier();
+    TokenIndex ident = consume_identifier();
     if (ident) {
         // if identifier is found
         // e.g. "struct MyStruct"
         // either a new struct type declaration, or type reference
         if (!consume("{")) {
             // type reference
-            for (int i = 0; i < vector_count(structs); i++) {
-                DefinedType *definedStruct = (DefinedType*) vector_get(structs, i);
-                if (ident->len == strlen(definedStruct->name)
-                && memcmp(definedStruct->name, ident->str, ident->len) == 0) {
-                    return definedStruct->ty;
-                }
+            DefinedType *definedStruct = (DefinedType*) map_get(structs, token_atom(ident));
+            if (definedStruct) {
+                return definedStruct->ty;
             }
-            error_at(ident->str, "struct %.*s is not defined", ident->len, ident->str);
+            error_at(token_str(ident), "struct %.*s is not defined", token_len(ident), token_str(ident));
         }
     } else {
         expect("{");
     }
 
     // consumed "{", new struct type declaration
-    Type *ty = new_type(STRUCT);
-    ty->params = new_vector();
+    // size and alignment are fixed after the members
+    Type *ty = new_type(STRUCT, 0, 1);
+    ty->params = new_vector_in(&permanent_arena);
 
     // to allow declaring the self struct type in members
     // e.g. "struct MyStruct { ... }"
     if (ident) {
         // define struct
-        ty->str = ident->str;
-        ty->len = ident->len;
-        DefinedType *defined = new_defined_type(ident->str, ident->len, ty);
-        vector_add(structs, defined);
+        ty->str = token_str(ident);
+        ty->len = token_len(ident);
+        ty->atom = token_atom(ident);
+        DefinedType *defined = new_defined_type(ty->atom, ty);
+        map_put(structs, defined->atom, defined);
     }
 
     // struct member declarations
+    int offset = 0;
     while (!consume("}")) {
         Type *member_base_type = base_type();
         if (member_base_type == NULL) {
-            error_at(token->str, "expected base type");
+            error_at(token_str(token), "expected base type");
         }
-        Type *member_type = type(member_base_type);
-        Token *member_name = retrieve_type_identifier(member_type);
-        if (member_name == NULL) {
-            error_at(token->str, "expected member name at struct definition");
+        Declarator decl = {0};
+        Type *member_type = type(member_base_type, &decl);
+        if (decl.name == NULL) {
+            error_at(token_str(token), "expected member name at struct definition");
         }
 
-        DefinedType *member = new_defined_type(member_name->str, member_name->len, member_type);
+        // lay out the members in order, each aligned to its own alignment
+        DefinedType *member = new_defined_type(decl.name->atom, member_type);
+        offset = align_to(offset, member_type->align);
+        member->offset = offset;
+        offset += size_of(member_type);
+        if (member_type->align > ty->align) {
+            ty->align = member_type->align;
+        }
         vector_add(ty->params, member);
 
         expect(";");
     }
+    ty->size = align_to(offset, ty->align);
 
     // even if no identifier was found, just return the type
     return ty;
@@ -1235,35 +1483,27 @@ Type *struct_type() {
 // Returns NULL otherwise.
 Type *base_type() {
     if (consume_keyword("char")) {
-        return new_type(CHAR);
+        return &char_type;
     } else if (consume_keyword("int")) {
-        return new_type(INT);
+        return &int_type;
     } else if (consume_keyword("long")) {
-        return new_type(LONG);
+        return &long_type;
     } else if (consume_keyword("void")) {
-        return new_type(VOID);
+        return &void_type;
     } else if (consume_keyword("struct")) {
         return struct_type();
     }
-    for (int i = 0; i < vector_count(types); i++) {
-        DefinedType *definedType = (DefinedType*) vector_get(types, i);
-        if (consume_identifier_with_name(definedType->name)) {
-            // shallow copy the type to prevent sharing the same struct ptr
-            Type *ret = malloc(sizeof(Type));
-            *ret = *(definedType->ty);
-            return ret;
-        }
+    DefinedType *definedType = consume_defined_type();
+    if (definedType) {
+        return definedType->ty;
     }
     return NULL;
 }
 
 // ptr_type parses the (pointer part of the) type.
 Type *ptr_type(Type* base) {
-    if (consume("*")) {
-        Type *ty = calloc(1, sizeof(Type));
-        ty->ty = PTR;
-        ty->ptr_to = ptr_type(base);
-        return ty;
+    while (consume("*")) {
+        base = pointer_to(base);
     }
     return base;
 }
@@ -1271,94 +1511,100 @@ Type *ptr_type(Type* base) {
 // array_type parses the (array part of the) type.
 Type *array_type(Type *base) {
      if (consume("[")) {
-        Token *num = consume_number();
+        TokenIndex num = consume_number();
         int size = -1;
         if (num) {
-            size = num->val;
+            size = token_val(num);
             if (size < 0) {
-                error_at(token->str, "Array size must not be negative");
+                error_at(token_str(token), "Array size must not be negative");
             }
         }
         expect("]");
-        Type *ty = calloc(1, sizeof(Type));
-        ty->ty = ARRAY;
-        ty->array_size = size;
-        ty->ptr_to = array_type(base);
-        return ty;
+        return array_of(array_type(base), size);
     }
     return base;
 }
 
-// combine_nested_type is a helper function for nested type parsing.
-Type *combine_nested_type(Type *nested, Type *base) {
-    Type *next = nested;
-    while (next->ty != -1) {
-        next = next->ptr_to;
+// skip_parens skips the tokens up to the ")" matching the already consumed "(".
+void skip_parens() {
+    int depth = 1;
+    while (depth > 0) {
+        if (at_eof()) {
+            error_at(token_str(token), "expected \")\"");
+        }
+        if (consume("(")) {
+            depth++;
+        } else if (consume(")")) {
+            depth--;
+        } else {
+            advance();
+        }
     }
-    // copy base type info
-    next->ty = base->ty;
-    next->ptr_to = base->ptr_to;
-    next->array_size = base->array_size;
-    next->params = base->params;
-    return nested;
 }
 
-// type parses the next 'type' in EBNF. Parses nested type.
-Type *type(Type *base) {
-    Type *ptr_ty = ptr_type(base);
-    Type *nested = NULL;
-    Token *tok = NULL;
-    if (consume("(")) {
-        // nested type
-        // combine base type later
-        nested = type(new_type(-1));
-        expect(")");
-    } else {
-        // variable or function identifier
-        tok = consume_identifier();
-    }
+// type_suffix parses the array or function part of the type after the identifier.
+Type *type_suffix(Type *base, Declarator *decl) {
     if (!consume("(")) {
-        Type *ret;
-        if (nested) {
-            ret = combine_nested_type(nested, array_type(ptr_ty));
-        } else {
-            ret = array_type(ptr_ty);
-        }
-        if (tok) {
-            ret->str = tok->str;
-            ret->len = tok->len;
-        }
-        return ret;
-    }
-    // consumed "(", function type
-    // if there is a pointer type, nested indicates a pointer type
-    // so append params to base type
-    Type *fun = new_type(FUNC);
-    fun->ptr_to = ptr_ty;
-    fun->params = new_vector();
-    if (tok) {
-        fun->str = tok->str;
-        fun->len = tok->len;
+        return array_type(base);
     }
+    // consumed "(", function type returning base
+    Vector *params = new_vector_in(&scope_arena);
+    bool variadic = false;
+    decl->param_names = new_vector_in(&scope_arena);
     while (!consume(")")) {
+        if (consume("...")) {
+            // variable arguments, must be the last
+            variadic = true;
+            expect(")");
+            break;
+        }
         Type *next_param_base_type = base_type();
         if (next_param_base_type == NULL) {
-            error_at(token->str, "Base type expected, but got %.*s", token->len, token->str);
+            error_at(token_str(token), "Base type expected, but got %.*s", token_len(token), token_str(token));
         }
-        Type *next_param_type = type(next_param_base_type);
-        vector_add(fun->params, next_param_type);
+        Declarator param = {0};
+        vector_add(params, type(next_param_base_type, &param));
+        vector_add(decl->param_names, param.name);
 
         if (!consume(",")) {
             expect(")");
             break;
         }
     }
+    return func_type(base, params, variadic);
+}
 
-    if (nested) {
-        return combine_nested_type(nested, fun);
-    } else {
-        return fun;
+// persist_token returns the copy of the given token (may be NULL), which outlives the token ring
+// until the declaration has been parsed.
+Token *persist_token(TokenIndex tok) {
+    if (tok == 0) return NULL;
+    Token *copy = arena_alloc(&scope_arena, sizeof(Token));
+    copy->kind = token_kind(tok);
+    copy->str = token_str(tok);
+    copy->len = token_len(tok);
+    copy->atom = token_atom(tok);
+    return copy;
+}
+
+// type parses the next 'type' in EBNF, and stores the declared identifier to decl. Parses nested type.
+Type *type(Type *base, Declarator *decl) {
+    Type *ptr_ty = ptr_type(base);
+    if (consume("(")) {
+        // nested type, e.g. "int (*x)[1]"
+        // the part outside the parentheses applies first: parse it, and then the nested part on top of it
+        Checkpoint nested = checkpoint();
+        skip_parens();
+        Type *outer = type_suffix(ptr_ty, decl);
+        Checkpoint end = checkpoint();
+        restore(nested);
+        Type *ty = type(outer, decl);
+        expect(")");
+        restore(end);
+        return ty;
     }
+    // variable or function identifier
+    decl->name = persist_token(consume_identifier());
+    return type_suffix(ptr_ty, decl);
 }
 
 Node *init(Type *ty);
@@ -1369,35 +1615,25 @@ size_t initializer_length();
 void expand_local_array_initializer(Vector *elements, Node *init_node, Node *var_node) {
     if (init_node->kind != ND_ARRAY) {
         // *(x + i) = rhs;
-        Node *next = calloc(1, sizeof(Node));
-        next->kind = ND_ASSIGN;
-        next->left = var_node;
-        next->right = init_node;
-
-        vector_add(elements, next);
+        vector_add(elements, new_node(ND_ASSIGN, var_node, init_node));
         return;
     }
 
     // check type and size
     if (type_of(var_node)->ty != ARRAY) {
-        error_at(var_node->str, "expected array type");
+        error_at(var_node->loc, "expected array type");
     }
     if (type_of(var_node)->array_size < initializer_length(init_node)) {
-        error_at(var_node->str, "array initializer length exceeds array length");
+        error_at(var_node->loc, "array initializer length exceeds array length");
     }
 
-    for (int i = 0; i < vector_count(init_node->arguments); i++) {
+    for (int i = 0; i < init_node->count; i++) {
         // x + i
-        Node *adder = calloc(1, sizeof(Node));
-        adder->kind = ND_ADD;
-        adder->left = var_node;
-        adder->right = new_node_num(i);
+        Node *adder = new_node(ND_ADD, var_node, new_node_num(i));
         // *(x + i)
-        Node *lhs = calloc(1, sizeof(Node));
-        lhs->kind = ND_DEREF;
-        lhs->left = adder;
+        Node *lhs = new_node(ND_DEREF, adder, NULL);
 
-        Node *rhs = (Node*) vector_get(init_node->arguments, i);
+        Node *rhs = init_node->items[i];
         expand_local_array_initializer(elements, rhs, lhs);
     }
 }
@@ -1407,23 +1643,17 @@ Node *local_var_init(Node *var_node) {
     // assert var_node->kind == ND_LOCAL_VAR
     Node *init_node = init(var_node->type);
 
-    Node *node = calloc(1, sizeof(Node));
-    node->kind = ND_BLOCK;
-    node->arguments = new_vector();
+    Vector *statements = new_vector_in(&scope_arena);
     // NOTE: adding var_node is actually not needed because the local var space is already prepared on stack by new_local_var()
-    vector_add(node->arguments, var_node);
+    vector_add(statements, var_node);
 
     // if the var was declared without array size
     if (var_node->type->array_size == -1) {
-        var_node->type->array_size = initializer_length(init_node);
+        var_node->type = array_of(var_node->type->ptr_to, initializer_length(init_node));
         // claim local var offset in stack
-        LocalVar *var = (LocalVar*) vector_get_last(locals);
-        if (vector_count(locals) == 0) {
-            var->offset = size_of(var_node->type);
-        } else {
-            LocalVar *last_var = (LocalVar*) vector_get_last(locals);
-            var->offset = last_var->offset + size_of(var_node->type);
-        }
+        LocalVar *var = (LocalVar*) map_get(scope->vars, var_node->atom);
+        var->type = var_node->type;
+        var->offset = claim_local_offset(var->type);
         var_node->offset = var->offset;
     }
 
@@ -1431,10 +1661,12 @@ Node *local_var_init(Node *var_node) {
     // x[0] = 1; // *(x + 0) = 1;
     // x[1] = 2; // *(x + 1) = 2;
     // and so on
-    expand_local_array_initializer(node->arguments, init_node, var_node);
-    return node;
+    expand_local_array_initializer(statements, init_node, var_node);
+    return new_list_node(ND_BLOCK, statements);
 }
 
+Node *recoverable_stmt();
+
 // stmt parses the next 'stmt' (in EBNF) as AST.
 Node *stmt() {
     Node *node;
@@ -1442,16 +1674,16 @@ Node *stmt() {
     Type *base_ty = base_type();
     if (base_ty) {
         // local variable declaration
-        Type *ty = type(base_ty);
-        node = new_local_var(ty);
+        Declarator decl = {0};
+        Type *ty = type(base_ty, &decl);
+        node = new_local_var(ty, decl.name);
         if (consume("=")) {
             node = local_var_init(node);
         }
         expect(";");
         return node;
     } else if (consume_keyword("return")) {
-        node = calloc(1, sizeof(Node));
-        node->kind = ND_RETURN;
+        node = allocate_node(ND_RETURN);
         node->left = expr();
         expect(";");
     } else if (consume_keyword("if")) {
@@ -1460,8 +1692,7 @@ Node *stmt() {
         expect(")");
         Node *inside = stmt();
 
-        node = calloc(1, sizeof(Node));
-        node->kind = ND_IF;
+        node = allocate_node(ND_IF);
         node->left = cond;
         node->right = inside;
         // Label: end
@@ -1480,13 +1711,12 @@ Node *stmt() {
         expect(")");
         Node *inside = stmt();
 
-        node = calloc(1, sizeof(Node));
-        node->kind = ND_WHILE;
+        node = allocate_node(ND_WHILE);
         node->left = cond;
         node->right = inside;
-        // Labels: begin, end
+        // Labels: begin, end, continue, test
         node->label = next_label;
-        next_label += 2;
+        next_label += 4;
     } else if (consume_keyword("for")) {
         expect("(");
 
@@ -1515,36 +1745,35 @@ Node *stmt() {
         }
         inside = stmt();
 
-        node = calloc(1, sizeof(Node));
-        node->kind = ND_FOR;
+        node = allocate_node(ND_FOR);
         node->left = init;
         node->right = cond;
         node->third = cont;
         node->fourth = inside;
-        // Labels: begin, end
+        // Labels: begin, end, continue, test
         node->label = next_label;
-        next_label += 3;
+        next_label += 4;
     } else if (consume_keyword("break")) {
         expect(";");
-        node = calloc(1, sizeof(Node));
         // determine where to break while generating code
-        node->kind = ND_BREAK;
-        node->str = token->str;
-        return node;
+        return allocate_node(ND_BREAK);
     } else if (consume_keyword("continue")) {
         expect(";");
-        node = calloc(1, sizeof(Node));
         // determine where to continue while generating code
-        node->kind = ND_CONTINUE;
-        node->str = token->str;
-        return node;
+        return allocate_node(ND_CONTINUE);
     } else if (consume("{")) {
-        node = calloc(1, sizeof(Node));
-        node->kind = ND_BLOCK;
-        node->arguments = new_vector();
+        char *loc = token_str(token);
+        Vector *statements = new_vector_in(&scope_arena);
+        enter_scope();
         while (!consume("}")) {
-            vector_add(node->arguments, stmt());
+            Node *next = recoverable_stmt();
+            if (next) {
+                vector_add(statements, next);
+            }
         }
+        leave_scope();
+        node = new_list_node(ND_BLOCK, statements);
+        node->loc = loc;
     } else {
         node = expr();
         expect(";");
@@ -1553,56 +1782,155 @@ Node *stmt() {
     return node;
 }
 
-// func parses the next 'func' (in EBNF) as AST.
-Node *func(Type *ty) {
-    if (ty->str == NULL) {
-        error_at(token->str, "expected identifier for a function");
+// brace_depth returns how many braces the given token opens (1) or closes (-1).
+int brace_depth(TokenIndex tok) {
+    if (token_kind(tok) != TK_RESERVED || token_len(tok) != 1) return 0;
+    return token_str(tok)[0] == '{' ? 1 : token_str(tok)[0] == '}' ? -1 : 0;
+}
+
+// skip_to_end skips the rest of the broken statement or declaration which began at the given token:
+// up to its ";", or the "}" closing the braces opened since the beginning.
+// Stops before the "}" of the enclosing block if in_block.
+void skip_to_end(Checkpoint start, bool in_block) {
+    if (!in_token_ring(start)) {
+        // too long to tell where it ends
+        exit_on_errors();
+    }
+    // braces and parentheses opened before the error
+    int depth = 0;
+    int parens = 0;
+    for (TokenIndex tok = start; tok != token; tok++) {
+        depth += brace_depth(tok);
+        if (token_kind(tok) == TK_RESERVED && token_len(tok) == 1) {
+            parens += token_str(tok)[0] == '(' ? 1 : token_str(tok)[0] == ')' ? -1 : 0;
+        }
+    }
+    if (depth < 0) {
+        depth = 0;
+    }
+    while (!at_eof()) {
+        int delta = brace_depth(token);
+        if (in_block && delta < 0 && depth == 0) return;
+        bool end = token_kind(token) == TK_RESERVED && token_len(token) == 1 && token_str(token)[0] == ';';
+        if (token_kind(token) == TK_RESERVED && token_len(token) == 1) {
+            parens += token_str(token)[0] == '(' ? 1 : token_str(token)[0] == ')' ? -1 : 0;
+        }
+        advance();
+        depth += delta;
+        if (depth <= 0 && (delta < 0 || (end && parens <= 0))) return;
     }
+}
 
-    // TODO: check if the function has already been declared (including prototype declaration)
-    Node *node = calloc(1, sizeof(Node));
-    node->kind = ND_FUNC;
-    node->type = ty->ptr_to;
-    node->str = ty->str;
-    node->len = ty->len;
+// recoverable_stmt parses the next statement. If it has an error, skips the statement after reporting the error
+// and returns NULL, so that the errors of the following statements are also reported in one run.
+Node *recoverable_stmt() {
+    jmp_buf recovery;
+    jmp_buf *outer = error_recovery;
+    Scope *sc = scope;
+    Checkpoint start = checkpoint();
+    if (setjmp(recovery)) {
+        error_recovery = outer;
+        scope = sc;
+        skip_to_end(start, true);
+        if (token == start) {
+            // make progress anyway
+            advance();
+        }
+        if (at_eof()) {
+            // nothing left to recover with
+            exit_on_errors();
+        }
+        return NULL;
+    }
+    error_recovery = &recovery;
+    Node *node = stmt();
+    error_recovery = outer;
+    return node;
+}
 
-    // current function's local variables, for new_local_var function to append to this
-    locals = new_vector();
+// declare_function returns the function symbol of the given name, declaring it if not yet.
+// All the declarations of a function must have the same type.
+Function *declare_function(Type *ty, Token *name) {
+    Function *fn = (Function*) map_get(function_map, name->atom);
+    if (fn) {
+        // canonical types are the same object if they agree
+        if (fn->type != ty) {
+            report_error_at(name->str, "conflicting types for function %.*s", name->len, name->str);
+        }
+        return fn;
+    }
+    fn = allocate(sizeof(Function));
+    fn->name = name->str;
+    fn->len = name->len;
+    fn->atom = name->atom;
+    fn->type = ty;
+    map_put(function_map, fn->atom, fn);
+    return fn;
+}
 
-    // read function arguments
-    Vector *arguments = new_vector();
-    for (int i = 0; i < vector_count(ty->params); i++) {
-        Type *next_arg_type = (Type*) vector_get(ty->params, i);
-        // treat each function argument as a local variable
-        Node *local_var = new_local_var(next_arg_type);
-        vector_add(arguments, local_var);
+// func parses the next function definition or prototype declaration.
+// Returns the function if defined, NULL if only declared.
+// decl: declarator of the function, with its name and parameter names
+Function *func(Type *ty, Declarator *decl) {
+    if (decl->name == NULL) {
+        error_at(token_str(token), "expected identifier for a function");
     }
-    node->arguments = arguments;
 
-    // parse function body
+    Function *fn = declare_function(ty, decl->name);
     if (!consume("{")) {
         // prototype function declaration
-        // TODO: temporarily ignoring it as we're not yet supporting #include.
-        //       should add to the declared function list, and lookup the list when calling a function
         expect(";");
         return NULL;
     }
-    Node *block = calloc(1, sizeof(Node));
-    block->kind = ND_BLOCK;
-    block->arguments = new_vector();
+    if (fn->loc) {
+        report_error_at(decl->name->str, "Function %.*s has already been defined", fn->len, fn->name);
+    }
+    if (ty->variadic) {
+        report_error_at(decl->name->str, "defining a function with variable arguments is not supported");
+    }
 
-    while (!consume("}")) {
-        vector_add(block->arguments, stmt());
+    fn->loc = decl->name->str;
+    fn->first_label = next_label;
+    fn->first_string = string_count;
+    if (streaming) {
+        // the function is released after it is generated
+        current_arena = &function_arena;
     }
 
-    node->left = block;
-    // final local vars offset
-    if (vector_count(locals) > 0) {
-        LocalVar *last_local_var = (LocalVar*) vector_get_last(locals);
-        node->offset = last_local_var->offset;
+    // current function's local variables, for new_local_var function to append to this
+    // parameters and the outermost block of the body share the same scope
+    enter_scope();
+    locals_offset = 0;
+
+    // read function arguments
+    Vector *params = new_vector();
+    for (int i = 0; i < vector_count(ty->params); i++) {
+        Type *next_arg_type = (Type*) vector_get(ty->params, i);
+        // treat each function argument as a local variable
+        Node *local_var = new_local_var(next_arg_type, (Token*) vector_get(decl->param_names, i));
+        vector_add(params, local_var);
     }
+    fn->params = params;
 
-    return node;
+    // parse function body
+    char *loc = token_str(token);
+    Vector *statements = new_vector_in(&scope_arena);
+    while (!consume("}")) {
+        Node *next = recoverable_stmt();
+        if (next) {
+            vector_add(statements, next);
+        }
+    }
+    fn->body = new_list_node(ND_BLOCK, statements);
+    fn->body->loc = loc;
+    // final local vars offset
+    fn->locals_size = locals_offset;
+    leave_scope();
+    // local variables are resolved to offsets in the nodes
+    arena_reset(&scope_arena);
+    current_arena = &permanent_arena;
+
+    return fn;
 }
 
 // init parses the next 'init' (in EBNF) as AST.
@@ -1611,9 +1939,10 @@ Node *func(Type *ty) {
 Node *init(Type *ty) {
     if (consume("{")) {
         if (ty->ty != ARRAY) {
-            error_at(token->str, "expected array type");
+            error_at(token_str(token), "expected array type");
         }
-        Vector *elements = new_vector();
+        char *loc = token_str(token);
+        Vector *elements = new_vector_in(&scope_arena);
         while (!consume("}")) {
             vector_add(elements, init(ty->ptr_to));
             if (!consume(",")) {
@@ -1622,11 +1951,9 @@ Node *init(Type *ty) {
             }
         }
 
-        Node *node = calloc(1, sizeof(Node));
-        node->kind = ND_ARRAY;
-        node->type = new_type(ARRAY);
-        node->type->array_size = vector_count(elements);
-        node->arguments = elements;
+        Node *node = new_list_node(ND_ARRAY, elements);
+        node->loc = loc;
+        node->type = array_of(ty->ptr_to, vector_count(elements));
         return node;
     }
 
@@ -1634,19 +1961,15 @@ Node *init(Type *ty) {
     // If the destination type is char[] and the initializer is string literal, we need to be careful
     // convert string literal "foo" to array initializer "{'f', 'o', 'o', '\0'}"
     if (ty->ty == ARRAY && ty->ptr_to->ty == CHAR && node->kind == ND_STRING) {
-        Vector *elements = new_vector();
+        Vector *elements = new_vector_in(&scope_arena);
         for (int i = 0; i < node->len; i++) {
             vector_add(elements, new_node_char((node->str)[i]));
         }
         // null sequence '0'
         vector_add(elements, new_node_char(0));
 
-        node = calloc(1, sizeof(Node));
-        node->kind = ND_ARRAY;
-        node->type = new_type(ARRAY);
-        node->type->ptr_to = new_type(CHAR);
-        node->type->array_size = vector_count(elements);
-        node->arguments = elements;
+        node = new_list_node(ND_ARRAY, elements);
+        node->type = array_of(&char_type, vector_count(elements));
     }
     return node;
 }
@@ -1655,46 +1978,42 @@ Node *init(Type *ty) {
 size_t initializer_length(Node *node) {
     switch (node->kind) {
     case ND_ARRAY:
-        return vector_count(node->arguments);
+        return node->count;
     case ND_STRING:
         return node->len + 1;
     default:
-        error_at(token->str, "unknown array type");
+        error_at(token_str(token), "unknown array type");
     }
 }
 
 // global parses the next global variable and defines it.
-void global(Type *ty) {
-    Token *name = retrieve_type_identifier(ty);
+void global(Type *ty, Token *name) {
     if (name == NULL) {
-        error_at(token->str, "expected identifier for a global variable");
+        error_at(token_str(token), "expected identifier for a global variable");
     }
 
     // Check if the name has already been used
-    if (find_global_var(name)) {
+    if (find_global_var(name->atom)) {
         error_at(name->str, "Global variable %.*s has already been declared", name->len, name->str);
     }
 
-    GlobalVar *var = calloc(1, sizeof(GlobalVar));
+    GlobalVar *var = allocate(sizeof(GlobalVar));
     var->name = name->str;
     var->len = name->len;
+    var->atom = name->atom;
     var->type = ty;
 
     // initializer
     if (consume("=")) {
-        Node *init_node_before = init(ty);
-        if (ty->ty == ARRAY && init_node_before->type && init_node_before->type->ty == ARRAY) {
-            // for eval_global_init to know which type this array is composed of
-            init_node_before->type->ptr_to = ty->ptr_to;
-        }
-        Node *init_node = eval_global_init(init_node_before);
+        Node *init_node = eval_global_init(init(ty));
         var->init = init_node;
 
         if (ty->ty == ARRAY) {
             size_t init_length = initializer_length(init_node);
             // support excluding array length: e.g. "int arr[] = {1, 2, 3};"
             if (ty->array_size == -1) {
-                ty->array_size = init_length;
+                ty = array_of(ty->ptr_to, init_length);
+                var->type = ty;
             } else if (ty->array_size < init_length) {
                 error_at(name->str, "array initializer length exceeds array length");
             }
@@ -1705,30 +2024,50 @@ void global(Type *ty) {
     var->offset = size_of(ty);
 
     vector_add(globals, var);
+    map_put(global_map, var->atom, var);
 }
 
 // type_def parses the next 'typedef' in EBNF.
 void type_def() {
     Type *base = base_type();
-    Type *ty = type(base);
-    Token *tok = retrieve_type_identifier(ty);
-    if (tok == NULL) {
-        error_at(token->str, "expected identifier for typedef");
+    Declarator decl = {0};
+    Type *ty = type(base, &decl);
+    if (decl.name == NULL) {
+        error_at(token_str(token), "expected identifier for typedef");
     }
 
-    DefinedType *defined = new_defined_type(tok->str, tok->len, ty);
-    vector_add(types, defined);
+    DefinedType *defined = new_defined_type(decl.name->atom, ty);
+    map_put(types, defined->atom, defined);
 }
 
-// program parses the next 'program' (in EBNF) as AST, a.k.a. the whole program.
-void program() {
+// init_symbols makes the empty symbol tables, before a precompiled header is loaded into them and the program is parsed.
+void init_symbols() {
     functions = new_vector();
+    function_map = new_map();
     globals = new_vector();
+    global_map = new_map();
     strings = new_vector();
-    types = new_vector();
-    structs = new_vector();
+    types = new_map();
+    structs = new_map();
+}
 
+// program parses the next 'program' (in EBNF) as AST, a.k.a. the whole program.
+void program() {
+    // a broken declaration is skipped, to continue with the next one
+    jmp_buf recovery;
+    error_recovery = &recovery;
     while (!at_eof()) {
+        Checkpoint first = checkpoint();
+        if (setjmp(recovery)) {
+            scope = NULL;
+            arena_reset(&scope_arena);
+            // drop the broken function in the streaming mode
+            current_arena = &permanent_arena;
+            arena_reset(&function_arena);
+            skip_to_end(first, false);
+            continue;
+        }
+
         // typedef
         if (consume_keyword("typedef")) {
             type_def();
@@ -1737,23 +2076,41 @@ void program() {
         }
 
         // Check if the next token is a global variable, or a function.
+        double start = wall_clock();
         Type *base = base_type();
         if (!base) {
-            error_at(token->str, "expected base type");
+            error_at(token_str(token), "expected base type");
+        }
+        Declarator decl = {0};
+        Type *ty = type(base, &decl);
+        if (ty->ty == STRUCT && decl.name == NULL) {
+            // struct declaration only, e.g. "struct MyStruct { ... };"
+            expect(";");
+            continue;
         }
-        Type *ty = type(base);
         if (ty->ty == FUNC) {
             // function
-            Node *f = func(ty);
-            if (f == NULL) {
-                // TODO: handle prototype function declaration correctly
+            Function *fn = func(ty, &decl);
+            if (fn == NULL) {
+                // prototype declaration
                 continue;
             }
-            vector_add(functions, f);
+            set_timed_function(vector_count(functions), fn->name, fn->len);
+            function_time(PHASE_PARSE, wall_clock() - start);
+            vector_add(functions, fn);
+            if (streaming) {
+                phase_end(PHASE_PARSE, 0);
+                gen_streamed_function(vector_count(functions) - 1, fn);
+                phase_begin(PHASE_PARSE);
+            }
         } else {
             // global variable
-            global(ty);
+            global(ty, decl.name);
             expect(";");
+            // the items of the initializer have been copied into the nodes
+            arena_reset(&scope_arena);
         }
     }
+    error_recovery = NULL;
+    exit_on_errors();
 }
@@ -0,0 +1,513 @@
+#include "main.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+Precompiled header format (binary, little-endian 8-byte integers; a string is its length, its bytes, and a '\0'):
+
+    magic "mainpch\n", version
+    header:     path, hash of the contents
+    headers:    count, {path, hash of the contents} of each header it includes
+    types:      count, each {kind, ...} (see write_type), referring to the earlier types by index;
+                the primitive types are 0 to 3
+    members:    {count, {name, type, offset}...} of each struct type in the order of the types
+    typedefs:   count, {name, type}...
+    structs:    count, {tag, type}...
+    globals:    count, {name, type, initializer}...
+    functions:  count, {name, type}...
+    macros:     see write_pch_macros
+
+The declarations are restored by the canonical type constructors, and the spellings of the macros are used
+in place in the file mapped into memory. The header and all the headers it includes are hashed,
+so that a precompiled header made from stale headers is rejected.
+*/
+
+#define PCH_MAGIC "mainpch\n"
+#define PCH_VERSION 1
+
+// Precompiled header to write out instead of the assembly (-emit-pch)
+bool emit_pch;
+// Precompiled header to load before the main file (-include-pch), NULL if none
+char *include_pch;
+
+// Slot of the type index table
+typedef struct TypeIndex {
+    Type *ty;
+    int index;
+} TypeIndex;
+
+// Indexes of the types to write out, by the type pointer, open addressing with linear probing
+TypeIndex *type_indexes;
+// number of slots, always a power of 2
+int type_index_capacity;
+
+// Types to write out in the order of the indexes, elements: Type*
+Vector *written_types;
+
+// hash_bytes returns the FNV-1a hash of the given bytes.
+unsigned long hash_bytes(char *p, long len) {
+    unsigned long hash = 14695981039346656037UL;
+    for (long i = 0; i < len; i++) {
+        hash ^= (unsigned char) p[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+// pch_write_long writes out the given integer to stdout.
+void pch_write_long(long value) {
+    fwrite(&value, sizeof(value), 1, stdout);
+}
+
+// pch_write_string writes out the given string to stdout.
+void pch_write_string(char *str, int len) {
+    pch_write_long(len);
+    fwrite(str, 1, len, stdout);
+    fputc('\0', stdout);
+}
+
+// pch_read_long reads the next integer.
+long pch_read_long(PCHReader *r) {
+    if (r->end - r->p < sizeof(long)) {
+        error("%s: broken precompiled header", r->path);
+    }
+    long value;
+    memcpy(&value, r->p, sizeof(value));
+    r->p += sizeof(value);
+    return value;
+}
+
+// pch_read_string reads the next string, returning it in place in the mapped file.
+char *pch_read_string(PCHReader *r, int *len) {
+    long n = pch_read_long(r);
+    if (n < 0 || r->end - r->p < n + 1 || r->p[n] != '\0') {
+        error("%s: broken precompiled header", r->path);
+    }
+    char *str = r->p;
+    r->p += n + 1;
+    *len = n;
+    return str;
+}
+
+// pch_read_atom reads the next string as an interned name.
+Atom *pch_read_atom(PCHReader *r) {
+    int len;
+    char *str = pch_read_string(r, &len);
+    return intern(str, len);
+}
+
+// find_type_index returns the slot of the type index table for the given type, or the empty slot to insert it into.
+TypeIndex *find_type_index(Type *ty) {
+    unsigned long mask = type_index_capacity - 1;
+    for (unsigned long i = ((unsigned long) ty / sizeof(Type)) & mask;; i = (i + 1) & mask) {
+        TypeIndex *slot = &type_indexes[i];
+        if (slot->ty == ty || slot->ty == NULL) {
+            return slot;
+        }
+    }
+}
+
+// type_index returns the index of the given type, or -1 if not indexed yet.
+int type_index(Type *ty) {
+    if (type_index_capacity == 0) return -1;
+    TypeIndex *slot = find_type_index(ty);
+    return slot->ty ? slot->index : -1;
+}
+
+// add_type_index assigns the next index to the given type, not indexed yet.
+// Returns the index of the type.
+int add_type_index(Type *ty) {
+    int count = vector_count(written_types);
+    // keep the load factor under 3/4
+    if ((count + 1) * 4 > type_index_capacity * 3) {
+        TypeIndex *old_indexes = type_indexes;
+        int old_capacity = type_index_capacity;
+        type_index_capacity = old_capacity == 0 ? 1024 : old_capacity * 2;
+        type_indexes = heap_allocate(sizeof(TypeIndex) * type_index_capacity);
+        for (int i = 0; i < old_capacity; i++) {
+            if (old_indexes[i].ty) {
+                *find_type_index(old_indexes[i].ty) = old_indexes[i];
+            }
+        }
+        free(old_indexes);
+    }
+    *find_type_index(ty) = (TypeIndex) {.ty = ty, .index = count};
+    vector_add(written_types, ty);
+    return count;
+}
+
+// index_type assigns the indexes to the given type and the types it refers to, the referred ones first.
+// A struct type takes its index before its members, as the members may refer to the struct itself.
+// Returns the index of the type.
+int index_type(Type *ty) {
+    int index = type_index(ty);
+    if (index >= 0) return index;
+
+    if (ty->ty == STRUCT) {
+        index = add_type_index(ty);
+        for (int i = 0; i < vector_count(ty->params); i++) {
+            index_type(((DefinedType*) vector_get(ty->params, i))->ty);
+        }
+        return index;
+    }
+    if (ty->ty == PTR || ty->ty == ARRAY || ty->ty == FUNC) {
+        index_type(ty->ptr_to);
+    }
+    if (ty->ty == FUNC) {
+        for (int i = 0; i < vector_count(ty->params); i++) {
+            index_type((Type*) vector_get(ty->params, i));
+        }
+    }
+    // the type may have been indexed through a struct it refers to, e.g. "struct S { struct S *next; }"
+    index = type_index(ty);
+    return index >= 0 ? index : add_type_index(ty);
+}
+
+// write_type writes out the given type, whose referred types have been written out.
+void write_type(Type *ty) {
+    pch_write_long(ty->ty);
+    switch (ty->ty) {
+    case PTR:
+        pch_write_long(index_type(ty->ptr_to));
+        break;
+    case ARRAY:
+        pch_write_long(index_type(ty->ptr_to));
+        pch_write_long(ty->array_size);
+        break;
+    case FUNC:
+        pch_write_long(index_type(ty->ptr_to));
+        pch_write_long(ty->variadic);
+        pch_write_long(vector_count(ty->params));
+        for (int i = 0; i < vector_count(ty->params); i++) {
+            pch_write_long(index_type((Type*) vector_get(ty->params, i)));
+        }
+        break;
+    case STRUCT:
+        // members are written out after all the types
+        pch_write_string(ty->atom ? ty->atom->name : "", ty->atom ? ty->atom->len : 0);
+        pch_write_long(ty->size);
+        pch_write_long(ty->align);
+        break;
+    default:
+        error("unknown type to precompile");
+    }
+}
+
+// index_init indexes the types of the initializer of the given global variable, made by eval_global_init().
+// Only the numbers and the arrays of them can be precompiled.
+void index_init(GlobalVar *var, Node *node) {
+    if (!node) return;
+    switch (node->kind) {
+    case ND_NUM:
+    case ND_CHAR:
+        if (node->type) index_type(node->type);
+        break;
+    case ND_ARRAY:
+        for (int i = 0; i < node->count; i++) {
+            index_init(var, node->items[i]);
+        }
+        break;
+    default:
+        error_at(var->name, "initializer of %.*s cannot be precompiled", var->len, var->name);
+    }
+}
+
+// write_init writes out the given initializer indexed by index_init.
+void write_init(Node *node) {
+    if (!node) {
+        pch_write_long(-1);
+        return;
+    }
+    pch_write_long(node->kind);
+    if (node->kind == ND_ARRAY) {
+        pch_write_long(node->count);
+        for (int i = 0; i < node->count; i++) {
+            write_init(node->items[i]);
+        }
+        return;
+    }
+    pch_write_long(node->val);
+    pch_write_long(node->type ? index_type(node->type) : -1);
+}
+
+// write_defined_types writes out the named types of the given map.
+// map: values: DefinedType*
+void write_defined_types(Map *map) {
+    pch_write_long(map_count(map));
+    for (int i = 0; i < map->capacity; i++) {
+        DefinedType *defined = (DefinedType*) map->entries[i].value;
+        if (!map->entries[i].key) continue;
+        pch_write_string(defined->atom->name, defined->atom->len);
+        pch_write_long(index_type(defined->ty));
+    }
+}
+
+// write_pch writes out the declarations and the macros of the parsed header to stdout (-emit-pch).
+// contents: the header before preprocessed
+void write_pch(char *contents) {
+    if (vector_count(functions) > 0) {
+        Function *fn = (Function*) vector_get(functions, 0);
+        error_at(fn->loc, "function definitions cannot be precompiled");
+    }
+    char real[PATH_MAX];
+    if (!realpath(file_name, real)) {
+        error("cannot precompile %s: %s", file_name, strerror(errno));
+    }
+
+    // index all the types first, to write them out before the declarations referring to them
+    written_types = new_vector();
+    Type *primitives[] = {&void_type, &char_type, &int_type, &long_type};
+    for (int i = 0; i < 4; i++) {
+        index_type(primitives[i]);
+    }
+    for (int i = 0; i < types->capacity; i++) {
+        if (types->entries[i].key) index_type(((DefinedType*) types->entries[i].value)->ty);
+    }
+    for (int i = 0; i < structs->capacity; i++) {
+        if (structs->entries[i].key) index_type(((DefinedType*) structs->entries[i].value)->ty);
+    }
+    for (int i = 0; i < vector_count(globals); i++) {
+        GlobalVar *var = (GlobalVar*) vector_get(globals, i);
+        index_type(var->type);
+        index_init(var, var->init);
+    }
+    for (int i = 0; i < function_map->capacity; i++) {
+        if (function_map->entries[i].key) index_type(((Function*) function_map->entries[i].value)->type);
+    }
+    int num_types = vector_count(written_types);
+
+    fwrite(PCH_MAGIC, 1, strlen(PCH_MAGIC), stdout);
+    pch_write_long(PCH_VERSION);
+    pch_write_string(real, strlen(real));
+    pch_write_long(hash_bytes(contents, strlen(contents)));
+    write_pch_headers();
+
+    pch_write_long(num_types - 4);
+    for (int i = 4; i < num_types; i++) {
+        write_type((Type*) vector_get(written_types, i));
+    }
+    for (int i = 4; i < num_types; i++) {
+        Type *ty = (Type*) vector_get(written_types, i);
+        if (ty->ty != STRUCT) continue;
+        pch_write_long(vector_count(ty->params));
+        for (int j = 0; j < vector_count(ty->params); j++) {
+            DefinedType *member = (DefinedType*) vector_get(ty->params, j);
+            pch_write_string(member->atom->name, member->atom->len);
+            pch_write_long(index_type(member->ty));
+            pch_write_long(member->offset);
+        }
+    }
+
+    write_defined_types(types);
+    write_defined_types(structs);
+    pch_write_long(vector_count(globals));
+    for (int i = 0; i < vector_count(globals); i++) {
+        GlobalVar *var = (GlobalVar*) vector_get(globals, i);
+        pch_write_string(var->atom->name, var->atom->len);
+        pch_write_long(index_type(var->type));
+        write_init(var->init);
+    }
+    pch_write_long(map_count(function_map));
+    for (int i = 0; i < function_map->capacity; i++) {
+        Function *fn = (Function*) function_map->entries[i].value;
+        if (!function_map->entries[i].key) continue;
+        pch_write_string(fn->atom->name, fn->atom->len);
+        pch_write_long(index_type(fn->type));
+    }
+    write_pch_macros();
+
+    if (fflush(stdout) != 0) {
+        error("cannot write the precompiled header: %s", strerror(errno));
+    }
+}
+
+// map_pch maps the given precompiled header into memory.
+PCHReader map_pch(char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        error("cannot open %s: %s", path, strerror(errno));
+    }
+    PCHReader r = {.path = path};
+    if (st.st_size > 0) {
+        r.p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (r.p == MAP_FAILED) {
+            error("cannot map %s: %s", path, strerror(errno));
+        }
+    }
+    close(fd);
+    r.end = r.p + st.st_size;
+    return r;
+}
+
+// check_source reads the path and the hash of the next source file of the precompiled header,
+// and exits if the file has changed since the header was precompiled.
+// Returns the path.
+char *check_source(PCHReader *r) {
+    int len;
+    char *path = pch_read_string(r, &len);
+    unsigned long hash = pch_read_long(r);
+    char *contents = read_file(path);
+    if (hash_bytes(contents, strlen(contents)) != hash) {
+        error("%s: precompiled header is stale, %s has changed since; make it again with -emit-pch", r->path, path);
+    }
+    return path;
+}
+
+// read_type_index reads the next type index, -1 for none.
+Type *read_type_index(PCHReader *r, Type **table, long count) {
+    long index = pch_read_long(r);
+    if (index == -1) return NULL;
+    if (index < 0 || index >= count) {
+        error("%s: broken precompiled header", r->path);
+    }
+    return table[index];
+}
+
+// read_init reads the initializer of a global variable.
+Node *read_init(PCHReader *r, Type **table, long count) {
+    long kind = pch_read_long(r);
+    if (kind == -1) return NULL;
+    if (kind == ND_NUM || kind == ND_CHAR) {
+        Node *node = allocate_node(kind);
+        node->val = pch_read_long(r);
+        node->type = read_type_index(r, table, count);
+        return node;
+    }
+    if (kind != ND_ARRAY) {
+        error("%s: broken precompiled header", r->path);
+    }
+    Vector *items = new_vector();
+    long num_items = pch_read_long(r);
+    for (long i = 0; i < num_items; i++) {
+        vector_add(items, read_init(r, table, count));
+    }
+    return new_list_node(ND_ARRAY, items);
+}
+
+// read_defined_types reads the named types into the given map.
+// map: values: DefinedType*
+void read_defined_types(PCHReader *r, Map *map, Type **table, long count) {
+    long num_defined = pch_read_long(r);
+    for (long i = 0; i < num_defined; i++) {
+        Atom *atom = pch_read_atom(r);
+        map_put(map, atom, new_defined_type(atom, read_type_index(r, table, count)));
+    }
+}
+
+// load_pch loads the declarations and the macros of the given precompiled header (-include-pch),
+// after checking that none of its headers has changed.
+// Returns the size of the precompiled header.
+long load_pch(char *path) {
+    PCHReader r = map_pch(path);
+    long size = r.end - r.p;
+    int magic_len = strlen(PCH_MAGIC);
+    if (size < magic_len || memcmp(r.p, PCH_MAGIC, magic_len) != 0) {
+        error("%s: not a precompiled header", path);
+    }
+    r.p += magic_len;
+    if (pch_read_long(&r) != PCH_VERSION) {
+        error("%s: precompiled header of another version; make it again with -emit-pch", path);
+    }
+    char *header = check_source(&r);
+    long num_headers = pch_read_long(&r);
+    for (long i = 0; i < num_headers; i++) {
+        check_source(&r);
+    }
+
+    long count = pch_read_long(&r) + 4;
+    if (count < 4) {
+        error("%s: broken precompiled header", path);
+    }
+    Type **table = arena_alloc(&permanent_arena, sizeof(Type*) * count);
+    table[0] = &void_type;
+    table[1] = &char_type;
+    table[2] = &int_type;
+    table[3] = &long_type;
+    for (long i = 4; i < count; i++) {
+        TypeKind kind = pch_read_long(&r);
+        Type *base = kind == STRUCT ? NULL : read_type_index(&r, table, i);
+        switch (kind) {
+        case PTR:
+            table[i] = pointer_to(base);
+            break;
+        case ARRAY:
+            table[i] = array_of(base, pch_read_long(&r));
+            break;
+        case FUNC: ;
+            bool variadic = pch_read_long(&r);
+            Vector *params = new_vector_in(&permanent_arena);
+            long num_params = pch_read_long(&r);
+            for (long j = 0; j < num_params; j++) {
+                vector_add(params, read_type_index(&r, table, i));
+            }
+            table[i] = func_type(base, params, variadic);
+            break;
+        case STRUCT: ;
+            Atom *tag = pch_read_atom(&r);
+            size_t size = pch_read_long(&r);
+            Type *ty = new_type(STRUCT, size, pch_read_long(&r));
+            ty->params = new_vector_in(&permanent_arena);
+            if (tag->len > 0) {
+                ty->str = tag->name;
+                ty->len = tag->len;
+                ty->atom = tag;
+            }
+            table[i] = ty;
+            break;
+        default:
+            error("%s: broken precompiled header", path);
+        }
+    }
+    for (long i = 4; i < count; i++) {
+        Type *ty = table[i];
+        if (ty->ty != STRUCT) continue;
+        long num_members = pch_read_long(&r);
+        for (long j = 0; j < num_members; j++) {
+            Atom *atom = pch_read_atom(&r);
+            DefinedType *member = new_defined_type(atom, read_type_index(&r, table, count));
+            member->offset = pch_read_long(&r);
+            vector_add(ty->params, member);
+        }
+    }
+
+    read_defined_types(&r, types, table, count);
+    read_defined_types(&r, structs, table, count);
+    long num_globals = pch_read_long(&r);
+    for (long i = 0; i < num_globals; i++) {
+        GlobalVar *var = allocate(sizeof(GlobalVar));
+        var->atom = pch_read_atom(&r);
+        var->name = var->atom->name;
+        var->len = var->atom->len;
+        var->type = read_type_index(&r, table, count);
+        var->init = read_init(&r, table, count);
+        var->offset = size_of(var->type);
+        vector_add(globals, var);
+        map_put(global_map, var->atom, var);
+    }
+    long num_functions = pch_read_long(&r);
+    for (long i = 0; i < num_functions; i++) {
+        Function *fn = allocate(sizeof(Function));
+        fn->atom = pch_read_atom(&r);
+        fn->name = fn->atom->name;
+        fn->len = fn->atom->len;
+        fn->type = read_type_index(&r, table, count);
+        map_put(function_map, fn->atom, fn);
+    }
+    read_pch_macros(&r, header);
+    if (r.p != r.end) {
+        error("%s: broken precompiled header", path);
+    }
+
+    // the header is not included again
+    mark_included(header);
+    return size;
+}
@@ -0,0 +1,1473 @@
+#include "main.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+The preprocessor expands the input into a new user_input before it is tokenized.
+
+Each line of the output starts with the tokens of the same line of the source file, so that the errors are reported
+at the original locations through the line marks recorded at every #include and at its end.
+The headers are tokenized once and the tokens are cached for the later #includes, while the main file is lexed on demand.
+A header wrapped in "#ifndef GUARD ... #endif" is not read again once GUARD is defined, nor is a "#pragma once" header.
+
+Macros are expanded on a stack of contexts: the files, the macro expansions, and the macro arguments being expanded.
+A macro is disabled while the tokens of its expansion are read, so that a macro referring to itself is not expanded again.
+*/
+
+// Size of pp_arena to release it at, when nothing but the files is being read
+#define PP_ARENA_RESET_SIZE (256 * 1024)
+
+typedef enum {
+    PP_IDENTIFIER,
+    PP_NUMBER,
+    PP_STRING,
+    PP_CHAR,
+    PP_PUNCTUATOR,
+    PP_EOF,
+} PPTokenKind;
+
+typedef struct SourceFile SourceFile;
+
+// Preprocessing token
+typedef struct PPToken {
+    PPTokenKind kind;
+    // spelling in the source, or in the arena if made by # or ##
+    char *str;
+    int len;
+    // Interned name if kind == PP_IDENTIFIER, set by pp_atom() when needed
+    Atom *atom;
+    SourceFile *file;
+    // 1-origin line in the file, or the line of the macro invocation
+    int line;
+    // 0-origin column in the file, -1 for the tokens made by the macro expansion
+    int col;
+    // first token of a line
+    bool bol;
+    // preceded by spaces
+    bool space;
+    // name of a macro found while it was being expanded, never expanded
+    bool noexpand;
+} PPToken;
+
+struct SourceFile {
+    // path as found, for the error messages
+    char *name;
+    char *contents;
+    // Tokens of a header, cached for the later #includes, elements: PPToken*. NULL for the main file.
+    Vector *tokens;
+    // Macro of the include guard if the whole file is in "#ifndef GUARD ... #endif", NULL otherwise
+    Atom *guard;
+    // #pragma once
+    bool once;
+    // modification time and size when read, to find the cached headers changed since
+    struct timespec mtime;
+    off_t size;
+    // compared with the file on the disk in this compilation (revalidate_sources)
+    bool checked;
+};
+
+typedef struct Macro {
+    Atom *name;
+    bool function_like;
+    // Parameter names of a function-like macro, elements: Atom*. The variadic one is __VA_ARGS__.
+    Vector *params;
+    bool variadic;
+    // Replacement list, elements: PPToken*
+    Vector *body;
+    // number of the expansions of this macro being read
+    int disabled;
+} Macro;
+
+typedef struct PPLexer {
+    SourceFile *file;
+    char *p;
+    int line;
+    char *line_start;
+    // at the beginning of a line
+    bool bol;
+    Arena *arena;
+} PPLexer;
+
+typedef enum {
+    // tokens of a file, ending with PP_EOF
+    CTX_FILE,
+    // tokens of a macro expansion, popped when all read
+    CTX_MACRO,
+    // tokens of a macro argument (or #if expression) being expanded, ending with PP_EOF
+    CTX_ARGUMENT,
+} ContextKind;
+
+// Source of the tokens to expand
+typedef struct Context {
+    ContextKind kind;
+    // tokens of a cached file, an expansion, or an argument, elements: PPToken*
+    Vector *tokens;
+    int pos;
+    // lexer of the file lexed on demand, NULL if the tokens are given
+    PPLexer *lexer;
+    // token lexed on demand but put back
+    PPToken *lookahead;
+    // macro disabled while its expansion is read
+    Macro *macro;
+    // depth of the conditional directives when the file was entered
+    int conditionals;
+} Context;
+
+// Conditional directive being processed
+typedef struct Conditional {
+    // #if, #ifdef or #ifndef directive, for the error messages
+    PPToken *directive;
+    // one of the groups has been taken
+    bool taken;
+    // after #else
+    bool in_else;
+} Conditional;
+
+// Directories to find the headers in, elements: char*
+Vector *include_paths;
+
+// Line marks of the preprocessed user_input in the order of the lines, elements: LineMark*. NULL if not preprocessed.
+Vector *line_marks;
+
+// Arena of the tokens lexed from the main file and of the macro expansions
+Arena pp_arena;
+
+// Macros by name, values: Macro*, NULL if undefined
+Map *macros;
+
+// Names of the macros ever defined by the first character and the length,
+// not to look up the identifiers which cannot be a macro
+bool macro_names[128][32];
+
+// Source files by their real path, values: SourceFile*
+Map *source_files;
+
+// Stack of the contexts, elements: Context*
+Vector *contexts;
+
+// Stack of the conditional directives, elements: Conditional*
+Vector *conditionals;
+
+// Token at the end of every file and argument
+PPToken eof_token = {.kind = PP_EOF, .str = ""};
+
+// Output of the preprocessor, growing as written
+char *pp_output;
+size_t pp_output_len;
+size_t pp_output_capacity;
+// Current line (0-origin) and column of the output
+int output_line;
+int output_col;
+// File and its line the current output line comes from
+SourceFile *output_file;
+int output_file_line;
+// the last token written was made by the macro expansion
+bool output_expanded;
+// Number of the tokens written, for -ftime-report
+long preprocessed_tokens;
+
+// Headers read, and the #includes skipped by their include guards or #pragma once, for -ftime-report
+int headers_read;
+int headers_skipped;
+
+// Compare the cached headers with the files on the disk once per compilation, as they outlive a compilation
+// in the compile server
+bool revalidate_sources;
+
+Macro *find_macro(PPToken *tok);
+PPToken *expand_next();
+
+// pp_error reports the error at the given token, and exits.
+void pp_error(PPToken *tok, char *fmt, ...) {
+    char *line = tok->str;
+    if (tok->col >= 0) {
+        line -= tok->col;
+    } else {
+        // made by the macro expansion, only the line is known
+        line = "";
+    }
+    char *end = line;
+    while (*end != '\n' && *end != '\0') {
+        end++;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    print_error_line(tok->file->name, tok->line, line, end, tok->col >= 0 ? tok->str : line, fmt, ap);
+    va_end(ap);
+    count_error();
+    exit_on_errors();
+}
+
+// equal returns true if the given token is the given punctuator or identifier.
+bool equal(PPToken *tok, char *op) {
+    return (tok->kind == PP_PUNCTUATOR || tok->kind == PP_IDENTIFIER)
+        && strlen(op) == tok->len && memcmp(tok->str, op, tok->len) == 0;
+}
+
+// pp_atom returns the interned name of the given identifier token.
+Atom *pp_atom(PPToken *tok) {
+    if (!tok->atom) {
+        tok->atom = intern(tok->str, tok->len);
+    }
+    return tok->atom;
+}
+
+// copy_token returns a copy of the given token in the preprocessor arena.
+PPToken *copy_token(PPToken *tok) {
+    PPToken *copy = arena_alloc(&pp_arena, sizeof(PPToken));
+    *copy = *tok;
+    return copy;
+}
+
+// Punctuators, the longer ones first
+char *punctuators[] = {
+    "<<=", ">>=", "...", "==", "!=", "<=", ">=", "->", "++", "--", "&&", "||", "<<", ">>", "##",
+    "+=", "-=", "*=", "/=", "%=", "&=", "|=", "^=",
+};
+
+// pp_punctuator_length returns the length of the punctuator at p.
+int pp_punctuator_length(char *p) {
+    // most of the punctuators are a single character
+    if (!strchr("<>.=!-+&|#*/%^", p[0]) || !strchr("<>.=-+&|#", p[1])) return 1;
+    for (int i = 0; i < sizeof(punctuators) / sizeof(*punctuators); i++) {
+        int len = strlen(punctuators[i]);
+        if (strncmp(p, punctuators[i], len) == 0) {
+            return len;
+        }
+    }
+    return 1;
+}
+
+// skip_literal returns the end of the string or char literal starting at p, which ends with the given quote.
+// An unterminated one ends at the end of the line, to be reported by the parser if it is not skipped.
+char *skip_literal(char *p, char quote) {
+    p++;
+    while (*p != quote && *p != '\n' && *p != '\0') {
+        if (*p == '\\' && p[1] != '\n' && p[1] != '\0') {
+            p++;
+        }
+        p++;
+    }
+    return *p == quote ? p + 1 : p;
+}
+
+// pp_lex lexes the next preprocessing token.
+PPToken *pp_lex(PPLexer *lx) {
+    bool space = false;
+    for (;;) {
+        char *p = lx->p;
+        if (*p == '\n') {
+            lx->p++;
+            lx->line++;
+            lx->line_start = lx->p;
+            lx->bol = true;
+            space = false;
+        } else if (*p == '\\' && p[1] == '\n') {
+            // line continuation
+            lx->p += 2;
+            lx->line++;
+            lx->line_start = lx->p;
+            space = true;
+        } else if (isspace(*p)) {
+            lx->p++;
+            space = true;
+        } else if (strncmp(p, "//", 2) == 0) {
+            while (*lx->p != '\n' && *lx->p != '\0') {
+                lx->p++;
+            }
+            space = true;
+        } else if (strncmp(p, "/*", 2) == 0) {
+            char *end = strstr(p + 2, "*/");
+            if (!end) {
+                PPToken tok = {.kind = PP_EOF, .str = p, .file = lx->file, .line = lx->line, .col = p - lx->line_start};
+                pp_error(&tok, "couldn't find comment closer");
+            }
+            for (char *q = p; q < end; q++) {
+                if (*q == '\n') {
+                    lx->line++;
+                    lx->line_start = q + 1;
+                    lx->bol = true;
+                }
+            }
+            lx->p = end + 2;
+            space = true;
+        } else {
+            break;
+        }
+    }
+
+    PPToken *tok = arena_alloc(lx->arena, sizeof(PPToken));
+    char *p = lx->p;
+    tok->str = p;
+    tok->file = lx->file;
+    tok->line = lx->line;
+    tok->col = p - lx->line_start;
+    tok->bol = lx->bol;
+    tok->space = space;
+    lx->bol = false;
+
+    if (*p == '\0') {
+        tok->kind = PP_EOF;
+        return tok;
+    }
+    if (isalpha(*p) || *p == '_') {
+        while (isalnum(*p) || *p == '_') {
+            p++;
+        }
+        tok->kind = PP_IDENTIFIER;
+    } else if (isdigit(*p) || (*p == '.' && isdigit(p[1]))) {
+        // preprocessing number, e.g. 0x1f, 10L, 1e+5
+        while (isalnum(*p) || *p == '_' || *p == '.'
+               || ((*p == '+' || *p == '-') && strchr("eEpP", p[-1]))) {
+            p++;
+        }
+        tok->kind = PP_NUMBER;
+    } else if (*p == '"') {
+        p = skip_literal(p, '"');
+        tok->kind = PP_STRING;
+    } else if (*p == '\'') {
+        p = skip_literal(p, '\'');
+        tok->kind = PP_CHAR;
+    } else {
+        p += pp_punctuator_length(p);
+        tok->kind = PP_PUNCTUATOR;
+    }
+    tok->len = p - tok->str;
+    lx->p = p;
+    return tok;
+}
+
+// init_lexer initializes the lexer of the given file, allocating the tokens from the given arena.
+void init_lexer(PPLexer *lx, SourceFile *file, Arena *arena) {
+    lx->file = file;
+    lx->p = file->contents;
+    lx->line = 1;
+    lx->line_start = file->contents;
+    lx->bol = true;
+    lx->arena = arena;
+}
+
+// is_directive returns true if the tokens from the given index are the directive of the given name.
+bool is_directive(Vector *tokens, int i, char *name) {
+    PPToken *hash = (PPToken*) vector_get(tokens, i);
+    if (!hash->bol || !equal(hash, "#") || i + 1 >= vector_count(tokens)) return false;
+    PPToken *directive = (PPToken*) vector_get(tokens, i + 1);
+    return !directive->bol && equal(directive, name);
+}
+
+// find_include_guard returns the macro guarding the whole file given by the tokens
+// (the file is "#ifndef GUARD ... #endif" without #else or #elif), NULL if not guarded.
+Atom *find_include_guard(Vector *tokens) {
+    int count = vector_count(tokens);
+    if (count < 3 || !is_directive(tokens, 0, "ifndef")) return NULL;
+    PPToken *guard = (PPToken*) vector_get(tokens, 2);
+    if (guard->bol || guard->kind != PP_IDENTIFIER) return NULL;
+
+    int depth = 0;
+    for (int i = 0; i < count; i++) {
+        if (is_directive(tokens, i, "if") || is_directive(tokens, i, "ifdef") || is_directive(tokens, i, "ifndef")) {
+            depth++;
+        } else if (depth == 1 && (is_directive(tokens, i, "else") || is_directive(tokens, i, "elif"))) {
+            return NULL;
+        } else if (is_directive(tokens, i, "endif")) {
+            depth--;
+            if (depth > 0) continue;
+            // nothing but the rest of the #endif line and the end of the file may follow
+            for (i += 2; i < count; i++) {
+                PPToken *tok = (PPToken*) vector_get(tokens, i);
+                if (tok->kind == PP_EOF) return pp_atom(guard);
+                if (tok->bol) return NULL;
+            }
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+// source_changed returns true if the given cached file has been changed or removed since it was read.
+bool source_changed(SourceFile *file, char *path) {
+    struct stat st;
+    return stat(path, &st) != 0 || st.st_size != file->size
+        || st.st_mtim.tv_sec != file->mtime.tv_sec || st.st_mtim.tv_nsec != file->mtime.tv_nsec;
+}
+
+// read_source_file returns the file of the given path, reading and tokenizing it only for the first time.
+// name: path to report the errors with
+SourceFile *read_source_file(char *path, char *name) {
+    // the same file may be found by different paths
+    char real[PATH_MAX];
+    char *key_path = realpath(path, real) ? real : path;
+    Atom *key = intern(key_path, strlen(key_path));
+    SourceFile *file = map_get(source_files, key);
+    if (file && revalidate_sources && !file->checked && file->tokens) {
+        if (source_changed(file, key_path)) {
+            file = NULL;
+        } else {
+            file->checked = true;
+        }
+    }
+    if (file) return file;
+
+    file = arena_alloc(&permanent_arena, sizeof(SourceFile));
+    file->name = name;
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        file->mtime = st.st_mtim;
+        file->size = st.st_size;
+    }
+    file->contents = read_file(path);
+    if (revalidate_sources) {
+        // the tokens refer to the contents, which must not change with the file while cached
+        file->contents = format("%s", file->contents);
+    }
+    file->tokens = new_vector_in(&permanent_arena);
+    PPLexer lx;
+    init_lexer(&lx, file, &permanent_arena);
+    for (;;) {
+        PPToken *tok = pp_lex(&lx);
+        vector_add(file->tokens, tok);
+        if (tok->kind == PP_EOF) break;
+    }
+    file->guard = find_include_guard(file->tokens);
+    map_put(source_files, key, file);
+    headers_read++;
+    return file;
+}
+
+// push_context pushes a new context of the given tokens.
+Context *push_context(ContextKind kind, Vector *tokens) {
+    Context *ctx = arena_alloc(kind == CTX_FILE ? &permanent_arena : &pp_arena, sizeof(Context));
+    ctx->kind = kind;
+    ctx->tokens = tokens;
+    ctx->conditionals = vector_count(conditionals);
+    vector_add(contexts, ctx);
+    return ctx;
+}
+
+// pop_context pops the innermost context, enabling its macro again.
+void pop_context() {
+    Context *ctx = (Context*) vector_get_last(contexts);
+    if (ctx->macro) {
+        ctx->macro->disabled--;
+    }
+    vector_delete(contexts, vector_count(contexts) - 1);
+}
+
+// raw_next returns the next token without expanding it, popping the macro expansions read through.
+// Returns PP_EOF at the end of the innermost file or argument, without proceeding.
+PPToken *raw_next() {
+    for (;;) {
+        Context *ctx = (Context*) vector_get_last(contexts);
+        if (ctx->lexer) {
+            PPToken *tok = ctx->lookahead ? ctx->lookahead : pp_lex(ctx->lexer);
+            ctx->lookahead = tok->kind == PP_EOF ? tok : NULL;
+            return tok;
+        }
+        if (ctx->pos < vector_count(ctx->tokens)) {
+            PPToken *tok = (PPToken*) vector_get(ctx->tokens, ctx->pos);
+            if (tok->kind != PP_EOF) {
+                ctx->pos++;
+            }
+            return tok;
+        }
+        if (ctx->kind != CTX_MACRO) {
+            return &eof_token;
+        }
+        pop_context();
+    }
+}
+
+// unread puts the token returned by raw_next back.
+void unread(PPToken *tok) {
+    if (tok->kind == PP_EOF) return;
+    Context *ctx = (Context*) vector_get_last(contexts);
+    if (ctx->lexer) {
+        ctx->lookahead = tok;
+    } else {
+        ctx->pos--;
+    }
+}
+
+// read_line returns the rest of the tokens of the current line of the directive, elements: PPToken*
+Vector *read_line() {
+    Vector *tokens = new_vector_in(&pp_arena);
+    for (;;) {
+        PPToken *tok = raw_next();
+        if (tok->kind == PP_EOF || tok->bol) {
+            unread(tok);
+            return tokens;
+        }
+        vector_add(tokens, tok);
+    }
+}
+
+// skip_line skips the rest of the tokens of the current line of the directive.
+void skip_line() {
+    read_line();
+}
+
+// new_macro_token returns a copy of the given token made by the expansion of a macro at the given invocation.
+PPToken *new_macro_token(PPToken *tok, PPToken *invocation) {
+    PPToken *copy = copy_token(tok);
+    copy->file = invocation->file;
+    copy->line = invocation->line;
+    copy->col = -1;
+    copy->bol = false;
+    return copy;
+}
+
+// stringify makes the string literal token spelling the given argument, for the # operator.
+// arg: elements: PPToken*
+PPToken *stringify(Vector *arg, PPToken *invocation) {
+    int size = 3;
+    for (int i = 0; i < vector_count(arg); i++) {
+        PPToken *tok = (PPToken*) vector_get(arg, i);
+        size += tok->len * 2 + 1;
+    }
+    char *buf = arena_alloc(&pp_arena, size);
+    int len = 0;
+    buf[len++] = '"';
+    for (int i = 0; i < vector_count(arg); i++) {
+        PPToken *tok = (PPToken*) vector_get(arg, i);
+        if (i > 0 && tok->space) {
+            buf[len++] = ' ';
+        }
+        for (int j = 0; j < tok->len; j++) {
+            char c = tok->str[j];
+            // quotes and backslashes in the literals are escaped
+            if ((tok->kind == PP_STRING || tok->kind == PP_CHAR) && (c == '"' || c == '\\')) {
+                buf[len++] = '\\';
+            }
+            buf[len++] = c;
+        }
+    }
+    buf[len++] = '"';
+
+    PPToken *tok = new_macro_token(invocation, invocation);
+    tok->kind = PP_STRING;
+    tok->str = buf;
+    tok->len = len;
+    tok->atom = NULL;
+    return tok;
+}
+
+// paste concatenates the given tokens into a single token, for the ## operator.
+PPToken *paste(PPToken *left, PPToken *right) {
+    char *buf = arena_alloc(&pp_arena, left->len + right->len + 1);
+    memcpy(buf, left->str, left->len);
+    memcpy(buf + left->len, right->str, right->len);
+
+    SourceFile file = {.name = left->file->name, .contents = buf};
+    PPLexer lx;
+    init_lexer(&lx, &file, &pp_arena);
+    PPToken *tok = pp_lex(&lx);
+    if (lx.p != buf + left->len + right->len) {
+        pp_error(left, "pasting \"%.*s\" and \"%.*s\" does not give a valid token",
+                 left->len, left->str, right->len, right->str);
+    }
+    tok->file = left->file;
+    tok->line = left->line;
+    tok->col = -1;
+    tok->bol = false;
+    tok->space = left->space;
+    return tok;
+}
+
+// find_param returns the index of the parameter of the macro named by the given token, -1 if not a parameter.
+int find_param(Macro *macro, PPToken *tok) {
+    if (!macro->function_like || tok->kind != PP_IDENTIFIER) return -1;
+    for (int i = 0; i < vector_count(macro->params); i++) {
+        if (vector_get(macro->params, i) == pp_atom(tok)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// expand_argument returns the fully macro expanded tokens of the given argument, elements: PPToken*
+Vector *expand_argument(Vector *arg) {
+    push_context(CTX_ARGUMENT, arg);
+    Vector *expanded = new_vector_in(&pp_arena);
+    for (;;) {
+        PPToken *tok = expand_next();
+        if (tok->kind == PP_EOF) break;
+        vector_add(expanded, tok);
+    }
+    pop_context();
+    return expanded;
+}
+
+// add_token adds the given token to the expansion, or pastes it to the last one if paste_last is true.
+void add_token(Vector *expansion, PPToken *tok, bool paste_last) {
+    if (paste_last && vector_count(expansion) > 0) {
+        vector_set(expansion, vector_count(expansion) - 1, paste((PPToken*) vector_get_last(expansion), tok));
+    } else {
+        vector_add(expansion, tok);
+    }
+}
+
+// append_tokens appends the tokens of an argument to the expansion, pasting the first one if paste_first is true.
+void append_tokens(Vector *expansion, Vector *tokens, bool paste_first, PPToken *invocation) {
+    for (int i = 0; i < vector_count(tokens); i++) {
+        add_token(expansion, new_macro_token((PPToken*) vector_get(tokens, i), invocation), i == 0 && paste_first);
+    }
+}
+
+// substitute returns the replacement list of the macro with the arguments substituted, elements: PPToken*
+// args: elements: Vector* of PPToken*, NULL for an object-like macro
+Vector *substitute(Macro *macro, Vector *args, PPToken *invocation) {
+    Vector *expansion = new_vector_in(&pp_arena);
+    // arguments expanded only when they are used without # or ##
+    Vector **expanded = args ? arena_alloc(&pp_arena, sizeof(Vector*) * vector_count(args)) : NULL;
+    int count = vector_count(macro->body);
+    bool paste_next = false;
+
+    for (int i = 0; i < count; i++) {
+        PPToken *tok = (PPToken*) vector_get(macro->body, i);
+        PPToken *next = i + 1 < count ? (PPToken*) vector_get(macro->body, i + 1) : NULL;
+
+        if (equal(tok, "##") && i > 0 && next) {
+            paste_next = true;
+            continue;
+        }
+        if (equal(tok, "#") && macro->function_like && next && find_param(macro, next) >= 0) {
+            PPToken *str = stringify((Vector*) vector_get(args, find_param(macro, next)), invocation);
+            str->space = tok->space;
+            add_token(expansion, str, paste_next);
+            paste_next = false;
+            i++;
+            continue;
+        }
+
+        int param = find_param(macro, tok);
+        if (param < 0) {
+            add_token(expansion, new_macro_token(tok, invocation), paste_next);
+            paste_next = false;
+            continue;
+        }
+
+        Vector *arg = (Vector*) vector_get(args, param);
+        if (paste_next || (next && equal(next, "##"))) {
+            // ", ## __VA_ARGS__" removes the comma if there are no variadic arguments
+            if (paste_next && vector_count(arg) == 0 && macro->variadic && param == vector_count(macro->params) - 1
+                && vector_count(expansion) > 0 && equal((PPToken*) vector_get_last(expansion), ",")) {
+                vector_delete(expansion, vector_count(expansion) - 1);
+            } else {
+                append_tokens(expansion, arg, paste_next, invocation);
+            }
+        } else {
+            if (!expanded[param]) {
+                expanded[param] = expand_argument(arg);
+            }
+            int start = vector_count(expansion);
+            append_tokens(expansion, expanded[param], false, invocation);
+            if (vector_count(expansion) > start) {
+                ((PPToken*) vector_get(expansion, start))->space = tok->space;
+            }
+        }
+        paste_next = false;
+    }
+
+    if (vector_count(expansion) > 0) {
+        ((PPToken*) vector_get(expansion, 0))->space = invocation->space;
+    }
+    return expansion;
+}
+
+// read_arguments reads the arguments of the invocation of the given function-like macro, after its name and "(".
+// Returns the tokens of each argument, elements: Vector* of PPToken*
+Vector *read_arguments(Macro *macro, PPToken *invocation) {
+    Vector *args = new_vector_in(&pp_arena);
+    Vector *arg = new_vector_in(&pp_arena);
+    int depth = 0;
+    for (;;) {
+        PPToken *tok = raw_next();
+        if (tok->kind == PP_EOF) {
+            pp_error(invocation, "unterminated argument list invoking macro %s", macro->name->name);
+        }
+        if (tok->bol && equal(tok, "#")) {
+            pp_error(tok, "directives are not supported in the arguments of macro %s", macro->name->name);
+        }
+        if (depth == 0 && equal(tok, ")")) break;
+        bool variadic_rest = macro->variadic && vector_count(args) == vector_count(macro->params) - 1;
+        if (depth == 0 && equal(tok, ",") && !variadic_rest) {
+            vector_add(args, arg);
+            arg = new_vector_in(&pp_arena);
+            continue;
+        }
+        if (equal(tok, "(")) {
+            depth++;
+        } else if (equal(tok, ")")) {
+            depth--;
+        }
+        vector_add(arg, tok);
+    }
+    vector_add(args, arg);
+
+    int params = vector_count(macro->params);
+    if (macro->variadic && vector_count(args) == params - 1) {
+        // no variadic arguments
+        vector_add(args, new_vector_in(&pp_arena));
+    }
+    if (params == 0 && vector_count(args) == 1 && vector_count(arg) == 0) {
+        // "f()" of the macro without parameters
+        vector_clear(args);
+    }
+    if (vector_count(args) != params) {
+        pp_error(invocation, "macro %s takes %d argument(s), but %d given",
+                 macro->name->name, params, vector_count(args));
+    }
+    return args;
+}
+
+// find_macro returns the macro named by the given token, NULL if it is not a macro.
+Macro *find_macro(PPToken *tok) {
+    if (tok->kind != PP_IDENTIFIER || !macro_names[(unsigned char) tok->str[0] & 127][tok->len & 31]) return NULL;
+    return map_get(macros, pp_atom(tok));
+}
+
+// expand_next returns the next token, expanding the macros.
+// Returns PP_EOF at the end of the innermost file or argument.
+PPToken *expand_next() {
+    for (;;) {
+        PPToken *tok = raw_next();
+        if (tok->noexpand) return tok;
+        Macro *macro = find_macro(tok);
+        if (!macro) return tok;
+        if (macro->disabled > 0) {
+            // not to be expanded even after the macro is enabled again
+            tok = copy_token(tok);
+            tok->noexpand = true;
+            return tok;
+        }
+
+        Vector *args = NULL;
+        if (macro->function_like) {
+            PPToken *next = raw_next();
+            if (!equal(next, "(")) {
+                // the name of a function-like macro without arguments is not an invocation
+                unread(next);
+                return tok;
+            }
+            args = read_arguments(macro, tok);
+        }
+        Context *ctx = push_context(CTX_MACRO, substitute(macro, args, tok));
+        ctx->macro = macro;
+        macro->disabled++;
+    }
+}
+
+// write_output appends the given characters to the output, or the given number of c if str is NULL.
+void write_output(char *str, char c, int len) {
+    if (pp_output_len + len + 1 > pp_output_capacity) {
+        pp_output_capacity = (pp_output_len + len + 1) * 2;
+        pp_output = realloc(pp_output, pp_output_capacity);
+        if (!pp_output) {
+            error("out of memory");
+        }
+    }
+    if (str) {
+        memcpy(pp_output + pp_output_len, str, len);
+    } else {
+        memset(pp_output + pp_output_len, c, len);
+    }
+    pp_output_len += len;
+}
+
+// new_line_mark records that the output from the current line comes from the given line of the given file.
+void new_line_mark(SourceFile *file, int line) {
+    if (output_col > 0) {
+        write_output(NULL, '\n', 1);
+        output_line++;
+        output_col = 0;
+    }
+    LineMark *mark = arena_alloc(&permanent_arena, sizeof(LineMark));
+    mark->line = output_line;
+    mark->file = file->name;
+    mark->file_line = line;
+    vector_add(line_marks, mark);
+    output_file = file;
+    output_file_line = line;
+}
+
+// write_token writes out the given token on its line of the output.
+void write_token(PPToken *tok) {
+    // keep the lines of the output in sync with the file
+    if (tok->file == output_file && output_file_line < tok->line) {
+        write_output(NULL, '\n', tok->line - output_file_line);
+        output_line += tok->line - output_file_line;
+        output_col = 0;
+        output_file_line = tok->line;
+    }
+    if (output_col < tok->col) {
+        // keep the column too, for the error messages
+        write_output(NULL, ' ', tok->col - output_col);
+        output_col = tok->col;
+    } else if (output_col > 0 && (tok->space || tok->col < 0 || output_expanded)) {
+        // tokens next to the expansions of macros are spaced not to be joined
+        write_output(NULL, ' ', 1);
+        output_col++;
+    }
+    write_output(tok->str, 0, tok->len);
+    output_col += tok->len;
+    output_expanded = tok->col < 0;
+    preprocessed_tokens++;
+}
+
+// find_include returns the path of the included file, NULL if not found.
+// quoted: "file" to find in the directory of the including file first, <file> otherwise
+char *find_include(char *name, bool quoted, SourceFile *includer) {
+    if (name[0] == '/') {
+        return access(name, R_OK) == 0 ? name : NULL;
+    }
+    if (quoted) {
+        char *dir = dirname(format("%s", includer->name));
+        char *path = format("%s/%s", dir, name);
+        if (access(path, R_OK) == 0) return path;
+    }
+    for (int i = 0; i < vector_count(include_paths); i++) {
+        char *path = format("%s/%s", (char*) vector_get(include_paths, i), name);
+        if (access(path, R_OK) == 0) return path;
+    }
+    return NULL;
+}
+
+// include_file processes the #include directive after its name.
+void include_file(PPToken *directive) {
+    PPToken *tok = raw_next();
+    char *name;
+    bool quoted;
+    if (tok->kind == PP_STRING && !tok->bol) {
+        name = format("%.*s", tok->len - 2, tok->str + 1);
+        quoted = true;
+    } else if (equal(tok, "<") && !tok->bol) {
+        // the name is taken as is, not as the tokens
+        char *end = strchr(tok->str, '>');
+        char *newline = strchr(tok->str, '\n');
+        if (!end || (newline && newline < end)) {
+            pp_error(tok, "expected \"FILE\" or <FILE>");
+        }
+        name = format("%.*s", (int) (end - tok->str - 1), tok->str + 1);
+        quoted = false;
+    } else {
+        pp_error(tok, "expected \"FILE\" or <FILE>");
+    }
+    skip_line();
+
+    char *path = find_include(name, quoted, directive->file);
+    if (!path) {
+        pp_error(tok, "%s: file not found", name);
+    }
+    SourceFile *file = read_source_file(path, path);
+    if (file->once || (file->guard && map_get(macros, file->guard))) {
+        headers_skipped++;
+        return;
+    }
+    if (vector_count(contexts) > 200) {
+        pp_error(tok, "#include nested too deeply");
+    }
+    push_context(CTX_FILE, file->tokens);
+    new_line_mark(file, 1);
+}
+
+// consume_punctuator returns true and proceeds if the next token on the directive line is the given punctuator.
+bool consume_punctuator(char *op) {
+    PPToken *tok = raw_next();
+    if (!tok->bol && equal(tok, op)) {
+        return true;
+    }
+    unread(tok);
+    return false;
+}
+
+// define_macro processes the #define directive after its name.
+void define_macro(PPToken *directive) {
+    PPToken *name = raw_next();
+    if (name->kind != PP_IDENTIFIER || name->bol) {
+        pp_error(name->bol ? directive : name, "macro name must be an identifier");
+    }
+    Macro *macro = arena_alloc(&permanent_arena, sizeof(Macro));
+    macro->name = pp_atom(name);
+    macro->body = new_vector_in(&permanent_arena);
+
+    PPToken *tok = raw_next();
+    if (equal(tok, "(") && !tok->space && !tok->bol) {
+        macro->function_like = true;
+        macro->params = new_vector_in(&permanent_arena);
+        for (int i = 0; !consume_punctuator(")"); i++) {
+            if (i > 0 && !consume_punctuator(",")) {
+                pp_error(raw_next(), "expected ',' or ')' in the parameters of macro %s", macro->name->name);
+            }
+            PPToken *param = raw_next();
+            if (equal(param, "...")) {
+                macro->variadic = true;
+                vector_add(macro->params, intern("__VA_ARGS__", 11));
+                if (!consume_punctuator(")")) {
+                    pp_error(raw_next(), "expected ')' after '...'");
+                }
+                break;
+            }
+            if (param->kind != PP_IDENTIFIER || param->bol) {
+                pp_error(param, "expected a parameter name");
+            }
+            vector_add(macro->params, pp_atom(param));
+        }
+    } else {
+        unread(tok);
+    }
+
+    // the replacement list outlives the tokens lexed from the main file
+    Vector *body = read_line();
+    for (int i = 0; i < vector_count(body); i++) {
+        PPToken *copy = arena_alloc(&permanent_arena, sizeof(PPToken));
+        *copy = *(PPToken*) vector_get(body, i);
+        copy->bol = false;
+        vector_add(macro->body, copy);
+    }
+    map_put(macros, macro->name, macro);
+    macro_names[(unsigned char) name->str[0] & 127][name->len & 31] = true;
+}
+
+
+// Tokens of the #if expression being evaluated
+typedef struct IfExpr {
+    // elements: PPToken*
+    Vector *tokens;
+    int pos;
+    PPToken *directive;
+} IfExpr;
+
+long eval_conditional(IfExpr *e);
+
+// if_peek returns the next token of the #if expression, NULL at the end.
+PPToken *if_peek(IfExpr *e) {
+    return e->pos < vector_count(e->tokens) ? (PPToken*) vector_get(e->tokens, e->pos) : NULL;
+}
+
+// if_consume returns true and proceeds if the next token of the #if expression is the given punctuator.
+bool if_consume(IfExpr *e, char *op) {
+    PPToken *tok = if_peek(e);
+    if (tok && equal(tok, op)) {
+        e->pos++;
+        return true;
+    }
+    return false;
+}
+
+// if_expect proceeds if the next token of the #if expression is the given punctuator. Reports error otherwise.
+void if_expect(IfExpr *e, char *op) {
+    if (!if_consume(e, op)) {
+        PPToken *tok = if_peek(e);
+        pp_error(tok ? tok : e->directive, "expected '%s' in #%.*s", op, e->directive->len, e->directive->str);
+    }
+}
+
+// eval_primary evaluates a number, a character, a parenthesized expression, or a unary operator.
+long eval_primary(IfExpr *e) {
+    PPToken *tok = if_peek(e);
+    if (!tok) {
+        pp_error(e->directive, "expected an expression in #%.*s", e->directive->len, e->directive->str);
+    }
+    e->pos++;
+    if (equal(tok, "(")) {
+        long val = eval_conditional(e);
+        if_expect(e, ")");
+        return val;
+    }
+    if (equal(tok, "!")) return !eval_primary(e);
+    if (equal(tok, "-")) return -eval_primary(e);
+    if (equal(tok, "+")) return eval_primary(e);
+    if (equal(tok, "~")) return ~eval_primary(e);
+    if (tok->kind == PP_NUMBER) {
+        char *end;
+        long val = strtoul(tok->str, &end, 0);
+        // suffixes such as "UL"
+        while (end < tok->str + tok->len && strchr("uUlL", *end)) {
+            end++;
+        }
+        if (end != tok->str + tok->len) {
+            pp_error(tok, "invalid integer constant in #%.*s", e->directive->len, e->directive->str);
+        }
+        return val;
+    }
+    if (tok->kind == PP_CHAR) {
+        char c = tok->str[1];
+        if (c != '\\') return c;
+        // escape sequences other than \n and \0 stand for the character itself, e.g. '\''
+        return tok->str[2] == 'n' ? '\n' : tok->str[2] == '0' ? 0 : tok->str[2];
+    }
+    if (tok->kind == PP_IDENTIFIER) {
+        // identifiers which are not macros
+        return 0;
+    }
+    pp_error(tok, "unexpected token in #%.*s", e->directive->len, e->directive->str);
+}
+
+// Binary operators in #if, from the lowest precedence
+char *binary_operators[][4] = {
+    {"||"}, {"&&"}, {"|"}, {"^"}, {"&"}, {"==", "!="}, {"<", "<=", ">", ">="}, {"<<", ">>"}, {"+", "-"},
+    {"*", "/", "%"},
+};
+
+// binary_precedence returns the precedence of the binary operator of the given token, 0 if not a binary operator.
+int binary_precedence(PPToken *tok) {
+    if (!tok || tok->kind != PP_PUNCTUATOR) return 0;
+    for (int i = 0; i < sizeof(binary_operators) / sizeof(*binary_operators); i++) {
+        for (int j = 0; j < 4 && binary_operators[i][j]; j++) {
+            if (equal(tok, binary_operators[i][j])) return i + 1;
+        }
+    }
+    return 0;
+}
+
+// eval_binary evaluates the binary operators of the given precedence or higher, by precedence climbing.
+long eval_binary(IfExpr *e, int min_precedence) {
+    long left = eval_primary(e);
+    for (;;) {
+        PPToken *op = if_peek(e);
+        int precedence = binary_precedence(op);
+        if (precedence == 0 || precedence < min_precedence) return left;
+        e->pos++;
+        long right = eval_binary(e, precedence + 1);
+        if (equal(op, "||")) left = left || right;
+        else if (equal(op, "&&")) left = left && right;
+        else if (equal(op, "|")) left = left | right;
+        else if (equal(op, "^")) left = left ^ right;
+        else if (equal(op, "&")) left = left & right;
+        else if (equal(op, "==")) left = left == right;
+        else if (equal(op, "!=")) left = left != right;
+        else if (equal(op, "<")) left = left < right;
+        else if (equal(op, "<=")) left = left <= right;
+        else if (equal(op, ">")) left = left > right;
+        else if (equal(op, ">=")) left = left >= right;
+        else if (equal(op, "<<")) left = left << right;
+        else if (equal(op, ">>")) left = left >> right;
+        else if (equal(op, "+")) left = left + right;
+        else if (equal(op, "-")) left = left - right;
+        else if (equal(op, "*")) left = left * right;
+        else {
+            if (right == 0) {
+                pp_error(op, "division by zero in #%.*s", e->directive->len, e->directive->str);
+            }
+            left = equal(op, "/") ? left / right : left % right;
+        }
+    }
+}
+
+// eval_conditional evaluates the conditional operator "?:", the lowest precedence in #if.
+long eval_conditional(IfExpr *e) {
+    long cond = eval_binary(e, 1);
+    if (!if_consume(e, "?")) return cond;
+    long then = eval_conditional(e);
+    if_expect(e, ":");
+    long els = eval_conditional(e);
+    return cond ? then : els;
+}
+
+// new_number_token returns a number token of 0 or 1 at the given token, for "defined" in #if.
+PPToken *new_number_token(PPToken *tok, bool value) {
+    PPToken *number = copy_token(tok);
+    number->kind = PP_NUMBER;
+    number->str = value ? "1" : "0";
+    number->len = 1;
+    return number;
+}
+
+// eval_if evaluates the expression of the #if or #elif directive on the rest of the line.
+bool eval_if(PPToken *directive) {
+    Vector *line = read_line();
+    // "defined NAME" and "defined(NAME)" are evaluated before the macros are expanded
+    Vector *tokens = new_vector_in(&pp_arena);
+    for (int i = 0; i < vector_count(line); i++) {
+        PPToken *tok = (PPToken*) vector_get(line, i);
+        if (!equal(tok, "defined")) {
+            vector_add(tokens, tok);
+            continue;
+        }
+        bool paren = i + 1 < vector_count(line) && equal((PPToken*) vector_get(line, i + 1), "(");
+        int name = i + (paren ? 2 : 1);
+        if (name >= vector_count(line) || ((PPToken*) vector_get(line, name))->kind != PP_IDENTIFIER
+            || (paren && (name + 1 >= vector_count(line) || !equal((PPToken*) vector_get(line, name + 1), ")")))) {
+            pp_error(tok, "macro name expected after defined");
+        }
+        vector_add(tokens, new_number_token(tok, find_macro((PPToken*) vector_get(line, name)) != NULL));
+        i = name + (paren ? 1 : 0);
+    }
+
+    IfExpr e = {.tokens = expand_argument(tokens), .directive = directive};
+    long val = eval_conditional(&e);
+    if (if_peek(&e)) {
+        pp_error(if_peek(&e), "extra tokens in #%.*s", directive->len, directive->str);
+    }
+    return val != 0;
+}
+
+// skip_group skips the tokens until the #elif, #else or #endif of the current conditional directive,
+// and returns the name of the directive (the token after "#").
+PPToken *skip_group() {
+    int depth = 0;
+    for (;;) {
+        PPToken *tok = raw_next();
+        if (tok->kind == PP_EOF) {
+            Conditional *cond = (Conditional*) vector_get_last(conditionals);
+            pp_error(cond->directive, "unterminated conditional directive");
+        }
+        if (!tok->bol || !equal(tok, "#")) continue;
+        PPToken *name = raw_next();
+        if (name->bol) {
+            unread(name);
+            continue;
+        }
+        if (equal(name, "if") || equal(name, "ifdef") || equal(name, "ifndef")) {
+            depth++;
+        } else if (depth > 0 && equal(name, "endif")) {
+            depth--;
+        } else if (depth == 0 && (equal(name, "elif") || equal(name, "else") || equal(name, "endif"))) {
+            return name;
+        }
+    }
+}
+
+// enter_group processes the conditional directives until a group whose condition holds is found,
+// starting from the condition of the given #if, #ifdef, #ifndef or #elif directive.
+void enter_group(PPToken *directive, bool condition) {
+    Conditional *cond = (Conditional*) vector_get_last(conditionals);
+    for (;;) {
+        if (condition) {
+            cond->taken = true;
+            return;
+        }
+        PPToken *name = skip_group();
+        if (equal(name, "endif")) {
+            skip_line();
+            vector_delete(conditionals, vector_count(conditionals) - 1);
+            return;
+        }
+        if (cond->in_else) {
+            pp_error(name, "#%.*s after #else", name->len, name->str);
+        }
+        if (equal(name, "else")) {
+            skip_line();
+            cond->in_else = true;
+            condition = true;
+        } else {
+            condition = eval_if(name);
+        }
+    }
+}
+
+// start_conditional processes the #if, #ifdef or #ifndef directive after its name.
+void start_conditional(PPToken *directive) {
+    Conditional *cond = arena_alloc(&permanent_arena, sizeof(Conditional));
+    // the token lexed from the main file may be released before #endif
+    cond->directive = arena_alloc(&permanent_arena, sizeof(PPToken));
+    *cond->directive = *directive;
+    vector_add(conditionals, cond);
+
+    bool condition;
+    if (equal(directive, "if")) {
+        condition = eval_if(directive);
+    } else {
+        PPToken *name = raw_next();
+        if (name->kind != PP_IDENTIFIER || name->bol) {
+            pp_error(name->bol ? directive : name, "macro name expected after #%.*s", directive->len, directive->str);
+        }
+        skip_line();
+        condition = (find_macro(name) != NULL) == equal(directive, "ifdef");
+    }
+    enter_group(directive, condition);
+}
+
+// next_group processes the #elif, #else or #endif directive after a group which has been taken.
+void next_group(PPToken *directive) {
+    Context *file = (Context*) vector_get_last(contexts);
+    if (vector_count(conditionals) <= file->conditionals) {
+        pp_error(directive, "#%.*s without #if", directive->len, directive->str);
+    }
+    Conditional *cond = (Conditional*) vector_get_last(conditionals);
+    if (cond->in_else && !equal(directive, "endif")) {
+        pp_error(directive, "#%.*s after #else", directive->len, directive->str);
+    }
+    // the rest of the groups are skipped until #endif
+    PPToken *name = directive;
+    while (!equal(name, "endif")) {
+        if (equal(name, "else")) {
+            cond->in_else = true;
+        }
+        skip_line();
+        name = skip_group();
+        if (cond->in_else && !equal(name, "endif")) {
+            pp_error(name, "#%.*s after #else", name->len, name->str);
+        }
+    }
+    skip_line();
+    vector_delete(conditionals, vector_count(conditionals) - 1);
+}
+
+// directive processes the preprocessing directive after "#".
+void directive(PPToken *hash) {
+    PPToken *name = raw_next();
+    if (name->bol || name->kind == PP_EOF) {
+        // null directive
+        unread(name);
+        return;
+    }
+    if (equal(name, "include")) {
+        include_file(name);
+    } else if (equal(name, "define")) {
+        define_macro(name);
+    } else if (equal(name, "undef")) {
+        PPToken *macro = raw_next();
+        if (macro->kind != PP_IDENTIFIER || macro->bol) {
+            pp_error(macro->bol ? name : macro, "macro name must be an identifier");
+        }
+        map_put(macros, pp_atom(macro), NULL);
+        skip_line();
+    } else if (equal(name, "if") || equal(name, "ifdef") || equal(name, "ifndef")) {
+        start_conditional(name);
+    } else if (equal(name, "elif") || equal(name, "else") || equal(name, "endif")) {
+        next_group(name);
+    } else if (equal(name, "pragma")) {
+        PPToken *pragma = raw_next();
+        if (equal(pragma, "once") && !pragma->bol) {
+            name->file->once = true;
+        } else {
+            // other pragmas are ignored
+            unread(pragma);
+        }
+        skip_line();
+    } else if (equal(name, "error")) {
+        char *end = name->str + name->len;
+        while (*end != '\n' && *end != '\0') {
+            end++;
+        }
+        pp_error(name, "#error%.*s", (int) (end - name->str - name->len), name->str + name->len);
+    } else {
+        pp_error(name, "unknown directive #%.*s", name->len, name->str);
+    }
+}
+
+// end_file finishes the innermost file, and returns true if it is the main file.
+bool end_file() {
+    Context *ctx = (Context*) vector_get_last(contexts);
+    if (vector_count(conditionals) > ctx->conditionals) {
+        Conditional *cond = (Conditional*) vector_get_last(conditionals);
+        pp_error(cond->directive, "unterminated conditional directive");
+    }
+    pop_context();
+    if (vector_count(contexts) == 0) return true;
+
+    // continue from the next token of the including file
+    PPToken *next = raw_next();
+    unread(next);
+    new_line_mark(next->file, next->line);
+    return false;
+}
+
+// add_include_path adds the directory to find the headers in (-I).
+void add_include_path(char *dir) {
+    if (!include_paths) {
+        include_paths = new_vector_in(&permanent_arena);
+    }
+    vector_add(include_paths, dir);
+}
+
+// init_include_paths adds the default directories to find the headers in, after the ones given by -I:
+// the headers of this compiler in the "include" directory next to the executable, and then the system headers.
+// argv0: path of the executable
+void init_include_paths(char *argv0) {
+    add_include_path(format("%s/include", dirname(format("%s", argv0))));
+    add_include_path("/usr/include");
+}
+
+// init_preprocessor makes the empty tables of the macros and the files, unless made by a precompiled header.
+void init_preprocessor() {
+    if (macros) return;
+    macros = new_map_in(&permanent_arena);
+    source_files = new_map_in(&permanent_arena);
+}
+
+// preprocess returns the given input of the main file with the directives processed and the macros expanded.
+// Returns the input as is if it has no directives, and no macros are defined by a precompiled header.
+char *preprocess(char *input) {
+    if (!strchr(input, '#') && (!macros || map_count(macros) == 0)) {
+        return input;
+    }
+
+    init_preprocessor();
+    contexts = new_vector_in(&permanent_arena);
+    conditionals = new_vector_in(&permanent_arena);
+    line_marks = new_vector_in(&permanent_arena);
+
+    SourceFile *main_file = arena_alloc(&permanent_arena, sizeof(SourceFile));
+    main_file->name = file_name;
+    main_file->contents = input;
+    PPLexer *lexer = arena_alloc(&permanent_arena, sizeof(PPLexer));
+    init_lexer(lexer, main_file, &pp_arena);
+    Context *main_context = push_context(CTX_FILE, NULL);
+    main_context->lexer = lexer;
+
+    // about as large as the input
+    pp_output_capacity = strlen(input) + 1;
+    pp_output = malloc(pp_output_capacity);
+    if (!pp_output) {
+        error("out of memory");
+    }
+    new_line_mark(main_file, 1);
+
+    for (;;) {
+        Context *top = (Context*) vector_get_last(contexts);
+        if (top->kind == CTX_FILE && !main_context->lookahead && pp_arena.reserved >= PP_ARENA_RESET_SIZE) {
+            // nothing lexed from the main file nor made by the expansions is referred to any more
+            arena_reset(&pp_arena);
+        }
+        PPToken *tok = expand_next();
+        if (tok->kind == PP_EOF) {
+            if (end_file()) break;
+            continue;
+        }
+        if (tok->bol && equal(tok, "#")) {
+            directive(tok);
+            continue;
+        }
+        write_token(tok);
+    }
+    write_output("\n", 0, 1);
+    pp_output[pp_output_len] = '\0';
+    arena_reset(&pp_arena);
+    return pp_output;
+}
+
+// find_line_mark returns the last line mark at or before the given 0-origin line of user_input,
+// NULL if user_input has not been preprocessed.
+LineMark *find_line_mark(int line) {
+    if (!line_marks) return NULL;
+    int low = 0;
+    int high = vector_count(line_marks) - 1;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (((LineMark*) vector_get(line_marks, mid))->line <= line) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return (LineMark*) vector_get(line_marks, low);
+}
+
+// write_pch_headers writes out the headers read with the hashes of their contents, to validate a precompiled header.
+void write_pch_headers() {
+    pch_write_long(source_files ? map_count(source_files) : 0);
+    for (int i = 0; source_files && i < source_files->capacity; i++) {
+        MapEntry *entry = &source_files->entries[i];
+        if (!entry->key) continue;
+        SourceFile *file = (SourceFile*) entry->value;
+        pch_write_string(entry->key->name, entry->key->len);
+        pch_write_long(hash_bytes(file->contents, strlen(file->contents)));
+    }
+}
+
+// write_pch_macros writes out the macros defined at the end of a precompiled header.
+void write_pch_macros() {
+    int count = 0;
+    for (int i = 0; macros && i < macros->capacity; i++) {
+        if (macros->entries[i].key && macros->entries[i].value) count++;
+    }
+    pch_write_long(count);
+    for (int i = 0; macros && i < macros->capacity; i++) {
+        Macro *macro = (Macro*) macros->entries[i].value;
+        if (!macros->entries[i].key || !macro) continue;
+        pch_write_string(macro->name->name, macro->name->len);
+        pch_write_long(macro->function_like);
+        pch_write_long(macro->variadic);
+        int num_params = macro->function_like ? vector_count(macro->params) : 0;
+        pch_write_long(num_params);
+        for (int j = 0; j < num_params; j++) {
+            Atom *param = (Atom*) vector_get(macro->params, j);
+            pch_write_string(param->name, param->len);
+        }
+        pch_write_long(vector_count(macro->body));
+        for (int j = 0; j < vector_count(macro->body); j++) {
+            PPToken *tok = (PPToken*) vector_get(macro->body, j);
+            pch_write_long(tok->kind);
+            pch_write_long(tok->space);
+            pch_write_string(tok->str, tok->len);
+        }
+    }
+}
+
+// read_pch_macros defines the macros of a precompiled header. The spellings of the tokens are left in the mapped file.
+// header: path of the precompiled header, for the error messages
+void read_pch_macros(PCHReader *r, char *header) {
+    init_preprocessor();
+    SourceFile *file = arena_alloc(&permanent_arena, sizeof(SourceFile));
+    file->name = header;
+    file->contents = "";
+
+    long count = pch_read_long(r);
+    for (long i = 0; i < count; i++) {
+        Macro *macro = arena_alloc(&permanent_arena, sizeof(Macro));
+        macro->name = pch_read_atom(r);
+        macro->function_like = pch_read_long(r);
+        macro->variadic = pch_read_long(r);
+        long num_params = pch_read_long(r);
+        if (macro->function_like) {
+            macro->params = new_vector_in(&permanent_arena);
+        }
+        for (long j = 0; j < num_params; j++) {
+            vector_add(macro->params, pch_read_atom(r));
+        }
+        macro->body = new_vector_in(&permanent_arena);
+        long num_tokens = pch_read_long(r);
+        for (long j = 0; j < num_tokens; j++) {
+            PPToken *tok = arena_alloc(&permanent_arena, sizeof(PPToken));
+            tok->kind = pch_read_long(r);
+            tok->space = pch_read_long(r);
+            tok->str = pch_read_string(r, &tok->len);
+            tok->file = file;
+            tok->line = 1;
+            vector_add(macro->body, tok);
+        }
+        map_put(macros, macro->name, macro);
+        macro_names[(unsigned char) macro->name->name[0] & 127][macro->name->len & 31] = true;
+    }
+}
+
+// mark_included marks the given file as already included by a precompiled header, so that #include skips it.
+void mark_included(char *path) {
+    init_preprocessor();
+    SourceFile *file = arena_alloc(&permanent_arena, sizeof(SourceFile));
+    file->name = path;
+    file->contents = "";
+    file->once = true;
+    map_put(source_files, intern(path, strlen(path)), file);
+}
+
+// warm_source_file reads and tokenizes the given header for the later compilations, unless cached and unchanged.
+// Called by the compile server, whose compilations inherit the cached headers.
+// path: real path of the header
+void warm_source_file(char *path) {
+    init_preprocessor();
+    SourceFile *file = map_get(source_files, intern(path, strlen(path)));
+    if (file && !source_changed(file, path)) return;
+    read_source_file(path, path);
+}
+
+// write_source_paths writes out the real paths of the headers read by this compilation to the given file, one per line.
+void write_source_paths(FILE *fp) {
+    for (int i = 0; source_files && i < source_files->capacity; i++) {
+        MapEntry *entry = &source_files->entries[i];
+        if (!entry->key || !((SourceFile*) entry->value)->tokens) continue;
+        fprintf(fp, "%s\n", entry->key->name);
+    }
+}
@@ -0,0 +1,276 @@
+#include "main.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+Profile file format (text, one record per line):
+
+    fn <name> <checksum> <number of counters> <counter 0> <counter 1> ...
+
+An instrumented program appends one record per function when it exits,
+so profiles of multiple runs (or multiple files, e.g. "cat a.prof b.prof > merged.prof") are merged
+by summing the counters of the records with the same name and checksum.
+The checksum is computed from the shape of the function's AST, and records with stale checksums are ignored.
+
+Counters of a function:
+    function:          [entry]
+    ND_IF, ND_COND:    [executed, "then" arm taken]
+    ND_WHILE, ND_FOR:  [loop entered, iterations]
+*/
+
+// Profile file to instrument the program for (-fprofile-generate), NULL if disabled
+char *profile_generate;
+// Profile file to optimize the program with (-fprofile-use), NULL if disabled
+char *profile_use;
+
+// Profile of the function currently being optimized and generated on the current thread
+_Thread_local FunctionProfile *current_profile;
+
+// Loaded profile records, elements: FunctionProfile*
+Vector *profiles;
+
+// hash_value mixes the given value into the FNV-1a hash.
+unsigned long hash_value(unsigned long hash, unsigned long value) {
+    for (int i = 0; i < 8; i++) {
+        hash ^= (value >> (i * 8)) & 0xff;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+// assign_counters_rec assigns profile counters to the given subtree in pre-order, and updates the checksum.
+void assign_counters_rec(FunctionProfile *prof, Node *node) {
+    if (node == NULL) return;
+    nodes_visited++;
+    prof->checksum = hash_value(prof->checksum, node->kind);
+
+    switch (node->kind) {
+    case ND_IF:
+    case ND_COND:
+    case ND_WHILE:
+    case ND_FOR:
+        node->counter = prof->num_counters;
+        prof->num_counters += 2;
+        break;
+    }
+
+    int arity = node_arity(node->kind);
+    if (arity > 0) assign_counters_rec(prof, node->left);
+    if (arity > 1) assign_counters_rec(prof, node->right);
+    if (arity > 2) assign_counters_rec(prof, node->third);
+    if (arity > 3) assign_counters_rec(prof, node->fourth);
+    if (has_items(node->kind)) {
+        for (int i = 0; i < node->count; i++) {
+            assign_counters_rec(prof, node->items[i]);
+        }
+    }
+}
+
+// find_profile_record returns the loaded profile record with the given name and checksum, NULL if not found.
+FunctionProfile *find_profile_record(char *name, int len, unsigned long checksum) {
+    for (int i = 0; i < vector_count(profiles); i++) {
+        FunctionProfile *record = (FunctionProfile*) vector_get(profiles, i);
+        if (record->len == len && memcmp(record->name, name, len) == 0 && record->checksum == checksum) {
+            return record;
+        }
+    }
+    return NULL;
+}
+
+// profile_function assigns the profile counters of the given function,
+// and looks up its counter values if a profile has been loaded.
+FunctionProfile *profile_function(Function *fn) {
+    // kept until the profile runtime is generated
+    FunctionProfile *prof = arena_alloc(&permanent_arena, sizeof(FunctionProfile));
+    prof->name = fn->name;
+    prof->len = fn->len;
+    // FNV offset basis
+    prof->checksum = 14695981039346656037UL;
+    // counter 0: function entry
+    prof->num_counters = 1;
+    assign_counters_rec(prof, fn->body);
+    prof->checksum = hash_value(prof->checksum, prof->num_counters);
+
+    if (profiles) {
+        FunctionProfile *record = find_profile_record(fn->name, fn->len, prof->checksum);
+        if (record && record->num_counters == prof->num_counters) {
+            prof->counters = record->counters;
+        }
+    }
+    return prof;
+}
+
+// profile_count returns the value of the given counter of the current function, or -1 if unknown.
+long profile_count(int counter) {
+    if (current_profile == NULL || current_profile->counters == NULL) {
+        return -1;
+    }
+    return current_profile->counters[counter];
+}
+
+// branch_probability returns the percentage of the "then" arm taken of the given ND_IF or ND_COND node,
+// or -1 if unknown (no profile, or never executed).
+int branch_probability(Node *node) {
+    long executed = profile_count(node->counter);
+    long taken = profile_count(node->counter + 1);
+    if (executed <= 0 || taken < 0) {
+        return -1;
+    }
+    return (int) (taken * 100 / executed);
+}
+
+// read_profile loads (and merges) the profile records from the given file.
+void read_profile(char *path) {
+    profiles = new_vector();
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        error("cannot open profile %s: %s", path, strerror(errno));
+    }
+
+    char name[256];
+    unsigned long checksum;
+    int num_counters;
+    while (fscanf(fp, " fn %255s %lu %d", name, &checksum, &num_counters) == 3) {
+        if (num_counters <= 0) {
+            error("%s: broken profile record of %s", path, name);
+        }
+        int len = strlen(name);
+        FunctionProfile *record = find_profile_record(name, len, checksum);
+        if (record && record->num_counters != num_counters) {
+            error("%s: inconsistent profile records of %s", path, name);
+        }
+        if (!record) {
+            record = allocate(sizeof(FunctionProfile));
+            record->name = allocate(len + 1);
+            memcpy(record->name, name, len);
+            record->len = len;
+            record->checksum = checksum;
+            record->num_counters = num_counters;
+            record->counters = allocate(num_counters * sizeof(long));
+            vector_add(profiles, record);
+        }
+        // merge by summing up the counters
+        for (int i = 0; i < num_counters; i++) {
+            long count;
+            if (fscanf(fp, "%ld", &count) != 1) {
+                error("%s: broken profile record of %s", path, name);
+            }
+            record->counters[i] += count;
+        }
+    }
+    if (!feof(fp)) {
+        error("%s: broken profile", path);
+    }
+    fclose(fp);
+}
+
+// gen_profile_counter prints out the assembly to increment the given counter of the current function.
+void gen_profile_counter(int counter) {
+    if (!profile_generate) return;
+    emit("        add QWORD PTR .Lprof.%.*s[rip+%d], 1\n", current_profile->len, current_profile->name, counter * 8);
+}
+
+// gen_profile_runtime generates the counters of the instrumented functions,
+// and the function appending them to the profile file at exit.
+// instrumented: elements: FunctionProfile*
+void gen_profile_runtime(Vector *instrumented) {
+    emit(".data\n");
+    emit(".Lprof.path:\n");
+    emit("        .string \"%s\"\n", profile_generate);
+    emit(".Lprof.mode:\n");
+    emit("        .string \"a\"\n");
+    emit(".Lprof.function_format:\n");
+    emit("        .string \"fn %%s %%lu %%ld\"\n");
+    emit(".Lprof.counter_format:\n");
+    emit("        .string \" %%lu\"\n");
+    for (int i = 0; i < vector_count(instrumented); i++) {
+        FunctionProfile *prof = (FunctionProfile*) vector_get(instrumented, i);
+        emit(".Lprof.name.%.*s:\n", prof->len, prof->name);
+        emit("        .string \"%.*s\"\n", prof->len, prof->name);
+        emit("        .p2align 3\n");
+        emit(".Lprof.%.*s:\n", prof->len, prof->name);
+        emit("        .zero %d\n", prof->num_counters * 8);
+    }
+    // table of {name, checksum, number of counters, counters}, terminated by a null name
+    emit("        .p2align 3\n");
+    emit(".Lprof.table:\n");
+    for (int i = 0; i < vector_count(instrumented); i++) {
+        FunctionProfile *prof = (FunctionProfile*) vector_get(instrumented, i);
+        emit("        .quad .Lprof.name.%.*s\n", prof->len, prof->name);
+        emit("        .quad %lu\n", prof->checksum);
+        emit("        .quad %d\n", prof->num_counters);
+        emit("        .quad .Lprof.%.*s\n", prof->len, prof->name);
+    }
+    emit("        .quad 0\n");
+
+    emit(".text\n");
+    // dump function: rbx = table cursor, r12 = FILE*, r13 = counter index, r14 = counters
+    emit(".Lprof.dump:\n");
+    emit("        push rbp\n");
+    emit("        mov rbp, rsp\n");
+    emit("        push rbx\n");
+    emit("        push r12\n");
+    emit("        push r13\n");
+    emit("        push r14\n");
+    emit("        lea rdi, .Lprof.path[rip]\n");
+    emit("        lea rsi, .Lprof.mode[rip]\n");
+    emit("        call fopen\n");
+    emit("        cmp rax, 0\n");
+    emit("        je .Lprof.done\n");
+    emit("        mov r12, rax\n");
+    emit("        lea rbx, .Lprof.table[rip]\n");
+    emit(".Lprof.next_function:\n");
+    emit("        cmp QWORD PTR [rbx], 0\n");
+    emit("        je .Lprof.close\n");
+    emit("        mov rdi, r12\n");
+    emit("        lea rsi, .Lprof.function_format[rip]\n");
+    emit("        mov rdx, [rbx]\n");
+    emit("        mov rcx, [rbx+8]\n");
+    emit("        mov r8, [rbx+16]\n");
+    emit("        mov eax, 0\n");
+    emit("        call fprintf\n");
+    emit("        mov r14, [rbx+24]\n");
+    emit("        mov r13, 0\n");
+    emit(".Lprof.next_counter:\n");
+    emit("        cmp r13, [rbx+16]\n");
+    emit("        jge .Lprof.end_function\n");
+    emit("        mov rdi, r12\n");
+    emit("        lea rsi, .Lprof.counter_format[rip]\n");
+    emit("        mov rdx, [r14+r13*8]\n");
+    emit("        mov eax, 0\n");
+    emit("        call fprintf\n");
+    emit("        add r13, 1\n");
+    emit("        jmp .Lprof.next_counter\n");
+    emit(".Lprof.end_function:\n");
+    emit("        mov rdi, 10\n");
+    emit("        mov rsi, r12\n");
+    emit("        call fputc\n");
+    emit("        add rbx, 32\n");
+    emit("        jmp .Lprof.next_function\n");
+    emit(".Lprof.close:\n");
+    emit("        mov rdi, r12\n");
+    emit("        call fclose\n");
+    emit(".Lprof.done:\n");
+    emit("        pop r14\n");
+    emit("        pop r13\n");
+    emit("        pop r12\n");
+    emit("        pop rbx\n");
+    emit("        pop rbp\n");
+    emit("        ret\n");
+
+    // register the dump function at startup
+    emit(".Lprof.init:\n");
+    emit("        push rbp\n");
+    emit("        mov rbp, rsp\n");
+    emit("        lea rdi, .Lprof.dump[rip]\n");
+    emit("        call atexit\n");
+    emit("        pop rbp\n");
+    emit("        ret\n");
+    emit("        .section .init_array,\"aw\"\n");
+    emit("        .p2align 3\n");
+    emit("        .quad .Lprof.init\n");
+    emit(".text\n");
+}
@@ -0,0 +1,88 @@
+#include "main.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// is_statement returns true if the given node kind is a statement, which has no type.
+bool is_statement(NodeKind kind) {
+    switch (kind) {
+    case ND_RETURN:
+    case ND_IF:
+    case ND_WHILE:
+    case ND_FOR:
+    case ND_BREAK:
+    case ND_CONTINUE:
+    case ND_BLOCK:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// check_expr computes the type of the given expression, whose children are already annotated.
+// Reports the type error and recovers with int, so that the rest of the function is checked.
+Type *check_expr(Node *node) {
+    switch (node->kind) {
+    case ND_DEREF: ;
+        Type *ty = node->left->type;
+        // implicit conversion of array to pointer
+        if (ty->ty != PTR && ty->ty != ARRAY) {
+            report_error_at(node->loc, "Dereference not to a pointer or an array");
+            return &int_type;
+        }
+        return ty->ptr_to;
+    case ND_FUNC_CALL: ;
+        Function *callee = (Function*) map_get(function_map, node->atom);
+        // implicitly declared function (e.g. from the C library) returns int
+        if (!callee) return &int_type;
+        int params = vector_count(callee->type->params);
+        int args = node->count;
+        if (args < params || (args > params && !callee->type->variadic)) {
+            report_error_at(node->loc, "%s arguments to function %.*s (expected %d, have %d)",
+                    args < params ? "too few" : "too many", callee->len, callee->name, params, args);
+        }
+        return callee->type->ptr_to;
+    default:
+        return type_of(node);
+    }
+}
+
+// annotate stores the type of every expression in the given subtree to the nodes, bottom-up.
+void annotate(Node *node) {
+    if (node == NULL) return;
+    nodes_visited++;
+
+    int arity = node_arity(node->kind);
+    if (arity > 0) annotate(node->left);
+    if (arity > 1) annotate(node->right);
+    if (arity > 2) annotate(node->third);
+    if (arity > 3) annotate(node->fourth);
+    if (has_items(node->kind)) {
+        for (int i = 0; i < node->count; i++) {
+            annotate(node->items[i]);
+        }
+    }
+
+    if (!is_statement(node->kind) && node->type == NULL) {
+        node->type = check_expr(node);
+    }
+}
+
+// sema_function annotates the types of the given function, the index-th in the order of the definition.
+void sema_function(int index, Function *fn) {
+    set_timed_function(index, fn->name, fn->len);
+    phase_begin(PHASE_SEMA);
+    long visited = nodes_visited;
+    annotate(fn->body);
+    function_time(PHASE_SEMA, phase_end(PHASE_SEMA, nodes_visited - visited));
+}
+
+// sema annotates the types of all the functions, so that the passes and codegen only read node->type.
+// Exits after reporting all the type errors, if any.
+void sema() {
+    for (int i = 0; i < vector_count(functions); i++) {
+        sema_function(i, (Function*) vector_get(functions, i));
+    }
+    exit_on_errors();
+}
@@ -0,0 +1,340 @@
+#include "main.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+Compile server (-fserver=socket) and its client (-fclient=socket).
+
+The client sends a request over the Unix domain socket, and receives the exit status of the compilation:
+
+    request:  size of the payload (long), with stdin, stdout and stderr of the client attached (SCM_RIGHTS)
+    payload:  working directory, then the arguments from argv[0], each terminated by '\0'
+    response: exit status (int)
+
+The server forks a compilation per request, which runs as the client would, on the file descriptors of the client.
+The compilations inherit the warm state of the server: the interned names, the tokens of the headers read
+by the former compilations, and the hash of the compiler for the code cache. Each compilation reports the headers
+it has read through a pipe, and the server reads and tokenizes them again if changed on the disk since.
+A compilation compares the cached headers with the disk before using them, so a stale header is never used.
+*/
+
+// Maximum number of the compilations running at the same time, the later requests wait in the listen queue
+#define MAX_REQUESTS 64
+
+// Compilation running for a client
+typedef struct Request {
+    pid_t pid;
+    // connection to the client, to send the exit status to
+    int conn;
+    // read end of the pipe the compilation reports the headers to
+    int report;
+    // report read so far
+    char *paths;
+    size_t len;
+    size_t capacity;
+} Request;
+
+// Requests being compiled
+Request requests[MAX_REQUESTS];
+int num_requests;
+
+// Listening socket of the server
+int server_socket = -1;
+
+// Write end of the report pipe in the compilation, -1 if not a compilation of the server
+int report_fd = -1;
+
+// connect_server connects to the compile server at the given socket.
+// Returns the connected socket, or -1 if no server is running.
+int connect_server(char *socket_path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        error("socket path too long: %s", socket_path);
+    }
+    strcpy(addr.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        error("cannot create a socket: %s", strerror(errno));
+    }
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// write_all writes out all the given bytes to the file descriptor.
+// Returns false on failure.
+bool write_all(int fd, char *buf, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, buf, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buf += n;
+        size -= n;
+    }
+    return true;
+}
+
+// read_all reads exactly the given number of bytes from the file descriptor.
+// Returns false on failure or at the end of the file.
+bool read_all(int fd, char *buf, size_t size) {
+    while (size > 0) {
+        ssize_t n = read(fd, buf, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buf += n;
+        size -= n;
+    }
+    return true;
+}
+
+// request_server asks the compile server at the given socket to compile with the given arguments,
+// with the standard input and outputs of this process.
+// Returns the exit status of the compilation, or -1 if no server is running.
+int request_server(char *socket_path, int argc, char **argv) {
+    int fd = connect_server(socket_path);
+    if (fd < 0) return -1;
+
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        error("cannot get the working directory: %s", strerror(errno));
+    }
+    long size = strlen(cwd) + 1;
+    for (int i = 0; i < argc; i++) {
+        size += strlen(argv[i]) + 1;
+    }
+    char *payload = arena_alloc(&permanent_arena, size);
+    char *p = stpcpy(payload, cwd) + 1;
+    for (int i = 0; i < argc; i++) {
+        p = stpcpy(p, argv[i]) + 1;
+    }
+
+    // the size, with the standard file descriptors attached
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))] = {0};
+    struct iovec iov = {.iov_base = &size, .iov_len = sizeof(size)};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(fd, &msg, 0) != sizeof(size) || !write_all(fd, payload, size)) {
+        error("cannot send the request to the compile server: %s", strerror(errno));
+    }
+
+    int status;
+    if (!read_all(fd, (char*) &status, sizeof(status))) {
+        error("the compile server closed the connection");
+    }
+    close(fd);
+    return status;
+}
+
+// report_sources reports the headers read by the compilation to the server, at exit.
+void report_sources() {
+    if (report_fd < 0) return;
+    FILE *fp = fdopen(report_fd, "w");
+    if (!fp) return;
+    write_source_paths(fp);
+    fclose(fp);
+    report_fd = -1;
+}
+
+// serve_request runs the compilation of the request from the given connection, in the forked process.
+// Never returns.
+void serve_request(int conn) {
+    long size;
+    int fds[3];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {.iov_base = &size, .iov_len = sizeof(size)};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg;
+    if (recvmsg(conn, &msg, 0) != sizeof(size) || !(cmsg = CMSG_FIRSTHDR(&msg))
+        || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)) || size <= 0) {
+        _exit(1);
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    char *payload = arena_alloc(&permanent_arena, size);
+    if (!read_all(conn, payload, size) || payload[size - 1] != '\0') {
+        _exit(1);
+    }
+    close(conn);
+
+    // run as the client
+    for (int i = 0; i < 3; i++) {
+        if (dup2(fds[i], i) < 0) {
+            _exit(1);
+        }
+        close(fds[i]);
+    }
+    char *cwd = payload;
+    if (chdir(cwd) != 0) {
+        fprintf(stderr, "cannot change the directory to %s: %s\n", cwd, strerror(errno));
+        exit(1);
+    }
+    Vector *args = new_vector();
+    for (char *p = cwd + strlen(cwd) + 1; p < payload + size; p += strlen(p) + 1) {
+        vector_add(args, p);
+    }
+    vector_add(args, NULL);
+    headers_read = 0;
+    headers_skipped = 0;
+    atexit(report_sources);
+    exit(compile_command(vector_count(args) - 1, (char**) args->data));
+}
+
+// start_request forks the compilation of the request from the given connection.
+void start_request(int conn) {
+    int report[2];
+    if (pipe(report) != 0) {
+        fprintf(stderr, "cannot create a pipe: %s\n", strerror(errno));
+        close(conn);
+        return;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "cannot fork: %s\n", strerror(errno));
+        close(conn);
+        close(report[0]);
+        close(report[1]);
+        return;
+    }
+    if (pid == 0) {
+        // only the connection and the report pipe of this request are kept
+        close(server_socket);
+        for (int i = 0; i < num_requests; i++) {
+            close(requests[i].conn);
+            close(requests[i].report);
+        }
+        close(report[0]);
+        report_fd = report[1];
+        serve_request(conn);
+    }
+    close(report[1]);
+    Request *req = &requests[num_requests++];
+    *req = (Request) {.pid = pid, .conn = conn, .report = report[0]};
+}
+
+// finish_request sends the exit status of the finished compilation to its client,
+// and warms the headers it has read for the later compilations.
+void finish_request(Request *req) {
+    close(req->report);
+    int status;
+    while (waitpid(req->pid, &status, 0) < 0 && errno == EINTR);
+    int exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    // the client may have gone
+    write_all(req->conn, (char*) &exit_status, sizeof(exit_status));
+    close(req->conn);
+
+    for (char *path = req->paths; path && path < req->paths + req->len;) {
+        char *newline = memchr(path, '\n', req->paths + req->len - path);
+        if (!newline) break;
+        *newline = '\0';
+        // a header removed since is dropped by the next compilation including it
+        if (access(path, R_OK) == 0) {
+            warm_source_file(path);
+        }
+        path = newline + 1;
+    }
+    free(req->paths);
+    *req = requests[--num_requests];
+}
+
+// read_report reads the headers reported by the compilation of the given request.
+// Returns false at the end, when the compilation has exited.
+bool read_report(Request *req) {
+    if (req->capacity - req->len < 4096) {
+        req->capacity = req->capacity * 2 + 4096;
+        req->paths = realloc(req->paths, req->capacity);
+        if (!req->paths) {
+            error("out of memory");
+        }
+    }
+    ssize_t n = read(req->report, req->paths + req->len, req->capacity - req->len);
+    if (n < 0 && errno == EINTR) return true;
+    if (n <= 0) return false;
+    req->len += n;
+    return true;
+}
+
+// serve runs the compile server at the given socket. Never returns.
+void serve(char *socket_path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        error("socket path too long: %s", socket_path);
+    }
+    strcpy(addr.sun_path, socket_path);
+    int listener = server_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        error("cannot create a socket: %s", strerror(errno));
+    }
+    // the socket of a former server
+    int running = connect_server(socket_path);
+    if (running >= 0) {
+        error("a compile server is already running at %s", socket_path);
+    }
+    unlink(socket_path);
+    if (bind(listener, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(listener, SOMAXCONN) != 0) {
+        error("cannot listen at %s: %s", socket_path, strerror(errno));
+    }
+    // a client gone before its status is sent
+    signal(SIGPIPE, SIG_IGN);
+
+    // state inherited by all the compilations
+    revalidate_sources = true;
+    init_preprocessor();
+    hash_compiler();
+
+    struct pollfd fds[MAX_REQUESTS + 1];
+    for (;;) {
+        int num_fds = 0;
+        for (int i = 0; i < num_requests; i++) {
+            fds[num_fds++] = (struct pollfd) {.fd = requests[i].report, .events = POLLIN};
+        }
+        // no more requests taken while busy
+        if (num_requests < MAX_REQUESTS) {
+            fds[num_fds++] = (struct pollfd) {.fd = listener, .events = POLLIN};
+        }
+        if (poll(fds, num_fds, -1) < 0) {
+            if (errno == EINTR) continue;
+            error("poll: %s", strerror(errno));
+        }
+
+        // from the last, as finish_request moves the last request to the finished one's place
+        for (int i = num_requests - 1; i >= 0; i--) {
+            if (fds[i].revents && !read_report(&requests[i])) {
+                finish_request(&requests[i]);
+            }
+        }
+        if (num_fds > 0 && fds[num_fds - 1].fd == listener && fds[num_fds - 1].revents) {
+            int conn = accept(listener, NULL, NULL);
+            if (conn >= 0) {
+                start_request(conn);
+            }
+        }
+    }
+}
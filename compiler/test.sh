@@ -6,4 +6,186 @@ set -eux
 cc -o tmp tmp.s
 ./tmp
 
+# Reading from stdin gives the same output
+./main - < ./test/main.c | cmp - tmp.s
+
+# Generating the functions on multiple threads gives the same output
+./main -fthreads=4 ./test/main.c | cmp - tmp.s
+
+# Streaming mode generates each function as soon as it is parsed
+./main -fstreaming ./test/main.c > tmp.s
+cc -o tmp tmp.s
+./tmp
+
+# A call whose arguments are longer than the token ring
+mkdir -p tmp.d
+awk 'BEGIN { printf "int f(int x) { return x; }\nint main() { return f(0"; for (i = 0; i < 2100; i++) printf " + 1"; print ") - 2100; }" }' > tmp.d/call.c
+./main tmp.d/call.c > tmp.s
+rm -r tmp.d
+cc -o tmp tmp.s
+./tmp
+
+# Profile-guided optimization round trip
+rm -f tmp.prof
+./main -fprofile-generate=tmp.prof ./test/main.c > tmp.s
+cc -o tmp tmp.s
+./tmp
+./main -fprofile-use=tmp.prof ./test/main.c > tmp.s
+cc -o tmp tmp.s
+./tmp
+# a cold "then" arm is moved out of line, and the "else" arm falls through without jumping over it
+./main ./test/cold.c > tmp.s
+cc -o tmp tmp.s
+./tmp
+grep -q "jne .Lcold" tmp.s
+awk '/jne \.Lcold/ { n = $2; sub(/\.Lcold/, "", n); cold[n] = 1 }
+    /^\.Lend[0-9]+:/ { n = $1; sub(/\.Lend/, "", n); sub(/:/, "", n); ended[n] = 1 }
+    /jmp \.Lend/ { n = $2; sub(/\.Lend/, "", n); if (cold[n] && !ended[n]) bad = 1 }
+    END { exit bad }' tmp.s
+# only the cold block never executed is split out into .text.unlikely, the rarely executed one stays in .text
+rm -f tmp.prof
+./main -fprofile-generate=tmp.prof ./test/cold.c > tmp.s
+cc -o tmp tmp.s
+./tmp
+./main -fprofile-use=tmp.prof ./test/cold.c > tmp.s
+cc -o tmp tmp.s
+./tmp
+test "$(awk '/^ *\.section \.text\.unlikely/ { section = "unlikely" } /^ *\.text$/ { section = "text" }
+    /^\.Lcold/ { print section }' tmp.s | sort | tr '\n' ' ')" = "text unlikely unlikely "
+
+# Time report, after the same assembly
+./main ./test/main.c > tmp.s
+./main -ftime-report ./test/main.c 2> tmp.err | cmp - tmp.s
+grep -q "Slowest functions" tmp.err
+
+# Code cache: the functions unchanged since the last compilation are reused, giving the same output
+rm -rf tmp.cache
+./main ./test/main.c > tmp.s
+./main -fcode-cache=tmp.cache ./test/main.c | cmp - tmp.s
+./main -fcode-cache=tmp.cache -ftime-report ./test/main.c 2> tmp.err | cmp - tmp.s
+grep -q "code cache: [1-9][0-9]* hit(s), 0 miss(es)" tmp.err
+./main -fthreads=4 -fcode-cache=tmp.cache ./test/main.c | cmp - tmp.s
+# a changed function is generated again, and the rest are reused with their labels renumbered
+mkdir -p tmp.d
+sed 's/    if (got == want) {/    if (got == want \&\& want == want) {/' ./test/main.c > tmp.d/main.c
+./main tmp.d/main.c > tmp.d/main.s
+./main -fcode-cache=tmp.cache -ftime-report tmp.d/main.c 2> tmp.err | cmp - tmp.d/main.s
+grep -q "code cache: [1-9][0-9]* hit(s), 1 miss(es)" tmp.err
+rm -r tmp.d
+# the least recently used functions are evicted beyond the size limit, also in the streaming mode
+rm -r tmp.cache
+./main -fcode-cache=tmp.cache -fcode-cache-size=1 -ftime-report -fstreaming ./test/main.c 2> tmp.err > /dev/null
+grep -q "code cache: .* [1-9][0-9]* evicted" tmp.err
+test "$(cat tmp.cache/*.s 2> /dev/null | wc -c)" -le 1024
+rm -r tmp.cache
+
+# Preprocessor: #include, macros, and conditionals
+./main ./test/preprocess.c > tmp.s
+cc -o tmp tmp.s
+./tmp
+# a benchmark program including the headers in include/
+./main ./test/sudoku_solver.c > tmp.s
+cc -o tmp tmp.s
+./tmp > /dev/null
+# errors are reported at the lines of the original file
+if ./main ./test/preprocess_errors.c > tmp.s 2> tmp.err; then
+    exit 1
+fi
+grep -q "^./test/preprocess_errors.c:6:" tmp.err
+
+# Precompiled header: the declarations and the macros of a header are loaded instead of parsed
+./main -emit-pch -o tmp.pch ./test/pch.h
+./main -include-pch tmp.pch ./test/pch.c > tmp.s
+cc -o tmp tmp.s
+./tmp
+# and give the same output as including the header
+./main ./test/pch.c | cmp - tmp.s
+# a precompiled header of a changed header is rejected
+mkdir -p tmp.d
+cp ./test/pch.h tmp.d/pch.h
+./main -emit-pch -o tmp.pch tmp.d/pch.h
+echo "int changed;" >> tmp.d/pch.h
+if ./main -I tmp.d -include-pch tmp.pch ./test/pch.c > tmp.s 2> tmp.err; then
+    exit 1
+fi
+grep -q "precompiled header is stale" tmp.err
+# a header with thousands of types
+awk 'BEGIN { print "#ifndef MANY_H\n#define MANY_H"; for (i = 0; i < 3000; i++) print "struct S" i " { int a; };\nint *f" i "(struct S" i " *p);"; print "#endif" }' > tmp.d/many.h
+echo '#include "many.h"
+int main() { struct S2999 s; s.a = 0; return s.a; }' > tmp.d/many.c
+./main -emit-pch -o tmp.pch tmp.d/many.h
+./main -include-pch tmp.pch tmp.d/many.c > tmp.s
+./main tmp.d/many.c | cmp - tmp.s
+rm -r tmp.d
+
+# Multiple files are compiled in parallel and linked together
+./main -j 2 -o tmp ./test/multi_main.c ./test/multi_sub.c
+./tmp
+# and a file with errors fails the build, without stopping the other files
+if ./main -j 2 -o tmp ./test/multi_main.c ./test/errors.c ./test/multi_sub.c 2> tmp.err; then
+    exit 1
+fi
+grep -q "^./test/errors.c:3:13: " tmp.err
+grep -q "^1 of 3 file(s) failed to compile.$" tmp.err
+
+# Compile server: the clients are compiled by the server with the headers kept warm, giving the same output
+rm -f tmp.sock
+./main -fserver=tmp.sock &
+server=$!
+trap 'kill $server' EXIT
+while [ ! -S tmp.sock ]; do sleep 0.1; done
+./main ./test/preprocess.c > tmp.s
+./main -fclient=tmp.sock ./test/preprocess.c | cmp - tmp.s
+./main -fclient=tmp.sock -ftime-report ./test/preprocess.c 2> tmp.err | cmp - tmp.s
+if grep -q "headers: " tmp.err; then
+    exit 1
+fi
+# concurrent clients, and the driver run by the server
+for i in 1 2 3 4; do
+    ./main -fclient=tmp.sock ./test/preprocess.c > tmp.$i.s &
+done
+wait $(jobs -p | grep -v "^$server$")
+for i in 1 2 3 4; do
+    cmp tmp.$i.s tmp.s
+done
+rm tmp.[1-4].s
+./main -fclient=tmp.sock -j 2 -o tmp ./test/multi_main.c ./test/multi_sub.c
+./tmp
+# a header changed since it was cached is read again
+mkdir -p tmp.d
+echo "#define VALUE 1" > tmp.d/value.h
+printf '#include "value.h"\nint main() { return VALUE - 2; }\n' > tmp.d/value.c
+./main -fclient=tmp.sock tmp.d/value.c > tmp.s
+echo "#define VALUE (1 + 1)" > tmp.d/value.h
+./main -fclient=tmp.sock tmp.d/value.c > tmp.s
+cc -o tmp tmp.s
+./tmp
+rm -r tmp.d
+# the exit status and the errors are those of the compilation
+if ./main -fclient=tmp.sock ./test/errors.c > tmp.s 2> tmp.err; then
+    exit 1
+fi
+grep -q "^4 error(s) generated.$" tmp.err
+kill $server
+trap - EXIT
+rm tmp.sock
+# without the server, the client compiles by itself
+./main -fclient=tmp.sock ./test/main.c > tmp.s
+cc -o tmp tmp.s
+./tmp
+
+# Error recovery: all the errors are reported with their line and column
+if ./main ./test/errors.c > tmp.s 2> tmp.err; then
+    exit 1
+fi
+grep -q "^./test/errors.c:3:13: " tmp.err
+grep -q "^./test/errors.c:5:9: " tmp.err
+grep -q "^./test/errors.c:10:8: " tmp.err
+grep -q "^./test/errors.c:13:19: " tmp.err
+grep -q "^4 error(s) generated.$" tmp.err
+if ./main -fstreaming ./test/errors.c > tmp.s 2> tmp.err; then
+    exit 1
+fi
+grep -q "^4 error(s) generated.$" tmp.err
+
 echo "OK"
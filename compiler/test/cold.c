@@ -0,0 +1,31 @@
+// check has a branch never taken, and a rarely taken one
+int check(int x) {
+    if (x == 12345) {
+        return 1;
+    }
+    if (x / 50 * 50 == x) {
+        return 2;
+    }
+    return 0;
+}
+
+// classify has the "then" arm guessed cold, with an "else" arm
+int classify(int x) {
+    int r;
+    if (x < 0) {
+        return 0;
+    } else {
+        r = x + 1;
+    }
+    return r;
+}
+
+int main() {
+    int sum;
+    int i;
+    sum = 0;
+    for (i = 0; i < 1000; i = i + 1) {
+        sum = sum + check(i) + classify(i) - i - 1;
+    }
+    return sum - 40;
+}
@@ -0,0 +1,14 @@
+// Each of the errors below is reported in one run
+int f(int a) {
+    int x = ;
+    if (a) {
+        y = 3;
+    }
+    return a;
+}
+
+int g( { return 1; }
+
+int main() {
+    return f(1) + ;
+}
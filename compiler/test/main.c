@@ -1,3 +1,5 @@
+int printf(char *format, ...);
+
 // assert prints out reason and exits with code 1 if the given assertion is false (= 0).
 int assert(int assertion, char *reason) {
     if (assertion != 0) {
@@ -468,6 +470,162 @@ long test_46() {
     return a * b;
 }
 
+int max_47(int a, int b) {
+    if (a > b) {
+        return a;
+    } else {
+        return b;
+    }
+}
+
+int side_effect_47;
+
+int bump_47() {
+    side_effect_47 = side_effect_47 + 1;
+    return side_effect_47;
+}
+
+// assert test_47 returns 42
+int test_47() {
+    int a = 3;
+    int b = 7;
+    int c = a < b ? 40 : 50;
+    int d = a > b ? 1 : a == 3 ? 2 : 3;
+    return c + d;
+}
+
+// assert test_48 returns 9
+int test_48() {
+    int m = 10;
+    int x = 4;
+    int y = 5;
+    if (x < m) m = x;
+    if (y < m) m = y;
+    int n;
+    if (x > y) n = x; else n = y;
+    return m + n;
+}
+
+// assert test_49 returns 1
+int test_49() {
+    // only one of the arms must be evaluated
+    side_effect_47 = 0;
+    int r = 1 < 2 ? bump_47() : bump_47() + 10;
+    return r == 1 && side_effect_47 == 1;
+}
+
+// assert test_50 returns 1
+int test_50() {
+    int *p = 0;
+    int v = 5;
+    // must not dereference the null pointer
+    int r = p ? *p : v - 4;
+    return r;
+}
+
+// assert test_51 returns 12
+int test_51() {
+    int a = 5;
+    int b = 0;
+    int c = a > b ? 1 : 0;
+    int d = a < b ? 1 : 0;
+    int e = a < b ? 0 : 1;
+    return max_47(a, 12) + max_47(-3, -4) + c + d + e + 1;
+}
+
+int gv_52 = 1 < 2 ? 10 : 20;
+
+// assert test_52 returns 10
+int test_52() {
+    return gv_52;
+}
+
+// assert test_53 returns 23
+int test_53() {
+    int i = 0;
+    int sum = 0;
+    while (i < 10 && sum < 100) {
+        i = i + 1;
+        if (i == 5) continue;
+        sum = sum + i;
+        if (sum > 20) break;
+    }
+    return sum;
+}
+
+// assert test_54 returns 7
+int test_54() {
+    int i = 0;
+    while (1) {
+        i = i + 1;
+        if (i == 7) break;
+    }
+    int j;
+    for (j = 10; j < 5; j = j + 1) {
+        i = i + 100;
+    }
+    return i;
+}
+
+int sign_55(int x) {
+    if (x == 0) {
+        return 0;
+    } else {
+        x = x * 2;
+    }
+    return x;
+}
+
+// assert test_55 returns 6
+int test_55() {
+    return sign_55(0) + sign_55(3);
+}
+
+// assert test_56 returns 123
+int test_56() {
+    int x = 1;
+    int y = 0;
+    {
+        int x = 2;
+        y = y * 10 + x;
+        {
+            int x[2] = {3, 4};
+            y = y * 10 + x[0];
+        }
+    }
+    return x * 100 + y;
+}
+
+typedef struct {
+    char a;
+    int b;
+    char c;
+    long d;
+} MyStruct5;
+
+// assert test_57 returns 24
+int test_57() {
+    MyStruct5 s;
+    s.a = 1;
+    s.b = 2;
+    s.c = 3;
+    s.d = 4;
+    // members are aligned: a at 0, b at 4, c at 8, d at 16
+    return sizeof(s) + s.a + s.b + s.c + s.d - 10;
+}
+
+int test_58_helper(int a, int b);
+
+// assert test_58 returns 7
+int test_58() {
+    // calls the function declared above but defined below
+    return test_58_helper(3, 4);
+}
+
+int test_58_helper(int a, int b) {
+    return a + b;
+}
+
 int main() {
     assert(1 == 1, "1 == 1 assertion failure");
     assert(0 != 1, "0 != 0 assertion failure");
@@ -577,6 +735,19 @@ int main() {
 
     assertEquals(test_46() == 9000000000000000000L, 1, "return value of test_46 does not equal to 9e18");
 
+    assertEquals(test_47(), 42, "return value of test_47 does not equal to 42");
+    assertEquals(test_48(), 9, "return value of test_48 does not equal to 9");
+    assertEquals(test_49(), 1, "return value of test_49 does not equal to 1");
+    assertEquals(test_50(), 1, "return value of test_50 does not equal to 1");
+    assertEquals(test_51(), 12, "return value of test_51 does not equal to 12");
+    assertEquals(test_52(), 10, "return value of test_52 does not equal to 10");
+    assertEquals(test_53(), 23, "return value of test_53 does not equal to 23");
+    assertEquals(test_54(), 7, "return value of test_54 does not equal to 7");
+    assertEquals(test_55(), 6, "return value of test_55 does not equal to 6");
+    assertEquals(test_56(), 123, "return value of test_56 does not equal to 123");
+    assertEquals(test_57(), 24, "return value of test_57 does not equal to 24");
+    assertEquals(test_58(), 7, "return value of test_58 does not equal to 7");
+
     /*
     This is a block comment
     */
@@ -0,0 +1,22 @@
+int printf(char *format, ...);
+
+// defined in multi_sub.c
+int add(int a, int b);
+int fib(int n);
+
+int assertEquals(int got, int want, char *reason) {
+    if (got == want) {
+        return 0;
+    }
+    printf(reason);
+    printf("\n");
+    printf("want: %d, but got: %d\n", want, got);
+    exit(1);
+}
+
+int main() {
+    assertEquals(add(3, 4), 7, "add(3, 4)");
+    assertEquals(fib(10), 55, "fib(10)");
+    printf("OK\n");
+    return 0;
+}
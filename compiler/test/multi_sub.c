@@ -0,0 +1,12 @@
+// linked with multi_main.c
+
+int add(int a, int b) {
+    return a + b;
+}
+
+int fib(int n) {
+    if (n < 2) {
+        return n;
+    }
+    return fib(n - 1) + fib(n - 2);
+}
@@ -0,0 +1,44 @@
+// compiled with the declarations and the macros of pch.h loaded from its precompiled header
+#include "pch.h"
+
+int assertEquals(int got, int want, char *reason) {
+    if (got == want) {
+        return 0;
+    }
+    printf("%s\nwant: %d, but got: %d\n", reason, want, got);
+    exit(1);
+}
+
+Node *push_node(Node *list, int value) {
+    Node *node = calloc(1, sizeof(Node));
+    node->value = value;
+    node->next = list;
+    return node;
+}
+
+int sum_nodes(Node *list) {
+    int sum = 0;
+    for (; list; list = list->next) {
+        sum = sum + list->value;
+    }
+    return sum;
+}
+
+int main() {
+    Node *list = 0;
+    int i;
+    for (i = 0; i < 3; i = i + 1) {
+        list = push_node(list, pch_numbers[i]);
+        pch_counter = pch_counter + 1;
+    }
+    assertEquals(sum_nodes(list), 15, "struct and typedef from the precompiled header");
+    assertEquals(pch_counter, 3, "global variable from the precompiled header");
+    assertEquals(PCH_MAX(PCH_LIMIT, 8), 16, "macros from the precompiled header");
+    struct Pair pair;
+    pair.second = 9;
+    assertEquals(sizeof(pair), 16, "struct layout from the precompiled header");
+    Table table;
+    assertEquals(sizeof(table), 16, "array typedef from the precompiled header");
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,29 @@
+// precompiled by test.sh with -emit-pch, and loaded by pch.c with -include-pch
+#ifndef PCH_H
+#define PCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PCH_LIMIT 16
+#define PCH_MAX(a, b) ((a) > (b) ? (a) : (b))
+
+typedef struct Node {
+    int value;
+    struct Node *next;
+} Node;
+
+struct Pair {
+    char first;
+    long second;
+};
+
+typedef int Table[4];
+
+int pch_counter;
+int pch_numbers[3] = {3, 5, 7};
+
+Node *push_node(Node *list, int value);
+int sum_nodes(Node *list);
+
+#endif
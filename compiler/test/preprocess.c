@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "preprocess.h"
+#include "preprocess.h"
+#include "preprocess_once.h"
+#include "preprocess_once.h"
+
+int assertEquals(int got, int want, char *reason) {
+    if (got == want) {
+        return 0;
+    }
+    printf(reason);
+    printf("\n");
+    printf("want: %d, but got: %d\n", want, got);
+    exit(1);
+}
+
+#define TEN 10
+#define TWENTY (TEN + TEN)
+#define ADD(a, b) ((a) + (b))
+#define TWICE(f, x) f(f(x))
+#define STRING(x) #x
+#define CONCAT(a, b) a##b
+#define FIRST(x, ...) (x)
+#define SUM(...) sum3(__VA_ARGS__)
+#define RECURSIVE RECURSIVE
+#define MULTI_LINE(a, \
+                   b) (a - b)
+
+int sum3(int a, int b, int c) {
+    return a + b + c;
+}
+
+#if TEN > 5 && defined(TWENTY) && !defined UNDEFINED
+int if_value = 1;
+#elif 1
+int if_value = 2;
+#else
+int if_value = 3;
+#endif
+
+#ifdef UNDEFINED
+#error must be skipped
+#elif TEN * 2 == TWENTY
+int elif_value = 1;
+#endif
+
+#ifndef TEN
+int ifndef_value = 1;
+#else
+int ifndef_value = 2;
+#endif
+
+#define LATER 1
+#undef LATER
+#ifdef LATER
+int undef_value = 1;
+#else
+int undef_value = 2;
+#endif
+
+#if 0
+this is skipped, even 'unterminated literals
+#if 1
+#endif
+#endif
+
+int main() {
+    int RECURSIVE = 4;
+    int xy = 5;
+
+    assertEquals(TEN, 10, "TEN");
+    assertEquals(TWENTY, 20, "TWENTY");
+    assertEquals(ADD(1, 2) * 3, 9, "ADD(1, 2) * 3");
+    assertEquals(ADD(ADD(1, 2), TEN), 13, "nested ADD");
+    assertEquals(TWICE(SQUARE, 3), 81, "TWICE(SQUARE, 3)");
+    assertEquals(STRING(hello)[0], 'h', "STRING(hello)");
+    assertEquals(CONCAT(x, y), 5, "CONCAT(x, y)");
+    assertEquals(FIRST(4, 5, 6), 4, "FIRST(4, 5, 6)");
+    assertEquals(SUM(1, 2, 3), 6, "SUM(1, 2, 3)");
+    assertEquals(RECURSIVE, 4, "RECURSIVE");
+    assertEquals(MULTI_LINE(9,
+                            4), 5, "MULTI_LINE");
+    assertEquals(ADD (2, 3), 5, "ADD (2, 3)");
+    assertEquals(if_value, 1, "#if");
+    assertEquals(elif_value, 1, "#elif");
+    assertEquals(ifndef_value, 2, "#ifndef");
+    assertEquals(undef_value, 2, "#undef");
+    assertEquals(header_function(), 42, "#include");
+    assertEquals(once_value, 7, "#pragma once");
+    assertEquals(included_count, 0, "included_count");
+    printf("OK\n");
+    return 0;
+}
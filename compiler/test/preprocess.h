@@ -0,0 +1,13 @@
+// included twice by preprocess.c, read once thanks to the include guard
+#ifndef PREPROCESS_H
+#define PREPROCESS_H
+
+#define SQUARE(x) ((x) * (x))
+
+int included_count = 0;
+
+int header_function() {
+    return 42;
+}
+
+#endif
@@ -0,0 +1,7 @@
+#include "preprocess.h"
+
+#define VALUE undeclared
+
+int main() {
+    return SQUARE(VALUE);
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+int once_value = 7;
@@ -1,8 +1,7 @@
-//#include <stddef.h>
-//#include <stdlib.h>
-//#include <string.h>
-//#include <stdio.h>
-//#include <time.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
 
 // sudoku board size
 int blockSize = 3;
@@ -11,8 +10,6 @@ typedef int Board[9][9];
 
 int called = 0;
 
-void *NULL = 0;
-
 typedef struct {
     int *possibilities;
     int size;
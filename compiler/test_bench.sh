@@ -1,34 +1,174 @@
 #!/bin/bash
 
+# Runtime benchmark.
+# Compiles each program with this compiler, "cc -O0" and "cc -O2", runs each binary RUNS times after WARMUP runs,
+# and reports the median, p95 and spread of the wall time.
+# The result is compared against the stored baseline as the ratio to "cc -O0" (so that it doesn't depend on the machine),
+# and exits with 1 if this compiler became slower than the threshold.
+
 set -eu
 
-run_single() {
-  NAME="$1"
-  TIME="$(time ( ./tmp ) 2>&1 1>/dev/null )"
-  echo "$NAME time: $TIME"
+usage() {
+  cat <<USAGE
+usage: $0 [-n runs] [-w warmup] [-o result.json] [-b baseline.json] [-t threshold] [-u] [program.c ...]
+  -n runs       measured runs per binary (default: $RUNS)
+  -w warmup     warmup runs per binary, not measured (default: $WARMUP)
+  -o file       write the result in JSON to the file
+  -b file       baseline to compare against (default: $BASELINE)
+  -t threshold  regression threshold in percent (default: $THRESHOLD)
+  -u            update the baseline with this result
+  program.c     programs in test/ to run (default: ${PROGRAMS[*]})
+USAGE
 }
 
-run_test() {
-  FILE="$1"
-  echo "Running test on $FILE ..."
-  echo "----"
+RUNS=5
+WARMUP=1
+OUTPUT=""
+BASELINE="test/bench_baseline.json"
+THRESHOLD=10
+UPDATE_BASELINE=0
+PROGRAMS=(simple_loop.c sudoku_solver.c)
+COMPILERS=(my-compiler cc-O0 cc-O2)
 
-  # gcc
-  cc -o tmp "test/$FILE"
-  run_single gcc
+while getopts "n:w:o:b:t:uh" opt; do
+  case "$opt" in
+    n) RUNS="$OPTARG" ;;
+    w) WARMUP="$OPTARG" ;;
+    o) OUTPUT="$OPTARG" ;;
+    b) BASELINE="$OPTARG" ;;
+    t) THRESHOLD="$OPTARG" ;;
+    u) UPDATE_BASELINE=1 ;;
+    h) usage; exit 0 ;;
+    *) usage; exit 2 ;;
+  esac
+done
+shift $((OPTIND - 1))
+if [ $# -gt 0 ]; then
+  PROGRAMS=("$@")
+fi
 
-  echo "----"
+# build COMPILER FILE: compiles test/FILE into ./tmp
+build() {
+  case "$1" in
+    my-compiler)
+      ./main "test/$2" > tmp.s
+      cc -o tmp tmp.s 2>/dev/null
+      ;;
+    cc-O0)
+      cc -O0 -w -o tmp "test/$2"
+      ;;
+    cc-O2)
+      cc -O2 -w -o tmp "test/$2"
+      ;;
+  esac
+}
 
-  # this compiler
-  ./main "test/$FILE" > tmp.s
-  cc -o tmp tmp.s
-  run_single my-compiler
+# measure: runs ./tmp, and prints the wall time of each measured run in nanoseconds
+measure() {
+  for ((i = 0; i < WARMUP; i++)); do
+    ./tmp > /dev/null
+  done
+  for ((i = 0; i < RUNS; i++)); do
+    START=$(date +%s%N)
+    ./tmp > /dev/null
+    END=$(date +%s%N)
+    echo $((END - START))
+  done
+}
 
-  echo "----"
+# stats: reads nanoseconds from stdin, and prints "median p95 min max stddev" in milliseconds
+stats() {
+  sort -n | awk '
+    { t[NR] = $1 / 1e6; sum += t[NR]; sq += t[NR] * t[NR] }
+    END {
+      median = NR % 2 ? t[(NR + 1) / 2] : (t[NR / 2] + t[NR / 2 + 1]) / 2
+      # nearest-rank percentile
+      rank = int(NR * 0.95); if (rank < NR * 0.95) rank++
+      mean = sum / NR
+      var = sq / NR - mean * mean; if (var < 0) var = 0
+      printf "%.3f %.3f %.3f %.3f %.3f\n", median, t[rank], t[1], t[NR], sqrt(var)
+    }'
+}
+
+# baseline_median PROGRAM COMPILER: prints the median in the baseline, or nothing if not found
+baseline_median() {
+  if [ ! -f "$BASELINE" ]; then
+    return
+  fi
+  grep "\"program\": \"$1\", \"compiler\": \"$2\"" "$BASELINE" | sed -E 's/.*"median_ms": ([0-9.]+).*/\1/' || true
 }
 
-run_test "simple_loop.c"
-# cannot run the same file because the compiler hasn't supported preprocessors yet
-#run_test "sudoku_solver.c"
+RESULTS=()
+declare -A MEDIANS
+
+printf "%-20s %-12s %12s %12s %12s %12s %12s\n" program compiler "median (ms)" "p95 (ms)" "min (ms)" "max (ms)" "stddev (ms)"
+for FILE in "${PROGRAMS[@]}"; do
+  for COMPILER in "${COMPILERS[@]}"; do
+    build "$COMPILER" "$FILE"
+    read -r MEDIAN P95 MIN MAX STDDEV < <(measure | stats)
+    MEDIANS["$FILE/$COMPILER"]="$MEDIAN"
+    printf "%-20s %-12s %12s %12s %12s %12s %12s\n" "$FILE" "$COMPILER" "$MEDIAN" "$P95" "$MIN" "$MAX" "$STDDEV"
+    RESULTS+=("    {\"program\": \"$FILE\", \"compiler\": \"$COMPILER\", \"median_ms\": $MEDIAN, \"p95_ms\": $P95, \"min_ms\": $MIN, \"max_ms\": $MAX, \"stddev_ms\": $STDDEV}")
+  done
+done
+
+# JSON, one result per line
+json() {
+  echo "{"
+  echo "  \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+  echo "  \"commit\": \"$(git rev-parse --short HEAD 2>/dev/null || echo unknown)\","
+  echo "  \"runs\": $RUNS,"
+  echo "  \"warmup\": $WARMUP,"
+  echo "  \"results\": ["
+  for ((i = 0; i < ${#RESULTS[@]}; i++)); do
+    if [ $i -lt $((${#RESULTS[@]} - 1)) ]; then
+      echo "${RESULTS[$i]},"
+    else
+      echo "${RESULTS[$i]}"
+    fi
+  done
+  echo "  ]"
+  echo "}"
+}
+
+if [ -n "$OUTPUT" ]; then
+  json > "$OUTPUT"
+fi
+
+# Compare against the baseline
+REGRESSED=0
+if [ -f "$BASELINE" ] && [ $UPDATE_BASELINE -eq 0 ]; then
+  echo "----"
+  echo "Compared to $BASELINE (time relative to cc -O0, threshold $THRESHOLD%):"
+  for FILE in "${PROGRAMS[@]}"; do
+    BASE_MINE=$(baseline_median "$FILE" my-compiler)
+    BASE_REF=$(baseline_median "$FILE" cc-O0)
+    if [ -z "$BASE_MINE" ] || [ -z "$BASE_REF" ]; then
+      echo "$FILE: not in the baseline"
+      continue
+    fi
+    if ! awk -v mine="${MEDIANS[$FILE/my-compiler]}" -v ref="${MEDIANS[$FILE/cc-O0]}" \
+        -v base_mine="$BASE_MINE" -v base_ref="$BASE_REF" -v threshold="$THRESHOLD" -v file="$FILE" '
+      BEGIN {
+        now = mine / ref
+        base = base_mine / base_ref
+        change = (now / base - 1) * 100
+        status = change > threshold ? "REGRESSION" : "ok"
+        printf "%s: %.3fx -> %.3fx of cc -O0 (%+.1f%%) %s\n", file, base, now, change, status
+        exit change > threshold
+      }'; then
+      REGRESSED=1
+    fi
+  done
+fi
+
+if [ $UPDATE_BASELINE -eq 1 ]; then
+  json > "$BASELINE"
+  echo "Updated $BASELINE"
+fi
 
+if [ $REGRESSED -eq 1 ]; then
+  echo "Tests bench FAILED: regression exceeds $THRESHOLD%"
+  exit 1
+fi
 echo "Tests bench OK"
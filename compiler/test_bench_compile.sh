@@ -0,0 +1,233 @@
+#!/bin/bash
+
+# Compile-throughput scaling benchmark.
+# Generates synthetic programs growing along a single axis at a time (functions, locals per function,
+# expression depth, initializer size, typedefs), compiles each RUNS times, and reports the median compile time
+# and the peak RSS against the size.
+# The growth exponent of each axis is estimated from the smallest and the largest size on a log-log scale
+# (1 for linear, 2 for quadratic), and the script exits with 1 if any axis grows faster than the threshold.
+
+set -eu
+
+usage() {
+  cat <<USAGE
+usage: $0 [-n runs] [-s steps] [-o result.json] [-t threshold] [-k] [axis ...]
+  -n runs       measured compilations per size (default: $RUNS)
+  -s steps      sizes per axis, each doubling the previous one (default: $STEPS)
+  -o file       write the result in JSON to the file
+  -t threshold  maximum growth exponent allowed (default: $THRESHOLD)
+  -k            keep the generated programs in $WORK_DIR
+  axis          axes to run (default: ${ALL_AXES[*]})
+USAGE
+}
+
+RUNS=3
+STEPS=4
+OUTPUT=""
+THRESHOLD=1.5
+KEEP=0
+WORK_DIR="tmp_bench_compile"
+ALL_AXES=(functions locals depth initializer typedefs)
+AXES=("${ALL_AXES[@]}")
+
+# Smallest size of each axis, large enough for the compilation to dominate the start of the process
+declare -A BASE_SIZE=(
+  [functions]=1000
+  [locals]=4000
+  [depth]=1000
+  [initializer]=20000
+  [typedefs]=8000
+)
+
+while getopts "n:s:o:t:kh" opt; do
+  case "$opt" in
+    n) RUNS="$OPTARG" ;;
+    s) STEPS="$OPTARG" ;;
+    o) OUTPUT="$OPTARG" ;;
+    t) THRESHOLD="$OPTARG" ;;
+    k) KEEP=1 ;;
+    h) usage; exit 0 ;;
+    *) usage; exit 2 ;;
+  esac
+done
+shift $((OPTIND - 1))
+if [ $# -gt 0 ]; then
+  AXES=("$@")
+fi
+for AXIS in "${AXES[@]}"; do
+  if [ -z "${BASE_SIZE[$AXIS]:-}" ]; then
+    echo "unknown axis: $AXIS" >&2
+    usage
+    exit 2
+  fi
+done
+if [ "$STEPS" -lt 2 ]; then
+  echo "at least 2 steps are needed to estimate the growth" >&2
+  exit 2
+fi
+
+# generate AXIS SIZE: prints a program of the given size along the axis
+generate() {
+  awk -v axis="$1" -v n="$2" '
+    BEGIN {
+      if (axis == "functions") {
+        # many small functions calling the previous one
+        print "int f0(int x) { return x; }"
+        for (i = 1; i < n; i++) {
+          printf "int f%d(int x) { int y = x * %d; if (y > 100) return f%d(y - 1); return y + %d; }\n", i, i % 7 + 1, i - 1, i
+        }
+        printf "int main() { return f%d(1); }\n", n - 1
+      } else if (axis == "locals") {
+        # a single function with many locals, each looked up by the later ones
+        print "int main() {"
+        print "    int v0 = 1;"
+        for (i = 1; i < n; i++) {
+          printf "    int v%d = v%d + %d;\n", i, i - 1, i % 10
+        }
+        printf "    return v%d;\n", n - 1
+        print "}"
+      } else if (axis == "depth") {
+        # deeply nested parenthesized expressions
+        printf "int main() {\n    int x = 1;\n    return "
+        for (i = 0; i < n; i++) printf "(x + "
+        printf "1"
+        for (i = 0; i < n; i++) printf ")"
+        print ";\n}"
+      } else if (axis == "initializer") {
+        # a large array initializer
+        printf "int table[%d] = {", n
+        for (i = 0; i < n; i++) {
+          printf "%s%d", (i == 0 ? "\n    " : i % 16 ? ", " : ",\n    "), i % 1000
+        }
+        print "\n};"
+        print "int main() { return table[0]; }"
+      } else if (axis == "typedefs") {
+        # many typedefs, each defined in terms of the previous one
+        print "typedef int t0;"
+        for (i = 1; i < n; i++) {
+          printf "typedef t%d t%d;\n", i - 1, i
+        }
+        for (i = 0; i < n; i += 16) {
+          printf "t%d g%d;\n", i, i
+        }
+        printf "int main() { t%d x = 0; return x; }\n", n - 1
+      }
+    }'
+}
+
+# measure FILE: compiles the file RUNS times, and prints the wall time in nanoseconds and the peak RSS in KB of each run
+measure() {
+  for ((i = 0; i < RUNS; i++)); do
+    START=$(date +%s%N)
+    if ! ./main -ftime-report "$1" > /dev/null 2> "$WORK_DIR/report"; then
+      echo "failed to compile $1:" >&2
+      cat "$WORK_DIR/report" >&2
+      return 1
+    fi
+    END=$(date +%s%N)
+    RSS=$(sed -nE 's/.*peak RSS: ([0-9]+) KB.*/\1/p' "$WORK_DIR/report")
+    echo "$((END - START)) ${RSS:-0}"
+  done
+}
+
+# stats: reads "nanoseconds KB" lines from stdin, and prints "median_ms max_rss_kb", or nothing if no lines
+stats() {
+  sort -n | awk '
+    { t[NR] = $1 / 1e6; if ($2 > rss) rss = $2 }
+    END {
+      if (NR == 0) exit
+      median = NR % 2 ? t[(NR + 1) / 2] : (t[NR / 2] + t[NR / 2 + 1]) / 2
+      printf "%.3f %d\n", median, rss
+    }'
+}
+
+mkdir -p "$WORK_DIR"
+RESULTS=()
+GROWTHS=()
+SUPERLINEAR=0
+
+printf "%-12s %10s %12s %14s %12s\n" axis size "median (ms)" "peak RSS (KB)" "us / unit"
+for AXIS in "${AXES[@]}"; do
+  SIZE=${BASE_SIZE[$AXIS]}
+  FIRST=""
+  LAST=""
+  for ((step = 0; step < STEPS; step++)); do
+    FILE="$WORK_DIR/$AXIS-$SIZE.c"
+    generate "$AXIS" "$SIZE" > "$FILE"
+    MEDIAN=""
+    read -r MEDIAN RSS < <(measure "$FILE" | stats) || true
+    if [ -z "$MEDIAN" ]; then
+      echo "Tests bench-compile FAILED: the generated program of $AXIS $SIZE does not compile"
+      exit 1
+    fi
+    printf "%-12s %10d %12s %14d %12.3f\n" "$AXIS" "$SIZE" "$MEDIAN" "$RSS" "$(awk -v t="$MEDIAN" -v n="$SIZE" 'BEGIN { print t * 1000 / n }')"
+    RESULTS+=("    {\"axis\": \"$AXIS\", \"size\": $SIZE, \"median_ms\": $MEDIAN, \"peak_rss_kb\": $RSS}")
+    if [ -z "$FIRST" ]; then
+      FIRST="$SIZE $MEDIAN $RSS"
+    fi
+    LAST="$SIZE $MEDIAN $RSS"
+    SIZE=$((SIZE * 2))
+  done
+
+  # exponent of the growth between the smallest and the largest size: time ~ size^exponent
+  read -r TIME_EXP RSS_EXP STATUS < <(awk -v first="$FIRST" -v last="$LAST" -v threshold="$THRESHOLD" '
+    BEGIN {
+      split(first, a, " ")
+      split(last, b, " ")
+      scale = log(b[1] / a[1])
+      time_exp = a[2] > 0 ? log(b[2] / a[2]) / scale : 0
+      rss_exp = a[3] > 0 ? log(b[3] / a[3]) / scale : 0
+      status = (time_exp > threshold || rss_exp > threshold) ? "SUPERLINEAR" : "ok"
+      printf "%.2f %.2f %s\n", time_exp, rss_exp, status
+    }')
+  echo "$AXIS: time ~ size^$TIME_EXP, peak RSS ~ size^$RSS_EXP $STATUS"
+  GROWTHS+=("    {\"axis\": \"$AXIS\", \"time_exponent\": $TIME_EXP, \"rss_exponent\": $RSS_EXP}")
+  if [ "$STATUS" != ok ]; then
+    SUPERLINEAR=1
+  fi
+done
+
+# json_array NAME ELEMENT...: prints the elements as a JSON array, one per line
+json_array() {
+  local name="$1"
+  shift
+  echo "  \"$name\": ["
+  local count=$#
+  local i=0
+  for element in "$@"; do
+    i=$((i + 1))
+    if [ $i -lt $count ]; then
+      echo "$element,"
+    else
+      echo "$element"
+    fi
+  done
+  echo -n "  ]"
+}
+
+# JSON, one result per line
+json() {
+  echo "{"
+  echo "  \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+  echo "  \"commit\": \"$(git rev-parse --short HEAD 2>/dev/null || echo unknown)\","
+  echo "  \"runs\": $RUNS,"
+  echo "  \"threshold\": $THRESHOLD,"
+  json_array results "${RESULTS[@]}"
+  echo ","
+  json_array growth "${GROWTHS[@]}"
+  echo
+  echo "}"
+}
+
+if [ -n "$OUTPUT" ]; then
+  json > "$OUTPUT"
+fi
+if [ $KEEP -eq 0 ]; then
+  rm -rf "$WORK_DIR"
+fi
+
+if [ $SUPERLINEAR -eq 1 ]; then
+  echo "Tests bench-compile FAILED: growth exponent exceeds $THRESHOLD"
+  exit 1
+fi
+echo "Tests bench-compile OK"
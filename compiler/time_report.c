@@ -0,0 +1,244 @@
+#include "main.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// A function taking more than this many times of the median is reported as an outlier
+#define OUTLIER_RATIO 10
+// and also taking longer than this (in seconds), not to report noise in tiny functions
+#define OUTLIER_MIN_TIME 0.0001
+// Number of the slowest functions to report
+#define SLOWEST_FUNCTIONS 10
+
+// Print out compile time report to stderr (-ftime-report)
+bool time_report;
+
+// Number of AST nodes visited by the passes and codegen on the current thread, for -ftime-report
+_Thread_local long nodes_visited;
+
+char phase_names[NUM_PHASES][24] = {
+    "read file",
+    "precompiled header",
+    "preprocess",
+    "tokenize + parse",
+    "sema: type check",
+    "pass: profile counters",
+    "pass: if-conversion",
+    "codegen",
+};
+
+char phase_units[NUM_PHASES][8] = {
+    "bytes",
+    "bytes",
+    "tokens",
+    "nodes",
+    "nodes",
+    "nodes",
+    "nodes",
+    "nodes",
+};
+
+typedef struct PhaseTime {
+    double wall;
+    double cpu;
+    long items;
+    long allocations;
+    long bytes;
+} PhaseTime;
+
+// Accumulated over all the threads
+PhaseTime phases[NUM_PHASES];
+// Time at phase_begin on the current thread
+_Thread_local PhaseTime phase_starts[NUM_PHASES];
+
+// Guards the statistics shared by the codegen threads
+pthread_mutex_t time_report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct FunctionTime {
+    char *name;
+    int len;
+    // wall time in seconds of each phase
+    double wall[NUM_PHASES];
+    double total;
+} FunctionTime;
+
+// Time spent in each function, in the order of the definition, elements: FunctionTime*
+Vector *function_times;
+
+// Function currently measured on the current thread
+_Thread_local FunctionTime *timed_function;
+
+// Largest size of the function arena, recorded by account_function_arena
+long function_arena_max_reserved;
+// Statistics of the function arenas of the finished codegen threads
+long thread_function_allocations;
+long thread_function_bytes;
+
+// Wall time of generating the functions on the codegen threads, 0 if not in parallel
+double parallel_codegen_wall;
+
+// read_clock returns the time in seconds of the given clock.
+double read_clock(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// wall_clock returns the monotonic wall clock time in seconds.
+double wall_clock() {
+    return read_clock(CLOCK_MONOTONIC);
+}
+
+// phase_begin starts measuring the given phase.
+void phase_begin(Phase phase) {
+    if (!time_report) return;
+    PhaseTime *start = &phase_starts[phase];
+    start->wall = wall_clock();
+    start->cpu = read_clock(CLOCK_THREAD_CPUTIME_ID);
+    start->allocations = allocation_count;
+    start->bytes = allocation_bytes;
+}
+
+// phase_end stops measuring the given phase, and accounts the number of items (tokens, nodes, ...) processed.
+// Returns the wall time in seconds since phase_begin.
+double phase_end(Phase phase, long items) {
+    if (!time_report) return 0;
+    PhaseTime *start = &phase_starts[phase];
+    double wall = wall_clock() - start->wall;
+    double cpu = read_clock(CLOCK_THREAD_CPUTIME_ID) - start->cpu;
+    pthread_mutex_lock(&time_report_lock);
+    PhaseTime *p = &phases[phase];
+    p->wall += wall;
+    p->cpu += cpu;
+    p->items += items;
+    p->allocations += allocation_count - start->allocations;
+    p->bytes += allocation_bytes - start->bytes;
+    pthread_mutex_unlock(&time_report_lock);
+    return wall;
+}
+
+// set_timed_function sets the index-th function (in the order of the definition) to account the time for
+// on the current thread. The codegen threads only take the functions already measured by sema.
+void set_timed_function(int index, char *name, int len) {
+    if (!time_report) return;
+    if (!function_times) {
+        function_times = new_vector();
+    }
+    while (vector_count(function_times) <= index) {
+        vector_add(function_times, allocate(sizeof(FunctionTime)));
+    }
+    timed_function = (FunctionTime*) vector_get(function_times, index);
+    timed_function->name = name;
+    timed_function->len = len;
+}
+
+// function_time accounts the wall time spent in the given phase for the current function.
+void function_time(Phase phase, double wall) {
+    if (!time_report) return;
+    timed_function->wall[phase] += wall;
+    timed_function->total += wall;
+}
+
+// account_function_arena records the largest size of the function arena before it is released.
+void account_function_arena() {
+    pthread_mutex_lock(&time_report_lock);
+    if (function_arena.reserved > function_arena_max_reserved) {
+        function_arena_max_reserved = function_arena.reserved;
+    }
+    pthread_mutex_unlock(&time_report_lock);
+}
+
+// account_thread_arena adds the statistics of the function arena of the current codegen thread, when it finishes.
+void account_thread_arena() {
+    pthread_mutex_lock(&time_report_lock);
+    thread_function_allocations += function_arena.allocations;
+    thread_function_bytes += function_arena.bytes;
+    pthread_mutex_unlock(&time_report_lock);
+}
+
+// compare_function_time orders FunctionTime* by the total time, descending.
+int compare_function_time(const void *a, const void *b) {
+    double first = (*(FunctionTime**) a)->total;
+    double second = (*(FunctionTime**) b)->total;
+    return first < second ? 1 : first > second ? -1 : 0;
+}
+
+// print_function_times prints out the slowest functions, and the outliers among them.
+void print_function_times() {
+    int count = vector_count(function_times);
+    if (count == 0) return;
+
+    FunctionTime **sorted = malloc(sizeof(FunctionTime*) * count);
+    for (int i = 0; i < count; i++) {
+        sorted[i] = (FunctionTime*) vector_get(function_times, i);
+    }
+    qsort(sorted, count, sizeof(FunctionTime*), compare_function_time);
+    double median = sorted[count / 2]->total;
+
+    fprintf(stderr, "\n  %d functions, median %.3f ms. Slowest functions:\n", count, median * 1e3);
+    fprintf(stderr, "  %-32s %10s %10s %10s %10s\n", "function", "parse", "passes", "codegen", "total (ms)");
+    for (int i = 0; i < count && i < SLOWEST_FUNCTIONS; i++) {
+        FunctionTime *f = sorted[i];
+        double passes = f->wall[PHASE_SEMA] + f->wall[PHASE_PROFILE] + f->wall[PHASE_IF_CONVERSION];
+        bool outlier = f->total > median * OUTLIER_RATIO && f->total > OUTLIER_MIN_TIME;
+        fprintf(stderr, "  %-32.*s %10.3f %10.3f %10.3f %10.3f%s\n", f->len, f->name,
+                f->wall[PHASE_PARSE] * 1e3, passes * 1e3, f->wall[PHASE_CODEGEN] * 1e3, f->total * 1e3,
+                outlier ? "  <- outlier" : "");
+    }
+    free(sorted);
+}
+
+// print_time_report prints out the time report to stderr.
+void print_time_report() {
+    if (!time_report) return;
+
+    fprintf(stderr, "Compile time report:\n");
+    fprintf(stderr, "  %-24s %10s %10s %12s %-6s %10s %12s\n",
+            "phase", "wall (ms)", "cpu (ms)", "items", "", "allocs", "alloc bytes");
+    PhaseTime total = {0};
+    for (int i = 0; i < NUM_PHASES; i++) {
+        PhaseTime *p = &phases[i];
+        fprintf(stderr, "  %-24s %10.3f %10.3f %12ld %-6s %10ld %12ld\n", phase_names[i],
+                p->wall * 1e3, p->cpu * 1e3, p->items, phase_units[i], p->allocations, p->bytes);
+        total.wall += p->wall;
+        total.cpu += p->cpu;
+        total.allocations += p->allocations;
+        total.bytes += p->bytes;
+    }
+    fprintf(stderr, "  %-24s %10.3f %10.3f %12s %-6s %10ld %12ld\n", "total",
+            total.wall * 1e3, total.cpu * 1e3, "", "", total.allocations, total.bytes);
+    if (parallel_codegen_wall > 0) {
+        fprintf(stderr, "  passes + codegen on %d threads: %.3f ms elapsed\n", codegen_threads, parallel_codegen_wall * 1e3);
+    }
+    if (headers_read > 0) {
+        fprintf(stderr, "  headers: %d read, %d #include(s) skipped by the include guards\n", headers_read, headers_skipped);
+    }
+    if (code_cache) {
+        fprintf(stderr, "  code cache: %d hit(s), %d miss(es), %d evicted\n",
+                code_cache_hits, code_cache_misses, code_cache_evictions);
+    }
+    if (phases[PHASE_PARSE].wall > 0) {
+        fprintf(stderr, "  front end throughput: %.1f MB/s, %ld tokens\n",
+                phases[PHASE_READ].items / phases[PHASE_PARSE].wall / 1e6, (long) token_count);
+    }
+
+    fprintf(stderr, "\n  %-24s %10s %12s %12s\n", "arena", "allocs", "bytes", "reserved");
+    fprintf(stderr, "  %-24s %10ld %12ld %12ld\n", "permanent",
+            permanent_arena.allocations, permanent_arena.bytes, permanent_arena.reserved);
+    fprintf(stderr, "  %-24s %10ld %12ld %12s\n", "scopes (per function)",
+            scope_arena.allocations, scope_arena.bytes, "released");
+    fprintf(stderr, "  %-24s %10ld %12ld %12ld\n", "codegen (per function)",
+            function_arena.allocations + thread_function_allocations, function_arena.bytes + thread_function_bytes,
+            function_arena_max_reserved);
+    fprintf(stderr, "  peak arena memory: %.1f MB\n", arena_peak_bytes / 1e6);
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        fprintf(stderr, "  peak RSS: %ld KB\n", usage.ru_maxrss);
+    }
+
+    print_function_times();
+}
@@ -0,0 +1 @@
+.intel_syntax noprefix